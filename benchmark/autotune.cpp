@@ -0,0 +1,185 @@
+/*
+ * autotune.cpp  -- Measure the best allgatherv and gatherv algorithms
+ *
+ * Run as `mpirun -np N unsafe_mpi_autotune [-o table] [-b max_bytes]
+ * [-i iterations]` on the machine to tune for. Times every algorithm of
+ * tuning.h for communicators of 3, 4, 8, ... PEs up to N, several total sizes
+ * up to max_bytes, and balanced as well as imbalanced inputs. Writes one CSV
+ * line per measurement to stdout, and the fastest algorithm per point to the
+ * tuning table (unsafe_mpi_tuning.txt by default). Point UNSAFE_MPI_TUNING to
+ * it to use it.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+namespace mpi = boost::mpi;
+
+struct config {
+    std::string output = "unsafe_mpi_tuning.txt";
+    uint64_t max_bytes = uint64_t(1) << 24;
+    int iterations = 10;
+    int warmup = 2;
+};
+
+// Average time per call of `f`, maximum over all PEs
+double measure(const mpi::communicator &comm, const config &conf, const std::function<int()> &f) {
+    for (int i = 0; i < conf.warmup; ++i) f();
+    comm.barrier();
+    const double start = MPI_Wtime();
+    for (int i = 0; i < conf.iterations; ++i) {
+        if (f() != 0) ERR << "autotune: algorithm failed" << std::endl;
+    }
+    const double local = (MPI_Wtime() - start) / conf.iterations;
+    double result;
+    mpi::all_reduce(comm, local, result, mpi::maximum<double>());
+    return result;
+}
+
+// Split `total` elements so that the largest share, PE 0's, is `imbalance`
+// times the average
+std::vector<uint64_t> make_sizes(size_t p, uint64_t total, double imbalance) {
+    std::vector<uint64_t> sizes(p, 0);
+    if (imbalance >= static_cast<double>(p)) {
+        sizes[0] = total;
+        return sizes;
+    }
+    const double factor = imbalance * (p - 1) / (p - imbalance);
+    const uint64_t others = static_cast<uint64_t>(total / (factor + p - 1));
+    for (size_t i = 1; i < p; ++i) sizes[i] = others;
+    sizes[0] = total - others * (p - 1);
+    return sizes;
+}
+
+void report(const mpi::communicator &comm, const char *op, const char *algorithm,
+            uint64_t bytes, double imbalance, double seconds) {
+    if (comm.rank() != 0) return;
+    std::cout << op << ',' << algorithm << ',' << comm.size() << ',' << bytes << ','
+              << imbalance << ',' << std::fixed << std::setprecision(3) << seconds * 1e6
+              << std::defaultfloat << std::endl;
+}
+
+void tune(const mpi::communicator &comm, const config &conf, unsafe_mpi::tuning_table &table) {
+    typedef uint64_t T;
+    const size_t p = static_cast<size_t>(comm.size()), rank = static_cast<size_t>(comm.rank());
+    const MPI_Datatype datatype = unsafe_mpi::transmit_datatype<T>();
+    // Balanced, somewhat imbalanced, and all data on one PE
+    std::vector<double> imbalances = { 1.0, static_cast<double>(p) };
+    if (p > 4) imbalances.insert(imbalances.begin() + 1, 4.0);
+
+    for (uint64_t bytes = 1024; bytes <= conf.max_bytes; bytes *= 16) {
+        for (double imbalance : imbalances) {
+            const std::vector<uint64_t> sizes = make_sizes(p, bytes / sizeof(T), imbalance);
+            unsafe_mpi::workspace ws;
+            ws.sizes64 = sizes;
+            ws.displacements64.assign(p + 1, 0);
+            for (size_t i = 0; i < p; ++i) {
+                ws.displacements64[i+1] = ws.displacements64[i] + sizes[i];
+            }
+            const std::vector<T> in(sizes[rank], rank);
+            std::vector<T> out(ws.displacements64.back());
+
+            double best = 0;
+            unsafe_mpi::allgatherv_algorithm best_allgatherv = unsafe_mpi::allgatherv_algorithm::native;
+            for (auto algorithm : { unsafe_mpi::allgatherv_algorithm::native,
+                                    unsafe_mpi::allgatherv_algorithm::ring,
+                                    unsafe_mpi::allgatherv_algorithm::bruck,
+                                    unsafe_mpi::allgatherv_algorithm::gather_broadcast }) {
+                const double t = measure(comm, conf, [&]() {
+                        return unsafe_mpi::allgatherv_sized(comm, in.data(), in.size(), out.data(),
+                                                            datatype, ws, algorithm);
+                    });
+                report(comm, "allgatherv", unsafe_mpi::name(algorithm), bytes, imbalance, t);
+                if (algorithm == unsafe_mpi::allgatherv_algorithm::native || t < best) {
+                    best = t;
+                    best_allgatherv = algorithm;
+                }
+            }
+            table.allgatherv.push_back({ p, bytes, imbalance, static_cast<int>(best_allgatherv) });
+
+            unsafe_mpi::gatherv_algorithm best_gatherv = unsafe_mpi::gatherv_algorithm::native;
+            for (auto algorithm : { unsafe_mpi::gatherv_algorithm::native,
+                                    unsafe_mpi::gatherv_algorithm::tree }) {
+                const double t = measure(comm, conf, [&]() {
+                        return unsafe_mpi::gatherv_sized(comm, in.data(), in.size(), out.data(),
+                                                         datatype, 0, ws, algorithm);
+                    });
+                report(comm, "gatherv", unsafe_mpi::name(algorithm), bytes, imbalance, t);
+                if (algorithm == unsafe_mpi::gatherv_algorithm::native || t < best) {
+                    best = t;
+                    best_gatherv = algorithm;
+                }
+            }
+            table.gatherv.push_back({ p, bytes, imbalance, static_cast<int>(best_gatherv) });
+        }
+    }
+}
+
+config parse_args(int argc, char **argv) {
+    config conf;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-o") == 0) {
+            conf.output = argv[i+1];
+        } else if (strcmp(argv[i], "-b") == 0) {
+            conf.max_bytes = std::strtoull(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            conf.iterations = std::atoi(argv[i+1]);
+        }
+    }
+    return conf;
+}
+
+}
+
+int main(int argc, char **argv) {
+    mpi::environment env(argc, argv);
+    mpi::communicator world;
+    const config conf = parse_args(argc, argv);
+
+    if (world.rank() == 0) {
+        std::cout << "operation,algorithm,ranks,bytes,imbalance,latency_us" << std::endl;
+    }
+
+    // Communicators of 3 PEs and powers of two up to the full size; with
+    // fewer PEs, MPI's own algorithms are always used
+    std::vector<int> comm_sizes;
+    if (world.size() >= 3) comm_sizes.push_back(3);
+    for (int ranks = 4; ranks < world.size(); ranks *= 2) {
+        comm_sizes.push_back(ranks);
+    }
+    if (world.size() > 3) comm_sizes.push_back(world.size());
+
+    unsafe_mpi::tuning_table table;
+    for (int ranks : comm_sizes) {
+        const bool member = world.rank() < ranks;
+        mpi::communicator comm = world.split(member ? 0 : 1);
+        if (member) tune(comm, conf, table);
+        world.barrier();
+    }
+
+    if (world.rank() == 0) {
+        if (table.save(conf.output)) {
+            std::cerr << "Wrote tuning table to " << conf.output << std::endl;
+        } else {
+            ERR << "Could not write tuning table to " << conf.output << std::endl;
+        }
+    }
+}
@@ -0,0 +1,258 @@
+/*
+ * benchmark.cpp  -- Compare unsafe_mpi against plain Boost.MPI
+ *
+ * Run as `mpirun -np N unsafe_mpi_benchmark [-n max_elements] [-i iterations]`
+ * Measures allgatherv, gatherv, broadcast and send/recv for several element
+ * types, message sizes and communicator sizes (powers of two up to N, and N),
+ * and writes one CSV line per measurement to stdout.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/collectives/all_gatherv.hpp>
+#include <boost/mpi/collectives/gatherv.hpp>
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+namespace mpi = boost::mpi;
+
+struct config {
+    size_t max_elements = 1 << 16;
+    int iterations = 20;
+    int warmup = 2;
+};
+
+// Element generators and payload sizes for the benchmarked types
+template <typename T> struct element;
+
+template <> struct element<uint64_t> {
+    static const char* name() { return "uint64"; }
+    static uint64_t make(size_t i, int rank) { return i * 31 + static_cast<uint64_t>(rank); }
+    static size_t bytes(const uint64_t &) { return sizeof(uint64_t); }
+};
+
+template <> struct element<std::pair<int, int>> {
+    static const char* name() { return "pair<int,int>"; }
+    static std::pair<int, int> make(size_t i, int rank) {
+        return std::make_pair(static_cast<int>(i), rank);
+    }
+    static size_t bytes(const std::pair<int, int> &) { return sizeof(std::pair<int, int>); }
+};
+
+template <> struct element<std::tuple<int, double>> {
+    static const char* name() { return "tuple<int,double>"; }
+    static std::tuple<int, double> make(size_t i, int rank) {
+        return std::make_tuple(rank, static_cast<double>(i));
+    }
+    static size_t bytes(const std::tuple<int, double> &) { return sizeof(int) + sizeof(double); }
+};
+
+template <> struct element<std::string> {
+    static const char* name() { return "string"; }
+    static std::string make(size_t i, int rank) {
+        return std::string(8 + (i + static_cast<size_t>(rank)) % 17, static_cast<char>('a' + i % 26));
+    }
+    static size_t bytes(const std::string &s) { return s.size(); }
+};
+
+template <> struct element<std::vector<int>> {
+    static const char* name() { return "vector<int>"; }
+    static std::vector<int> make(size_t i, int rank) {
+        return std::vector<int>(1 + (i + static_cast<size_t>(rank)) % 8, rank);
+    }
+    static size_t bytes(const std::vector<int> &v) { return v.size() * sizeof(int); }
+};
+
+template <typename T>
+std::vector<T> make_data(size_t n, int rank) {
+    std::vector<T> data;
+    data.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        data.push_back(element<T>::make(i, rank));
+    }
+    return data;
+}
+
+template <typename T>
+size_t payload_bytes(const std::vector<T> &data) {
+    size_t bytes = 0;
+    for (const T &elem : data) bytes += element<T>::bytes(elem);
+    return bytes;
+}
+
+// Average time per call of `f`, maximum over all PEs
+double measure(const mpi::communicator &comm, const config &conf, const std::function<void()> &f) {
+    for (int i = 0; i < conf.warmup; ++i) f();
+    comm.barrier();
+    const double start = MPI_Wtime();
+    for (int i = 0; i < conf.iterations; ++i) f();
+    const double local = (MPI_Wtime() - start) / conf.iterations;
+    double result;
+    mpi::all_reduce(comm, local, result, mpi::maximum<double>());
+    return result;
+}
+
+void print_header() {
+    std::cout << "operation,type,implementation,ranks,elements_per_rank,bytes_per_rank,"
+              << "iterations,latency_us,bandwidth_mb_s" << std::endl;
+}
+
+// `bytes` is the payload moved by one call, used for the bandwidth
+void report(const mpi::communicator &comm, const config &conf, const char *op,
+            const char *type, const char *impl, size_t elements,
+            size_t bytes_per_rank, size_t bytes, double seconds) {
+    if (comm.rank() != 0) return;
+    std::cout << op << ',' << type << ',' << impl << ',' << comm.size() << ','
+              << elements << ',' << bytes_per_rank << ',' << conf.iterations << ','
+              << std::fixed << std::setprecision(3) << seconds * 1e6 << ','
+              << (seconds > 0 ? bytes / seconds / 1e6 : 0.0)
+              << std::defaultfloat << std::endl;
+}
+
+// Boost.MPI equivalents of the unsafe_mpi operations
+template <typename T>
+void boost_allgatherv(const mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+    std::vector<int> sizes;
+    mpi::all_gather(comm, static_cast<int>(in.size()), sizes);
+    mpi::all_gatherv(comm, in, out, sizes);
+}
+
+template <typename T>
+void boost_gatherv(const mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out, int root) {
+    const int size = static_cast<int>(in.size());
+    if (comm.rank() == root) {
+        std::vector<int> sizes;
+        mpi::gather(comm, size, sizes, root);
+        out.resize(static_cast<size_t>(std::accumulate(sizes.begin(), sizes.end(), 0)));
+        mpi::gatherv(comm, in, out.data(), sizes, root);
+    } else {
+        mpi::gather(comm, size, root);
+        mpi::gatherv(comm, in, root);
+    }
+}
+
+template <typename T>
+void bench_type(const mpi::communicator &comm, const config &conf) {
+    const char *type = element<T>::name();
+    const int rank = comm.rank(), size = comm.size();
+    // Pairwise exchange partner for send/recv, the last PE idles if size is odd
+    const int partner = rank ^ 1;
+
+    for (size_t n = 1; n <= conf.max_elements; n *= 16) {
+        const std::vector<T> in = make_data<T>(n, rank);
+        const size_t bytes = payload_bytes(in);
+        std::vector<T> out;
+        double t;
+
+        // allgatherv
+        t = measure(comm, conf, [&]() { out.clear(); unsafe_mpi::allgatherv(comm, in, out); });
+        report(comm, conf, "allgatherv", type, "unsafe_mpi", n, bytes, bytes * size, t);
+        t = measure(comm, conf, [&]() { out.clear(); boost_allgatherv(comm, in, out); });
+        report(comm, conf, "allgatherv", type, "boost", n, bytes, bytes * size, t);
+
+        // gatherv
+        t = measure(comm, conf, [&]() { out.clear(); unsafe_mpi::gatherv(comm, in, out, 0); });
+        report(comm, conf, "gatherv", type, "unsafe_mpi", n, bytes, bytes * size, t);
+        t = measure(comm, conf, [&]() { out.clear(); boost_gatherv(comm, in, out, 0); });
+        report(comm, conf, "gatherv", type, "boost", n, bytes, bytes * size, t);
+
+        // broadcast
+        t = measure(comm, conf, [&]() {
+                out = (rank == 0) ? in : std::vector<T>();
+                unsafe_mpi::broadcast(comm, out, 0);
+            });
+        report(comm, conf, "broadcast", type, "unsafe_mpi", n, bytes, bytes, t);
+        t = measure(comm, conf, [&]() {
+                out = (rank == 0) ? in : std::vector<T>();
+                mpi::broadcast(comm, out, 0);
+            });
+        report(comm, conf, "broadcast", type, "boost", n, bytes, bytes, t);
+
+        // send/recv ping-pong between pairs of PEs
+        if (size < 2) continue;
+        auto pingpong = [&](const std::function<void()> &send, const std::function<void()> &recv) {
+            if (partner >= size) return;
+            if (rank % 2 == 0) { send(); recv(); }
+            else               { recv(); send(); }
+        };
+        t = measure(comm, conf, [&]() {
+                pingpong([&]() { unsafe_mpi::send(comm, partner, 0, in); },
+                         [&]() { unsafe_mpi::recv(comm, partner, 0, out); });
+            });
+        report(comm, conf, "sendrecv", type, "unsafe_mpi", n, bytes, 2 * bytes, t);
+        t = measure(comm, conf, [&]() {
+                pingpong([&]() { unsafe_mpi::send(comm, partner, 0, in, unsafe_mpi::protocol::probe); },
+                         [&]() { unsafe_mpi::recv(comm, partner, 0, out, unsafe_mpi::protocol::probe); });
+            });
+        report(comm, conf, "sendrecv", type, "unsafe_mpi_probe", n, bytes, 2 * bytes, t);
+        t = measure(comm, conf, [&]() {
+                pingpong([&]() { comm.send(partner, 0, in); },
+                         [&]() { comm.recv(partner, 0, out); });
+            });
+        report(comm, conf, "sendrecv", type, "boost", n, bytes, 2 * bytes, t);
+    }
+}
+
+config parse_args(int argc, char **argv) {
+    config conf;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            conf.max_elements = std::strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            conf.iterations = std::atoi(argv[i+1]);
+        }
+    }
+    return conf;
+}
+
+}
+
+int main(int argc, char **argv) {
+    mpi::environment env(argc, argv);
+    mpi::communicator world;
+    const config conf = parse_args(argc, argv);
+
+    if (world.rank() == 0) print_header();
+
+    // Sweep communicator sizes: powers of two, and the full communicator
+    std::vector<int> comm_sizes;
+    for (int ranks = 1; ranks < world.size(); ranks *= 2) {
+        comm_sizes.push_back(ranks);
+    }
+    comm_sizes.push_back(world.size());
+
+    for (int ranks : comm_sizes) {
+        const bool member = world.rank() < ranks;
+        mpi::communicator comm = world.split(member ? 0 : 1);
+        if (member) {
+            bench_type<uint64_t>(comm, conf);
+            bench_type<std::pair<int, int>>(comm, conf);
+            bench_type<std::tuple<int, double>>(comm, conf);
+            bench_type<std::string>(comm, conf);
+            bench_type<std::vector<int>>(comm, conf);
+        }
+        world.barrier();
+    }
+}
@@ -0,0 +1,139 @@
+/*
+ * sort_benchmark.cpp  -- Throughput of the distributed sample sort
+ *
+ * Run as `mpirun -np N unsafe_mpi_sort_benchmark [-n keys_per_rank]
+ * [-i iterations] [-t threads]`. Sorts uniformly distributed, skewed and
+ * all-equal keys and writes one CSV line per measurement to stdout, with the
+ * throughput in keys per second over all PEs.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+namespace mpi = boost::mpi;
+
+struct config {
+    size_t keys = 1 << 20;
+    int iterations = 5;
+    size_t threads = 1;
+};
+
+enum class distribution { uniform, skewed, equal };
+
+const char* name(distribution dist) {
+    switch (dist) {
+    case distribution::uniform: return "uniform";
+    case distribution::skewed: return "skewed";
+    default: return "equal";
+    }
+}
+
+// Skewed keys: a few very frequent values, and PE 0 holds twice the data
+uint64_t make_key(std::mt19937_64 &gen, distribution dist) {
+    switch (dist) {
+    case distribution::uniform: return gen();
+    case distribution::skewed: return (gen() % 4 == 0) ? gen() : gen() % 16;
+    default: return 42;
+    }
+}
+
+template <typename T> struct element;
+
+template <> struct element<uint64_t> {
+    static const char* name() { return "uint64"; }
+    static uint64_t make(uint64_t key, size_t) { return key; }
+};
+
+template <> struct element<std::pair<uint64_t, uint64_t>> {
+    static const char* name() { return "pair<uint64,uint64>"; }
+    static std::pair<uint64_t, uint64_t> make(uint64_t key, size_t i) {
+        return std::make_pair(key, static_cast<uint64_t>(i));
+    }
+};
+
+template <typename T>
+void bench(const mpi::communicator &comm, const config &conf, distribution dist) {
+    const int rank = comm.rank();
+    std::mt19937_64 gen(static_cast<uint64_t>(rank) * 7919 + 1);
+    const size_t n = (dist == distribution::skewed && rank == 0) ? 2 * conf.keys : conf.keys;
+    std::vector<T> input(n);
+    for (size_t i = 0; i < n; ++i) {
+        input[i] = element<T>::make(make_key(gen, dist), i);
+    }
+
+    unsafe_mpi::workspace ws;
+    std::vector<T> data;
+    double total = 0;
+    for (int it = 0; it < conf.iterations; ++it) {
+        data = input;
+        comm.barrier();
+        const double start = MPI_Wtime();
+        unsafe_mpi::sort(comm, data, std::less<T>(), ws, conf.threads);
+        const double local = MPI_Wtime() - start;
+        double seconds;
+        mpi::all_reduce(comm, local, seconds, mpi::maximum<double>());
+        total += seconds;
+    }
+
+    uint64_t keys = n, all_keys = 0, largest = 0, local_size = data.size();
+    mpi::all_reduce(comm, keys, all_keys, std::plus<uint64_t>());
+    mpi::all_reduce(comm, local_size, largest, mpi::maximum<uint64_t>());
+    if (rank != 0) return;
+    const double seconds = total / conf.iterations;
+    // Imbalance: largest output relative to a perfectly even split
+    const double imbalance = static_cast<double>(largest) * comm.size() / all_keys;
+    std::cout << name(dist) << ',' << element<T>::name() << ',' << comm.size() << ','
+              << conf.keys << ',' << conf.threads << ',' << conf.iterations << ','
+              << std::fixed << std::setprecision(6) << seconds << ','
+              << std::setprecision(0) << all_keys / seconds << ','
+              << std::setprecision(3) << imbalance << std::defaultfloat << std::endl;
+}
+
+config parse_args(int argc, char **argv) {
+    config conf;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            conf.keys = std::strtoul(argv[i+1], nullptr, 10);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            conf.iterations = std::atoi(argv[i+1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            conf.threads = std::strtoul(argv[i+1], nullptr, 10);
+        }
+    }
+    return conf;
+}
+
+}
+
+int main(int argc, char **argv) {
+    mpi::environment env(argc, argv);
+    mpi::communicator world;
+    const config conf = parse_args(argc, argv);
+
+    if (world.rank() == 0) {
+        std::cout << "distribution,type,ranks,keys_per_rank,threads,iterations,"
+                  << "seconds,keys_per_s,imbalance" << std::endl;
+    }
+    for (distribution dist : { distribution::uniform, distribution::skewed, distribution::equal }) {
+        bench<uint64_t>(world, conf, dist);
+        bench<std::pair<uint64_t, uint64_t>>(world, conf, dist);
+    }
+}
@@ -13,6 +13,7 @@
 #include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <numeric>
 #include <vector>
 
@@ -24,119 +25,613 @@
 #include <boost/serialization/string.hpp>
 #include <boost/serialization/vector.hpp>
 
+#include "archive.h"
+#include "codec.h"
 #include "common.h"
+#include "instrumentation.h"
+#include "large_count.h"
+#include "output.h"
+#include "packed.h"
+#include "private_comm.h"
+#include "request.h"
+#include "tuning.h"
 #include "tuple_serialization.h"
+#include "workspace.h"
 
 namespace unsafe_mpi {
 
 template <typename T>
-void allgatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+void allgatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                          std::vector<T> &out, workspace &ws) {
     const size_t comm_size = static_cast<size_t>(comm.size());
+    instrument::recorder rec(comm, instrument::operation::allgatherv);
+    rec.taken(is_ragged<T>::value ? instrument::path::ragged : instrument::path::serialized);
+
     // Step 1: serialize input data
-    boost::mpi::packed_oarchive oa(comm);
+    rec.enter(instrument::phase::serialize);
+    archive_buffer &send = ws.send_buffer;
     if (!in.empty())
-        oa << in;
+        pack_blocks(comm, in.data(), in.size(), send, ws.block_buffers);
 
-    // Step 2: exchange sizes (archives' .size() is measured in bytes)
+    // Step 2: exchange sizes (archives' .size() is measured in bytes), along
+    // with small archives or the first eager_limit bytes of large ones
+    rec.enter(instrument::phase::size_exchange);
     // Need to cast to int because this is what MPI uses as size_t...
-    const int in_size = static_cast<int>(in.size()),
-        transmit_size = (in.empty() ? 0 : static_cast<int>(oa.size()));
-    std::vector<int> in_sizes(comm_size), transmit_sizes(comm_size);
-    boost::mpi::all_gather(comm, in_size,       in_sizes.data());
-    boost::mpi::all_gather(comm, transmit_size, transmit_sizes.data());
+    eager_block block;
+    block.in_size = static_cast<int>(in.size());
+    block.transmit_size = (in.empty() ? 0 : static_cast<int>(send.size()));
+    if (block.inline_size() > 0)
+        memcpy(block.payload, send.data(), block.inline_size());
+    std::vector<eager_block> &blocks = ws.blocks;
+    blocks.resize(comm_size);
+    int status = MPI_Allgather(&block, sizeof(eager_block), MPI_BYTE,
+                               blocks.data(), sizeof(eager_block), MPI_BYTE, comm);
+    if (status != 0) {
+        ERR << "MPI_Allgather returned " << status << ", errno " << errno << std::endl;
+        return;
+    }
 
     // Step 3: calculate displacements from sizes (prefix sum)
-    std::vector<int> displacements(comm_size + 1);
-    displacements[0] = sizeof(boost::mpi::packed_iarchive);
-    for (size_t i = 1; i <= comm_size; ++i) {
-        displacements[i] = displacements[i-1] + transmit_sizes[i-1];
+    std::vector<int> &in_sizes = ws.sizes, &displacements = ws.displacements,
+        &rest_sizes = ws.rest_sizes, &rest_displacements = ws.rest_displacements;
+    in_sizes.resize(comm_size);
+    displacements.resize(comm_size + 1);
+    rest_sizes.resize(comm_size);
+    rest_displacements.resize(comm_size);
+    displacements[0] = 0;
+    bool need_rest = false;
+    for (size_t i = 0; i < comm_size; ++i) {
+        in_sizes[i] = blocks[i].in_size;
+        displacements[i+1] = displacements[i] + blocks[i].transmit_size;
+        rest_sizes[i] = blocks[i].rest_size();
+        rest_displacements[i] = displacements[i] + static_cast<int>(blocks[i].inline_size());
+        need_rest |= (rest_sizes[i] > 0);
     }
 
-    // Step 4: allocate space for result and MPI_Allgatherv
-    char* recv = new char[displacements.back()];
-    // If in.empty(), transmit_size is 0 so we don't really care
-    auto sendptr = const_cast<void*>(oa.address());
+    // Step 4: allocate space for result, copy inline parts of the archives and
+    // MPI_Allgatherv the rest of those that were too large
+    archive_buffer &recv = ws.recv_buffer;
+    recv.resize(static_cast<size_t>(displacements.back()));
+    for (size_t i = 0; i < comm_size; ++i) {
+        if (blocks[i].inline_size() > 0)
+            memcpy(recv.data() + displacements[i], blocks[i].payload, blocks[i].inline_size());
+    }
 
-    int status = MPI_Allgatherv(sendptr, transmit_size, MPI_PACKED, recv,
-                                transmit_sizes.data(), displacements.data(),
+    rec.sent(static_cast<size_t>(block.transmit_size));
+    rec.received(static_cast<size_t>(displacements.back()));
+    if (need_rest) {
+        rec.enter(instrument::phase::transfer);
+        // If in.empty(), transmit_size is 0 so we don't really care
+        auto sendptr = send.data() + block.inline_size();
+        status = MPI_Allgatherv(sendptr, block.rest_size(), MPI_PACKED, recv.data(),
+                                rest_sizes.data(), rest_displacements.data(),
                                 MPI_PACKED, comm);
 
-    if (status != 0) {
-        ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
-        return;
+        if (status != 0) {
+            ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
     }
 
     // Step 5: deserialize received data
-    // Preallocate storage to prevent reallocations
-    std::vector<T> temp;
-    const int largest_size = *std::max_element(in_sizes.begin(), in_sizes.end());
-    temp.reserve(static_cast<size_t>(largest_size));
-    out.reserve(static_cast<size_t>(
-                    std::accumulate(in_sizes.begin(), in_sizes.end(), 0)));
-
-    // Deserialize archives one by one, inserting elements at the end of ̀out̀
-    for (size_t i = 0; i < comm_size; ++i) {
-        if (in_sizes[i] == 0) {
-            // We can ignore processes which didn't have anything to send
-            continue;
+    rec.enter(instrument::phase::deserialize);
+    unpack_archives<T>(comm, recv, in_sizes, displacements, out, ws.offsets);
+}
+
+template <typename T>
+void allgatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+    workspace ws;
+    allgatherv_serialize(comm, in, out, ws);
+}
+
+
+// All-gather the number of elements `size` of every PE into ws.sizes64, and
+// compute their displacements (plus the total at the end) in ws.displacements64
+inline void exchange_sizes(const boost::mpi::communicator &comm, uint64_t size, workspace &ws) {
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    ws.sizes64.resize(comm_size);
+    boost::mpi::all_gather(comm, size, ws.sizes64.data());
+    ws.displacements64.resize(comm_size + 1);
+    ws.displacements64[0] = 0;
+    std::partial_sum(ws.sizes64.begin(), ws.sizes64.end(), ws.displacements64.begin() + 1);
+}
+
+// Post nonblocking sends to (or receives from) `peer` of the blocks first,
+// first+1, ..., first+n-1 (modulo p) of `data`, where block i holds the
+// elements between displacements i and i+1. That's at most two messages.
+inline int post_blocks(bool send, void *data, const std::vector<size_t> &displacements,
+                       size_t first, size_t n, MPI_Datatype datatype, int peer, MPI_Comm comm,
+                       std::vector<MPI_Request> &requests) {
+    const size_t p = displacements.size() - 1, extent = datatype_extent(datatype);
+    while (n > 0) {
+        const size_t end = std::min(first + n, p);
+        const size_t count = displacements[end] - displacements[first];
+        char *ptr = static_cast<char*>(data) + displacements[first] * extent;
+        if (count > 0) {
+            int status = send
+                ? isend_large(ptr, count, datatype, peer, 0, comm, requests)
+                : irecv_large(ptr, count, datatype, peer, 0, comm, requests);
+            if (status != 0) return status;
+        }
+        n -= end - first;
+        first = 0;
+    }
+    return 0;
+}
+
+// Ring allgatherv on `data`, which already holds the local block: in step s,
+// pass block r-s on to the right neighbor and receive block r-s-1. Messages
+// go over the private duplicate of `comm`.
+inline int allgatherv_ring(const boost::mpi::communicator &comm, void *data,
+                           const std::vector<size_t> &displacements, MPI_Datatype datatype) {
+    const size_t p = static_cast<size_t>(comm.size()), rank = static_cast<size_t>(comm.rank());
+    const int right = static_cast<int>((rank + 1) % p), left = static_cast<int>((rank + p - 1) % p);
+    const MPI_Comm ring = private_comm(comm);
+    std::vector<MPI_Request> requests;
+    for (size_t step = 0; step + 1 < p; ++step) {
+        requests.clear();
+        int status = post_blocks(false, data, displacements, (rank + 2 * p - step - 1) % p, 1,
+                                 datatype, left, ring, requests);
+        if (status == 0) {
+            status = post_blocks(true, data, displacements, (rank + p - step) % p, 1,
+                                 datatype, right, ring, requests);
         }
-        boost::mpi::packed_iarchive archive(comm);
-        auto transmit_size_i = static_cast<size_t>(transmit_sizes[i]);
-        archive.resize(transmit_size_i);
-        memcpy(archive.address(), recv + displacements[i], transmit_size_i);
+        if (status == 0) status = wait_chunks(requests);
+        if (status != 0) return status;
+    }
+    return 0;
+}
 
-        temp.clear();
-        temp.resize(static_cast<size_t>(in_sizes[i]));
-        archive >> temp;
-        out.insert(out.end(), temp.begin(), temp.end());
+// Bruck allgatherv on `data`, which already holds the local block. Before
+// step k, PE r has blocks r, ..., r+2^k-1, and sends all of them to PE r-2^k.
+// Messages go over the private duplicate of `comm`.
+inline int allgatherv_bruck(const boost::mpi::communicator &comm, void *data,
+                            const std::vector<size_t> &displacements, MPI_Datatype datatype) {
+    const size_t p = static_cast<size_t>(comm.size()), rank = static_cast<size_t>(comm.rank());
+    const MPI_Comm bruck = private_comm(comm);
+    std::vector<MPI_Request> requests;
+    for (size_t distance = 1; distance < p; distance *= 2) {
+        const size_t n = std::min(distance, p - distance);
+        const size_t from = (rank + distance) % p;
+        requests.clear();
+        int status = post_blocks(false, data, displacements, from, n, datatype,
+                                 static_cast<int>(from), bruck, requests);
+        if (status == 0) {
+            status = post_blocks(true, data, displacements, rank, n, datatype,
+                                 static_cast<int>((rank + p - distance) % p), bruck, requests);
+        }
+        if (status == 0) status = wait_chunks(requests);
+        if (status != 0) return status;
     }
+    return 0;
 }
 
+// Gatherv to the PE with the largest block, which then broadcasts everything.
+// `data` already holds the local block.
+inline int allgatherv_gather_broadcast(const boost::mpi::communicator &comm, void *data,
+                                       workspace &ws, MPI_Datatype datatype) {
+    const std::vector<uint64_t> &sizes = ws.sizes64;
+    const std::vector<size_t> &displacements = ws.displacements64;
+    const int rank = comm.rank();
+    const int owner = static_cast<int>(std::max_element(sizes.begin(), sizes.end()) - sizes.begin());
+    const void *sendptr = (rank == owner) ? MPI_IN_PLACE :
+        static_cast<char*>(data) + displacements[rank] * datatype_extent(datatype);
+    int status;
+    if (fits_count(displacements.back())) {
+        status = MPI_Gatherv(sendptr, static_cast<int>(sizes[rank]), datatype, data,
+                             ws.sizes.data(), ws.displacements.data(), datatype, owner, comm);
+    } else {
+        std::vector<size_t> counts(sizes.begin(), sizes.end());
+        status = gatherv_large(sendptr, sizes[rank], data, counts, displacements,
+                               datatype, owner, comm);
+    }
+    if (status != 0) return status;
+    return bcast_large(data, displacements.back(), datatype, owner, comm);
+}
 
-template <typename T, typename transmit_type=uint64_t>
-void allgatherv_unsafe(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+/*
+ * Allgatherv with the sizes and displacements from exchange_sizes, in
+ * elements of `datatype`. `sendptr` may be MPI_IN_PLACE. Uses the algorithm
+ * chosen by select_allgatherv unless told otherwise, see tuning.h. The
+ * alternatives to MPI_Allgatherv first copy the local block into place.
+ */
+inline int allgatherv_sized(const boost::mpi::communicator &comm, const void *sendptr,
+                            uint64_t sendcount, void *recvptr, MPI_Datatype datatype,
+                            workspace &ws,
+                            allgatherv_algorithm algorithm = allgatherv_algorithm::automatic) {
+    const std::vector<uint64_t> &sizes = ws.sizes64;
+    const std::vector<size_t> &displacements = ws.displacements64;
+    if (algorithm == allgatherv_algorithm::automatic) {
+        algorithm = select_allgatherv(sizes, datatype_extent(datatype));
+    }
+    const bool fits = fits_count(displacements.back());
+    if (fits) {
+        ws.sizes.assign(sizes.begin(), sizes.end());
+        ws.displacements.assign(displacements.begin(), displacements.end());
+    }
+    if (algorithm == allgatherv_algorithm::native || comm.size() == 1) {
+        if (fits) {
+            return MPI_Allgatherv(sendptr, static_cast<int>(sendcount), datatype, recvptr,
+                                  ws.sizes.data(), ws.displacements.data(), datatype, comm);
+        }
+        std::vector<size_t> counts(sizes.begin(), sizes.end());
+        return allgatherv_large(sendptr, sendcount, recvptr, counts, displacements, datatype, comm);
+    }
+
+    if (sendptr != MPI_IN_PLACE && sendcount > 0) {
+        const size_t extent = datatype_extent(datatype);
+        memcpy(static_cast<char*>(recvptr) + displacements[comm.rank()] * extent, sendptr,
+               sendcount * extent);
+    }
+    switch (algorithm) {
+    case allgatherv_algorithm::ring:
+        return allgatherv_ring(comm, recvptr, displacements, datatype);
+    case allgatherv_algorithm::bruck:
+        return allgatherv_bruck(comm, recvptr, displacements, datatype);
+    default:
+        return allgatherv_gather_broadcast(comm, recvptr, ws, datatype);
+    }
+}
+
+
+// Gather into `out` without initializing it first, see output.h
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv_unsafe(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                       output<T> out, workspace &ws) {
     static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
         "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+    instrument::recorder rec(comm, instrument::operation::allgatherv);
+    rec.taken(instrument::path::trivial);
 
     // Step 1: exchange sizes
+    rec.enter(instrument::phase::size_exchange);
     // We need to compute the displacement array, specifying for each PE
     // at which position in out to place the data received from it
-    // Need to cast to int because this is what MPI uses as size_t...
-    const size_t comm_size = static_cast<size_t>(comm.size());
+    // Sizes are exchanged as 64 bit, MPI's int only suffices for up to 2^31
+    // elements of transmit_type
     const size_t factor = sizeof(T) / sizeof(transmit_type);
-    const int in_size = static_cast<int>(in.size() * factor);
-    std::vector<int> sizes(comm_size);
-    boost::mpi::all_gather(comm, in_size, sizes.data());
+    const uint64_t in_size = in.size() * factor;
+    exchange_sizes(comm, in_size, ws);
 
     // Step 2: calculate displacements from sizes
-    // Compute prefix sum to compute displacements from sizes
-    std::vector<int> displacements(comm_size + 1);
-    displacements[0] = 0;
-    std::partial_sum(sizes.begin(), sizes.end(), displacements.begin() + 1);
     // divide by factor by which T is larger than transmit_type
-    out.resize(static_cast<size_t>(displacements.back()) / factor);
+    const std::vector<size_t> &displacements = ws.displacements64;
+    std::vector<T> discard;
+    T *outptr = out.prepare(displacements.back() / factor);
+    if (outptr == nullptr && out.size() > 0) {
+        // Still take part in the allgatherv, but discard the data
+        ERR << "allgatherv: output buffer too small for " << out.size() << " elements" << std::endl;
+        discard.resize(out.size());
+        outptr = discard.data();
+    }
 
     // Step 3: MPI_Allgatherv
+    rec.enter(instrument::phase::transfer);
+    rec.sent(in.size() * sizeof(T));
+    rec.received(out.size() * sizeof(T));
     const transmit_type *sendptr = reinterpret_cast<const transmit_type*>(in.data());
-    transmit_type *recvptr = reinterpret_cast<transmit_type*>(out.data());
-    const MPI_Datatype datatype = boost::mpi::get_mpi_datatype<transmit_type>();
+    transmit_type *recvptr = reinterpret_cast<transmit_type*>(outptr);
+    int status = allgatherv_sized(comm, sendptr, in_size, recvptr,
+                                  transmit_datatype<transmit_type>(), ws);
+    if (status != 0) {
+        ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
+    }
+}
 
-    int status = MPI_Allgatherv(sendptr, in_size, datatype, recvptr,
-                                sizes.data(), displacements.data(),
-                                datatype, comm);
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv_unsafe(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                       output<T> out) {
+    workspace ws;
+    allgatherv_unsafe<T, transmit_type>(comm, in, out, ws);
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv_unsafe(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                       std::vector<T> &out, workspace &ws) {
+    allgatherv_unsafe<T, transmit_type>(comm, in, output<T>(out), ws);
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv_unsafe(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+    workspace ws;
+    allgatherv_unsafe<T, transmit_type>(comm, in, out, ws);
+}
+
+
+/*
+ * In-place allgatherv of trivial (enough) data: `data` holds the local
+ * elements on entry, and those of all PEs in order of rank on return. The
+ * local elements are moved to their place within `data`, and the other PEs'
+ * are received around them with MPI_IN_PLACE, so there is no second copy of
+ * the local data. Growing an uninitialized_vector<T> (see output.h) also
+ * saves zeroing the new elements.
+ */
+template <typename T, typename transmit_type=default_transmit_type<T>, typename Alloc>
+void allgatherv_in_place(const boost::mpi::communicator &comm, std::vector<T, Alloc> &data,
+                         workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "allgatherv_in_place requires trivial (enough) T");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+    instrument::recorder rec(comm, instrument::operation::allgatherv);
+    rec.taken(instrument::path::trivial);
+
+    rec.enter(instrument::phase::size_exchange);
+    const size_t factor = sizeof(T) / sizeof(transmit_type);
+    const size_t count = data.size();
+    exchange_sizes(comm, count * factor, ws);
+
+    // Make room and move the local elements to their place
+    const size_t offset = ws.displacements64[comm.rank()] / factor;
+    data.resize(ws.displacements64.back() / factor);
+    if (offset > 0 && count > 0) {
+        std::copy_backward(data.begin(), data.begin() + count, data.begin() + offset + count);
+    }
+
+    rec.enter(instrument::phase::transfer);
+    rec.sent(count * sizeof(T));
+    rec.received(data.size() * sizeof(T));
+    int status = allgatherv_sized(comm, MPI_IN_PLACE, 0, data.data(),
+                                  transmit_datatype<transmit_type>(), ws);
     if (status != 0) {
         ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
     }
 }
 
-template <typename T, typename transmit_type=uint64_t>
-void allgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+template <typename T, typename transmit_type=default_transmit_type<T>, typename Alloc>
+void allgatherv_in_place(const boost::mpi::communicator &comm, std::vector<T, Alloc> &data) {
+    workspace ws;
+    allgatherv_in_place<T, transmit_type>(comm, data, ws);
+}
+
+// Same, but the elements of PE i already sit at their place in `data`, after
+// those of PEs 0..i-1, and every PE knows the number of elements of every
+// other PE: `counts[i]` for PE i. Doesn't exchange sizes, and doesn't move
+// any data locally. `data` is resized to the sum of `counts`.
+template <typename T, typename transmit_type=default_transmit_type<T>, typename Alloc>
+void allgatherv_in_place(const boost::mpi::communicator &comm, std::vector<T, Alloc> &data,
+                         const std::vector<size_t> &counts, workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "allgatherv_in_place requires trivial (enough) T");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+    instrument::recorder rec(comm, instrument::operation::allgatherv);
+    rec.taken(instrument::path::trivial);
+
+    if (counts.size() != static_cast<size_t>(comm.size())) {
+        ERR << "allgatherv_in_place: " << counts.size() << " counts for "
+            << comm.size() << " PEs" << std::endl;
+        return;
+    }
+
+    const size_t factor = sizeof(T) / sizeof(transmit_type);
+    ws.sizes64.resize(counts.size());
+    ws.displacements64.resize(counts.size() + 1);
+    ws.displacements64[0] = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        ws.sizes64[i] = counts[i] * factor;
+        ws.displacements64[i+1] = ws.displacements64[i] + ws.sizes64[i];
+    }
+    data.resize(ws.displacements64.back() / factor);
+
+    rec.enter(instrument::phase::transfer);
+    rec.sent(counts[comm.rank()] * sizeof(T));
+    rec.received(data.size() * sizeof(T));
+    int status = allgatherv_sized(comm, MPI_IN_PLACE, 0, data.data(),
+                                  transmit_datatype<transmit_type>(), ws);
+    if (status != 0) {
+        ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
+    }
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>, typename Alloc>
+void allgatherv_in_place(const boost::mpi::communicator &comm, std::vector<T, Alloc> &data,
+                         const std::vector<size_t> &counts) {
+    workspace ws;
+    allgatherv_in_place<T, transmit_type>(comm, data, counts, ws);
+}
+
+
+// Gather trivial (enough) data without its padding, see packed.h
+template <typename T>
+void allgatherv_packed(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                       std::vector<T> &out, workspace &ws) {
+    pack(in, ws.packed);
+    allgatherv_unsafe<uint8_t>(comm, ws.packed, into(ws.packed_recv), ws);
+    unpack(ws.packed_recv, out);
+}
+
+
+// Pass the same workspace to repeated calls to avoid allocating scratch space
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                std::vector<T> &out, workspace &ws) {
     // Trivial (enough) datatypes can be transmit directly via MPI_Allgatherv
     // For all others, we have to serialize them using boost::serialize
+    if (packed_wire<T>::value) {
+        allgatherv_packed<T>(comm, in, out, ws);
+    } else if (is_trivial_enough<T>::value) {
+        allgatherv_unsafe<T, transmit_type>(comm, in, out, ws);
+    } else {
+        allgatherv_serialize<T>(comm, in, out, ws);
+    }
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+    workspace ws;
+    allgatherv<T, transmit_type>(comm, in, out, ws);
+}
+
+// Gather trivial (enough) data into a raw buffer or a vector with any
+// allocator, or append it to a vector, see output.h
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                output<T> out, workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "output<T> requires trivial (enough) T");
+    allgatherv_unsafe<T, transmit_type>(comm, in, out, ws);
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void allgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, output<T> out) {
+    workspace ws;
+    allgatherv<T, transmit_type>(comm, in, out, ws);
+}
+
+
+// Compress trivial (enough) data with `codec` before gathering it, see
+// codec.h. The sizes of the compressed frames are exchanged instead of the
+// sizes of the data.
+template <typename T, typename Codec>
+void allgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                std::vector<T> &out, const Codec &codec, workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "codecs require trivial (enough) T");
+    codec::encode_frame(codec, in.data(), in.size(), ws.packed);
+    allgatherv_unsafe<uint8_t>(comm, ws.packed, into(ws.packed_recv), ws);
+    // allgatherv_unsafe leaves the frame sizes and their offsets in ws
+    codec::decode_frames(codec, ws.packed_recv.data(), ws.sizes64, ws.displacements64, out);
+}
+
+template <typename T, typename Codec>
+typename std::enable_if<codec::is_codec<Codec>::value>::type
+allgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in,
+           std::vector<T> &out, const Codec &codec) {
+    workspace ws;
+    allgatherv(comm, in, out, codec, ws);
+}
+
+
+// Nonblocking variant of allgatherv_unsafe. `in` and `out` must stay alive
+// until the returned request has completed.
+template <typename T, typename transmit_type=default_transmit_type<T>>
+request iallgatherv_unsafe(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    struct state_t {
+        int in_size;
+        std::vector<int> sizes, displacements;
+    };
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    const size_t factor = sizeof(T) / sizeof(transmit_type);
+    auto state = std::make_shared<state_t>();
+    state->in_size = static_cast<int>(in.size() * factor);
+    state->sizes.resize(comm_size);
+
+    request result;
+    result.hold(state);
+
+    // Step 1: exchange sizes
+    MPI_Request req;
+    int status = MPI_Iallgather(&state->in_size, 1, MPI_INT, state->sizes.data(), 1, MPI_INT,
+                                comm, &req);
+    if (status != 0) {
+        ERR << "MPI_Iallgather returned " << status << ", errno " << errno << std::endl;
+        return result;
+    }
+    result.add(req);
+
+    // Step 2: once sizes are known, compute displacements and start data
+    // exchange on the operation's own communicator, see request.h
+    const std::shared_ptr<MPI_Comm> dup = result.dup(comm);
+    const transmit_type *sendptr = reinterpret_cast<const transmit_type*>(in.data());
+    result.then([state, dup, sendptr, factor, &out](request &r) {
+        state->displacements.resize(state->sizes.size() + 1);
+        state->displacements[0] = 0;
+        std::partial_sum(state->sizes.begin(), state->sizes.end(),
+                         state->displacements.begin() + 1);
+        out.resize(static_cast<size_t>(state->displacements.back()) / factor);
+
+        transmit_type *recvptr = reinterpret_cast<transmit_type*>(out.data());
+        const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+        MPI_Request req;
+        int status = MPI_Iallgatherv(sendptr, state->in_size, datatype, recvptr,
+                                     state->sizes.data(), state->displacements.data(),
+                                     datatype, *dup, &req);
+        if (status != 0) {
+            ERR << "MPI_Iallgatherv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        r.add(req);
+    });
+    return result;
+}
+
+
+// Nonblocking variant of allgatherv_serialize. Input is serialized right away,
+// so `in` may be destroyed immediately. Deserialization happens in wait().
+template <typename T>
+request iallgatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
+    struct state_t {
+        archive_buffer send;
+        int meta[2]; // number of elements, archive size
+        std::vector<int> all_meta, in_sizes, transmit_sizes, displacements;
+        archive_buffer recv;
+    };
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    auto state = std::make_shared<state_t>();
+
+    // Step 1: serialize input data
+    if (!in.empty())
+        pack_blocks(comm, in.data(), in.size(), state->send);
+    state->meta[0] = static_cast<int>(in.size());
+    state->meta[1] = (in.empty() ? 0 : static_cast<int>(state->send.size()));
+    state->all_meta.resize(2 * comm_size);
+
+    request result;
+    result.hold(state);
+
+    // Step 2: exchange both sizes in one go
+    MPI_Request req;
+    int status = MPI_Iallgather(state->meta, 2, MPI_INT, state->all_meta.data(), 2, MPI_INT,
+                                comm, &req);
+    if (status != 0) {
+        ERR << "MPI_Iallgather returned " << status << ", errno " << errno << std::endl;
+        return result;
+    }
+    result.add(req);
+
+    // Step 3: calculate displacements and start data exchange on the
+    // operation's own communicator, see request.h
+    const boost::mpi::communicator comm_copy = comm;
+    const std::shared_ptr<MPI_Comm> dup = result.dup(comm);
+    result.then([state, comm_copy, dup, comm_size, &out](request &r) {
+        state->in_sizes.resize(comm_size);
+        state->transmit_sizes.resize(comm_size);
+        state->displacements.resize(comm_size + 1);
+        state->displacements[0] = 0;
+        for (size_t i = 0; i < comm_size; ++i) {
+            state->in_sizes[i] = state->all_meta[2 * i];
+            state->transmit_sizes[i] = state->all_meta[2 * i + 1];
+            state->displacements[i+1] = state->displacements[i] + state->transmit_sizes[i];
+        }
+        state->recv.resize(static_cast<size_t>(state->displacements.back()));
+
+        auto sendptr = state->send.data();
+        MPI_Request req;
+        int status = MPI_Iallgatherv(sendptr, state->meta[1], MPI_PACKED, state->recv.data(),
+                                     state->transmit_sizes.data(), state->displacements.data(),
+                                     MPI_PACKED, *dup, &req);
+        if (status != 0) {
+            ERR << "MPI_Iallgatherv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        r.add(req);
+
+        // Step 4: deserialize received data once the user waits for it
+        r.finally([state, comm_copy, &out]() {
+            unpack_archives<T>(comm_copy, state->recv, state->in_sizes,
+                               state->displacements, out);
+        });
+    });
+    return result;
+}
+
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+request iallgatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out) {
     if (is_trivial_enough<T>::value) {
-        allgatherv_unsafe<T, transmit_type>(comm, in, out);
+        return iallgatherv_unsafe<T, transmit_type>(comm, in, out);
     } else {
-        allgatherv_serialize<T>(comm, in, out);
+        return iallgatherv_serialize<T>(comm, in, out);
     }
 }
 
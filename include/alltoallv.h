@@ -0,0 +1,253 @@
+#pragma once
+
+/*
+ * alltoallv.h  -- MPI_Alltoallv wrapper for std::vector
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/packed_iarchive.hpp>
+#include <boost/mpi/packed_oarchive.hpp>
+
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include "archive.h"
+#include "common.h"
+#include "tuple_serialization.h"
+#include "workspace.h"
+
+namespace unsafe_mpi {
+
+// Exchange the per-destination archives in `send`, which holds one
+// pack_blocks archive per PE, back to back. `in_sizes` holds the number of
+// elements and `transmit_sizes` the number of bytes destined for each PE.
+// Received elements are appended to `out` in order of source rank.
+template <typename T>
+void alltoallv_archive(const boost::mpi::communicator &comm, archive_buffer &send,
+                       const std::vector<int> &in_sizes,
+                       const std::vector<int> &transmit_sizes,
+                       std::vector<T> &out, workspace &ws) {
+    const size_t comm_size = static_cast<size_t>(comm.size());
+
+    // Step 1: exchange both sizes in one go
+    std::vector<int> &meta = ws.meta, &recv_meta = ws.recv_meta;
+    meta.resize(2 * comm_size);
+    recv_meta.resize(2 * comm_size);
+    for (size_t i = 0; i < comm_size; ++i) {
+        meta[2 * i] = in_sizes[i];
+        meta[2 * i + 1] = transmit_sizes[i];
+    }
+    int status = MPI_Alltoall(meta.data(), 2, MPI_INT, recv_meta.data(), 2, MPI_INT, comm);
+    if (status != 0) {
+        ERR << "MPI_Alltoall returned " << status << ", errno " << errno << std::endl;
+        return;
+    }
+    // meta is not needed any more, reuse it for the received element counts
+    std::vector<int> &recv_sizes = meta, &recv_transmit_sizes = ws.rest_sizes;
+    recv_sizes.resize(comm_size);
+    recv_transmit_sizes.resize(comm_size);
+    for (size_t i = 0; i < comm_size; ++i) {
+        recv_sizes[i] = recv_meta[2 * i];
+        recv_transmit_sizes[i] = recv_meta[2 * i + 1];
+    }
+
+    // Step 2: calculate displacements from sizes (prefix sum)
+    std::vector<int> &send_displs = ws.displacements, &recv_displs = ws.rest_displacements;
+    send_displs.resize(comm_size + 1);
+    recv_displs.resize(comm_size + 1);
+    send_displs[0] = recv_displs[0] = 0;
+    std::partial_sum(transmit_sizes.begin(), transmit_sizes.end(), send_displs.begin() + 1);
+    std::partial_sum(recv_transmit_sizes.begin(), recv_transmit_sizes.end(), recv_displs.begin() + 1);
+
+    // Step 3: allocate space for result and MPI_Alltoallv
+    archive_buffer &recv = ws.recv_buffer;
+    recv.resize(static_cast<size_t>(recv_displs.back()));
+
+    status = MPI_Alltoallv(send.data(), transmit_sizes.data(), send_displs.data(), MPI_PACKED,
+                           recv.data(), recv_transmit_sizes.data(), recv_displs.data(), MPI_PACKED,
+                           comm);
+    if (status != 0) {
+        ERR << "MPI_Alltoallv returned " << status << ", errno " << errno << std::endl;
+        return;
+    }
+
+    // Step 4: deserialize received data in place. Every source's archive is
+    // self-contained, including Boost's class information.
+    unpack_archives<T>(comm, recv, recv_sizes, recv_displs, out, ws.offsets);
+}
+
+// Append a pack_blocks archive of in[0], ..., in[count-1] to ws.send_buffer
+// and return its size in bytes
+template <typename T>
+int append_archive(const boost::mpi::communicator &comm, const T *in, size_t count,
+                   workspace &ws) {
+    if (count == 0) return 0;
+    archive_buffer &segment = ws.segment_buffer;
+    pack_blocks(comm, in, count, segment, ws.block_buffers);
+    ws.send_buffer.insert(ws.send_buffer.end(), segment.begin(), segment.end());
+    return static_cast<int>(segment.size());
+}
+
+
+// Send `counts[i]` consecutive elements of `in` to PE i. Each destination's
+// elements are serialized into an archive of their own.
+template <typename T>
+void alltoallv_serialize(const boost::mpi::communicator &comm, const T *in,
+                         const std::vector<int> &counts, std::vector<T> &out,
+                         workspace &ws) {
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    ws.send_buffer.clear();
+    std::vector<int> &transmit_sizes = ws.sizes;
+    transmit_sizes.resize(comm_size);
+
+    for (size_t i = 0; i < comm_size; ++i) {
+        transmit_sizes[i] = append_archive(comm, in, static_cast<size_t>(counts[i]), ws);
+        in += counts[i];
+    }
+
+    out.clear();
+    alltoallv_archive<T>(comm, ws.send_buffer, counts, transmit_sizes, out, ws);
+}
+
+
+// Same as above, but with a separate vector for each destination PE
+template <typename T>
+void alltoallv_serialize(const boost::mpi::communicator &comm,
+                         const std::vector<std::vector<T>> &per_dest, std::vector<T> &out,
+                         workspace &ws) {
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    ws.send_buffer.clear();
+    std::vector<int> in_sizes(comm_size), &transmit_sizes = ws.sizes;
+    transmit_sizes.resize(comm_size);
+
+    for (size_t i = 0; i < comm_size; ++i) {
+        in_sizes[i] = static_cast<int>(per_dest[i].size());
+        transmit_sizes[i] = append_archive(comm, per_dest[i].data(), per_dest[i].size(), ws);
+    }
+
+    out.clear();
+    alltoallv_archive<T>(comm, ws.send_buffer, in_sizes, transmit_sizes, out, ws);
+}
+
+
+// Send `counts[i]` consecutive elements of `in` to PE i via MPI_Alltoallv,
+// reinterpreting them as `transmit_type`. The elements from PE i end up in
+// out[recv_displacements[i]], ..., out[recv_displacements[i+1]-1].
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void alltoallv_unsafe(const boost::mpi::communicator &comm, const T *in,
+                      const std::vector<int> &counts, std::vector<T> &out,
+                      std::vector<size_t> &recv_displacements, workspace &ws) {
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    // Step 1: exchange sizes, measured in units of transmit_type
+    // Need to cast to int because this is what MPI uses as size_t...
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    const int factor = static_cast<int>(sizeof(T) / sizeof(transmit_type));
+    std::vector<int> &send_sizes = ws.sizes, &recv_sizes = ws.rest_sizes;
+    send_sizes.resize(comm_size);
+    recv_sizes.resize(comm_size);
+    for (size_t i = 0; i < comm_size; ++i) {
+        send_sizes[i] = counts[i] * factor;
+    }
+    boost::mpi::all_to_all(comm, send_sizes.data(), recv_sizes.data());
+
+    // Step 2: calculate displacements from sizes
+    std::vector<int> &send_displs = ws.displacements, &recv_displs = ws.rest_displacements;
+    send_displs.resize(comm_size + 1);
+    recv_displs.resize(comm_size + 1);
+    send_displs[0] = recv_displs[0] = 0;
+    std::partial_sum(send_sizes.begin(), send_sizes.end(), send_displs.begin() + 1);
+    std::partial_sum(recv_sizes.begin(), recv_sizes.end(), recv_displs.begin() + 1);
+    // divide by factor by which T is larger than transmit_type
+    out.resize(static_cast<size_t>(recv_displs.back() / factor));
+    recv_displacements.resize(comm_size + 1);
+    for (size_t i = 0; i <= comm_size; ++i) {
+        recv_displacements[i] = static_cast<size_t>(recv_displs[i] / factor);
+    }
+
+    // Step 3: MPI_Alltoallv
+    const transmit_type *sendptr = reinterpret_cast<const transmit_type*>(in);
+    transmit_type *recvptr = reinterpret_cast<transmit_type*>(out.data());
+    const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+
+    int status = MPI_Alltoallv(sendptr, send_sizes.data(), send_displs.data(), datatype,
+                               recvptr, recv_sizes.data(), recv_displs.data(), datatype,
+                               comm);
+    if (status != 0) {
+        ERR << "MPI_Alltoallv returned " << status << ", errno " << errno << std::endl;
+    }
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void alltoallv_unsafe(const boost::mpi::communicator &comm, const T *in,
+                      const std::vector<int> &counts, std::vector<T> &out,
+                      workspace &ws) {
+    alltoallv_unsafe<T, transmit_type>(comm, in, counts, out, ws.offsets, ws);
+}
+
+
+// Flat buffer: the first counts[0] elements of `in` go to PE 0, the next
+// counts[1] to PE 1, and so on. Received data is stored in `out`, ordered by
+// source rank. Pass the same workspace to repeated calls to avoid allocating
+// scratch space.
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void alltoallv(const boost::mpi::communicator &comm, const std::vector<T> &in,
+               const std::vector<int> &counts, std::vector<T> &out, workspace &ws) {
+    if (is_trivial_enough<T>::value) {
+        alltoallv_unsafe<T, transmit_type>(comm, in.data(), counts, out, ws);
+    } else {
+        alltoallv_serialize<T>(comm, in.data(), counts, out, ws);
+    }
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void alltoallv(const boost::mpi::communicator &comm, const std::vector<T> &in,
+               const std::vector<int> &counts, std::vector<T> &out) {
+    workspace ws;
+    alltoallv<T, transmit_type>(comm, in, counts, out, ws);
+}
+
+
+// One vector per destination PE, per_dest[i] is sent to PE i
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void alltoallv(const boost::mpi::communicator &comm,
+               const std::vector<std::vector<T>> &per_dest, std::vector<T> &out,
+               workspace &ws) {
+    if (is_trivial_enough<T>::value) {
+        // MPI_Alltoallv needs a single send buffer, so flatten the input
+        std::vector<int> counts(per_dest.size());
+        std::vector<T> flat;
+        size_t total = 0;
+        for (const auto &v : per_dest) total += v.size();
+        flat.reserve(total);
+        for (size_t i = 0; i < per_dest.size(); ++i) {
+            counts[i] = static_cast<int>(per_dest[i].size());
+            flat.insert(flat.end(), per_dest[i].begin(), per_dest[i].end());
+        }
+        alltoallv_unsafe<T, transmit_type>(comm, flat.data(), counts, out, ws);
+    } else {
+        alltoallv_serialize<T>(comm, per_dest, out, ws);
+    }
+}
+
+template <typename T, typename transmit_type=default_transmit_type<T>>
+void alltoallv(const boost::mpi::communicator &comm,
+               const std::vector<std::vector<T>> &per_dest, std::vector<T> &out) {
+    workspace ws;
+    alltoallv<T, transmit_type>(comm, per_dest, out, ws);
+}
+
+}
@@ -0,0 +1,391 @@
+#pragma once
+
+/*
+ * archive.h  -- Helpers for exchanging Boost.Serialization archives
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/packed_iarchive.hpp>
+#include <boost/mpi/packed_oarchive.hpp>
+
+#include <boost/serialization/array.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include "common.h"
+#include "parallel.h"
+#include "ragged.h"
+#include "tuple_serialization.h"
+
+namespace unsafe_mpi {
+
+// Buffer for receiving archives. Boost's packed_iarchive can deserialize
+// directly from it, starting at any offset.
+typedef boost::mpi::packed_iarchive::buffer_type archive_buffer;
+
+// Deserialize the archives of at least this many PEs in parallel
+static const size_t parallel_unpack_threshold = 64;
+
+// Vectors of at least twice this many elements are serialized as independent
+// blocks of this many to twice as many elements, which are packed and
+// unpacked in parallel (see pack_blocks)
+static const size_t serialize_block_size = size_t(1) << 12;
+
+// Archives of up to this many bytes travel together with their sizes in the
+// serialized collectives, saving a round of latency
+static const size_t eager_limit = 64;
+
+// Size exchange record of one PE, carrying the start of its archive
+struct eager_block {
+    int in_size;       // number of elements
+    int transmit_size; // archive size in bytes
+    char payload[eager_limit];
+
+    // Number of archive bytes carried in payload
+    size_t inline_size() const {
+        return std::min(static_cast<size_t>(transmit_size), eager_limit);
+    }
+    // Number of archive bytes that did not fit into payload
+    int rest_size() const {
+        return transmit_size - static_cast<int>(inline_size());
+    }
+};
+
+inline archive_buffer& cleared(archive_buffer &buf) {
+    buf.clear();
+    return buf;
+}
+
+/*
+ * Archives holding a whole std::vector<T>. These use Boost's packed archives,
+ * unless T is a ragged container (see ragged.h), which is packed into a flat
+ * buffer instead. The interface mirrors that of the packed archives.
+ *
+ * The element count is stored first, followed by the elements as an array, so
+ * that the receiver can deserialize them into any preallocated location.
+ *
+ * All archives can work on an external buffer, e.g. one from a workspace, to
+ * reuse its memory. An output archive clears it first.
+ */
+template <typename T, bool ragged = is_ragged<T>::value>
+class vector_oarchive {
+public:
+    explicit vector_oarchive(const boost::mpi::communicator &comm) : oa_(comm) {}
+    vector_oarchive(const boost::mpi::communicator &comm, archive_buffer &buf)
+        : oa_(comm, cleared(buf)) {}
+
+    vector_oarchive& operator<<(const std::vector<T> &in) {
+        pack(in.data(), in.size());
+        return *this;
+    }
+
+    // Same as operator<<, for in[0], ..., in[size-1]
+    void pack(const T *in, size_t size) {
+        oa_ << size;
+        if (size > 0)
+            oa_ << boost::serialization::make_array(in, size);
+    }
+
+    const void* address() const { return oa_.address(); }
+    size_t size() const { return oa_.size(); }
+
+private:
+    boost::mpi::packed_oarchive oa_;
+};
+
+template <typename T>
+class vector_oarchive<T, true> {
+public:
+    explicit vector_oarchive(const boost::mpi::communicator &) : buf_(own_) {}
+    vector_oarchive(const boost::mpi::communicator &, archive_buffer &buf) : buf_(buf) {
+        buf_.clear();
+    }
+
+    vector_oarchive(const vector_oarchive&) = delete;
+    vector_oarchive& operator=(const vector_oarchive&) = delete;
+
+    vector_oarchive& operator<<(const std::vector<T> &in) {
+        pack_ragged(in, buf_);
+        return *this;
+    }
+
+    void pack(const T *in, size_t size) {
+        pack_ragged(in, size, buf_);
+    }
+
+    const void* address() const { return buf_.data(); }
+    size_t size() const { return buf_.size(); }
+
+private:
+    archive_buffer own_;
+    archive_buffer &buf_;
+};
+
+
+template <typename T, bool ragged = is_ragged<T>::value>
+class vector_iarchive {
+public:
+    explicit vector_iarchive(const boost::mpi::communicator &comm) : ia_(comm) {}
+    vector_iarchive(const boost::mpi::communicator &comm, archive_buffer &buf)
+        : ia_(comm, buf) {}
+
+    vector_iarchive& operator>>(std::vector<T> &out) {
+        size_t size;
+        ia_ >> size;
+        out.resize(size);
+        if (size > 0)
+            ia_ >> boost::serialization::make_array(out.data(), size);
+        return *this;
+    }
+
+    void resize(size_t size) { ia_.resize(size); }
+    void* address() { return ia_.address(); }
+
+private:
+    boost::mpi::packed_iarchive ia_;
+};
+
+template <typename T>
+class vector_iarchive<T, true> {
+public:
+    explicit vector_iarchive(const boost::mpi::communicator &) : buf_(own_) {}
+    vector_iarchive(const boost::mpi::communicator &, archive_buffer &buf) : buf_(buf) {}
+
+    vector_iarchive(const vector_iarchive&) = delete;
+    vector_iarchive& operator=(const vector_iarchive&) = delete;
+
+    vector_iarchive& operator>>(std::vector<T> &out) {
+        out.resize(ragged_count(buf_.data()));
+        unpack_ragged(buf_.data(), out.data());
+        return *this;
+    }
+
+    void resize(size_t size) { buf_.resize(size); }
+    void* address() { return buf_.data(); }
+
+private:
+    archive_buffer own_;
+    archive_buffer &buf_;
+};
+
+
+// Whether archives of T may be packed and unpacked by several threads at
+// once. Ragged containers are packed without MPI, but Boost archives use
+// MPI_Pack and MPI_Unpack, which requires MPI_THREAD_MULTIPLE for them.
+template <typename T>
+bool parallel_serialization() {
+    if (is_ragged<T>::value) return true;
+    int provided = MPI_THREAD_SINGLE;
+    MPI_Query_thread(&provided);
+    return provided == MPI_THREAD_MULTIPLE;
+}
+
+// Number of blocks pack_blocks splits `count` elements into. This depends on
+// nothing else, so that the receiver can compute it, too.
+inline size_t num_serialize_blocks(size_t count) {
+    return std::max<size_t>(1, count / serialize_block_size);
+}
+
+/*
+ * Serialize in[0], ..., in[count-1] into `buf` as num_serialize_blocks(count)
+ * independent vector_oarchive<T> archives of consecutive elements, packed in
+ * parallel. The archives are preceded by the start of every archive but the
+ * first, relative to that of the first:
+ *
+ *   uint64_t start[blocks-1] | archive 0 | ... | archive blocks-1
+ *
+ * A single block is exactly what a vector_oarchive<T> would have packed.
+ * Only the calling thread makes MPI calls unless parallel_serialization<T>()
+ * says otherwise, so this works with MPI_THREAD_FUNNELED. `scratch` holds the
+ * blocks until they are copied into `buf`.
+ */
+template <typename T>
+void pack_blocks(const boost::mpi::communicator &comm, const T *in, size_t count,
+                 archive_buffer &buf, std::vector<archive_buffer> &scratch) {
+    const size_t blocks = num_serialize_blocks(count);
+    if (blocks == 1) {
+        vector_oarchive<T> oa(comm, buf);
+        oa.pack(in, count);
+        return;
+    }
+
+    const size_t threads = parallel_serialization<T>() ? num_threads(blocks) : 1;
+    scratch.resize(blocks);
+    parallel_for(blocks, threads, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; ++b) {
+            const size_t first = count * b / blocks, last = count * (b + 1) / blocks;
+            vector_oarchive<T> oa(comm, scratch[b]);
+            oa.pack(in + first, last - first);
+        }
+    });
+
+    // Write the header, then concatenate the archives
+    const size_t header = (blocks - 1) * sizeof(uint64_t);
+    std::vector<size_t> starts(blocks + 1, 0);
+    for (size_t b = 0; b < blocks; ++b) {
+        starts[b+1] = starts[b] + scratch[b].size();
+    }
+    buf.resize(header + starts.back());
+    for (size_t b = 1; b < blocks; ++b) {
+        const uint64_t start = starts[b];
+        memcpy(buf.data() + (b - 1) * sizeof(uint64_t), &start, sizeof(uint64_t));
+    }
+    parallel_for(blocks, threads, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; ++b) {
+            memcpy(buf.data() + header + starts[b], scratch[b].data(), scratch[b].size());
+        }
+    });
+}
+
+template <typename T>
+void pack_blocks(const boost::mpi::communicator &comm, const T *in, size_t count,
+                 archive_buffer &buf) {
+    std::vector<archive_buffer> scratch;
+    pack_blocks(comm, in, count, buf, scratch);
+}
+
+
+// Deserialize `count` elements from the Boost archive starting at
+// recv[offset] into dest[0], ..., dest[count-1]
+template <typename T>
+void unpack_segment(const boost::mpi::communicator &comm, archive_buffer &recv,
+                    int offset, T *dest, size_t count, std::false_type /* ragged */) {
+    boost::mpi::packed_iarchive archive(comm, recv, boost::archive::no_header, offset);
+    size_t size;
+    archive >> size;
+    if (size != count) {
+        ERR << "unpack_segment: archive holds " << size << " elements, expected "
+            << count << std::endl;
+        return;
+    }
+    archive >> boost::serialization::make_array(dest, count);
+}
+
+// Rebuild ragged containers directly from the receive buffer
+template <typename T>
+void unpack_segment(const boost::mpi::communicator &, archive_buffer &recv,
+                    int offset, T *dest, size_t, std::true_type /* ragged */) {
+    unpack_ragged(recv.data() + offset, dest);
+}
+
+// One block of a pack_blocks archive: `count` elements that go to position
+// `first` of the output, packed at recv[offset]
+struct unpack_task {
+    int offset;
+    size_t first, count;
+};
+
+// Append the blocks of the pack_blocks archive at recv[offset], which holds
+// `count` elements that go to positions first, ..., first+count-1, to `tasks`
+inline void add_unpack_tasks(const archive_buffer &recv, int offset, size_t first,
+                             size_t count, std::vector<unpack_task> &tasks) {
+    const size_t blocks = num_serialize_blocks(count);
+    const int header = static_cast<int>((blocks - 1) * sizeof(uint64_t));
+    for (size_t b = 0; b < blocks; ++b) {
+        uint64_t start = 0;
+        if (b > 0) {
+            memcpy(&start, recv.data() + offset + (b - 1) * sizeof(uint64_t), sizeof(uint64_t));
+        }
+        const size_t lo = count * b / blocks, hi = count * (b + 1) / blocks;
+        tasks.push_back(unpack_task{offset + header + static_cast<int>(start), first + lo, hi - lo});
+    }
+}
+
+// Deserialize all `tasks` into `dest` with `threads` threads
+template <typename T>
+void run_unpack_tasks(const boost::mpi::communicator &comm, archive_buffer &recv,
+                      const std::vector<unpack_task> &tasks, T *dest, size_t threads) {
+    typedef std::integral_constant<bool, is_ragged<T>::value> ragged;
+    parallel_for(tasks.size(), threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const unpack_task &task = tasks[i];
+            unpack_segment<T>(comm, recv, task.offset, dest + task.first, task.count, ragged());
+        }
+    });
+}
+
+// Deserialize the `count` elements packed by pack_blocks at recv[offset]
+// into dest[0], ..., dest[count-1], unpacking the blocks in parallel
+template <typename T>
+void unpack_blocks(const boost::mpi::communicator &comm, archive_buffer &recv, int offset,
+                   T *dest, size_t count) {
+    if (count == 0) return;
+    std::vector<unpack_task> tasks;
+    add_unpack_tasks(recv, offset, 0, count, tasks);
+    size_t threads = 1;
+    if (tasks.size() > 1 && parallel_serialization<T>()) {
+        threads = num_threads(tasks.size());
+    }
+    run_unpack_tasks(comm, recv, tasks, dest, threads);
+}
+
+// Deserialize the archives received from all PEs, appending them to `out`.
+// The archive of PE i holds in_sizes[i] elements and starts at
+// recv[displacements[i]]. It must have been packed by pack_blocks<T>.
+//
+// Elements are deserialized in place into their final position in `out`.
+// With many PEs or large archives, the archives and their blocks are
+// unpacked in parallel. Boost archives are read using MPI_Unpack, so this
+// requires MPI_THREAD_MULTIPLE for them.
+//
+// `offsets` is scratch space.
+template <typename T>
+void unpack_archives(const boost::mpi::communicator &comm, archive_buffer &recv,
+                     const std::vector<int> &in_sizes,
+                     const std::vector<int> &displacements,
+                     std::vector<T> &out, std::vector<size_t> &offsets) {
+    const size_t comm_size = in_sizes.size();
+
+    // Compute each PE's position in `out` and allocate space for all of them
+    offsets.resize(comm_size + 1);
+    offsets[0] = out.size();
+    for (size_t i = 0; i < comm_size; ++i) {
+        offsets[i+1] = offsets[i] + static_cast<size_t>(in_sizes[i]);
+    }
+    out.resize(offsets.back());
+
+    std::vector<unpack_task> tasks;
+    size_t senders = 0;
+    for (size_t i = 0; i < comm_size; ++i) {
+        if (in_sizes[i] == 0) {
+            // We can ignore processes which didn't have anything to send
+            continue;
+        }
+        add_unpack_tasks(recv, displacements[i], offsets[i],
+                         static_cast<size_t>(in_sizes[i]), tasks);
+        ++senders;
+    }
+
+    size_t useful = (tasks.size() > senders) ? tasks.size() : 0;
+    if (comm_size >= parallel_unpack_threshold) {
+        useful = std::max(useful, comm_size / parallel_unpack_threshold * 4);
+    }
+    size_t threads = 1;
+    if (useful > 1 && parallel_serialization<T>()) {
+        threads = num_threads(useful);
+    }
+    run_unpack_tasks(comm, recv, tasks, out.data(), threads);
+}
+
+template <typename T>
+void unpack_archives(const boost::mpi::communicator &comm, archive_buffer &recv,
+                     const std::vector<int> &in_sizes,
+                     const std::vector<int> &displacements,
+                     std::vector<T> &out) {
+    std::vector<size_t> offsets;
+    unpack_archives(comm, recv, in_sizes, displacements, out, offsets);
+}
+
+}
@@ -12,7 +12,12 @@
 #include <mpi.h>
 #include <errno.h>
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <type_traits>
 #include <vector>
 
 #include <boost/mpi/communicator.hpp>
@@ -24,31 +29,311 @@
 #include <boost/serialization/string.hpp>
 #include <boost/serialization/vector.hpp>
 
+#include "archive.h"
+#include "codec.h"
 #include "common.h"
+#include "instrumentation.h"
+#include "large_count.h"
+#include "output.h"
+#include "packed.h"
+#include "request.h"
 #include "tuple_serialization.h"
+#include "workspace.h"
 
 namespace unsafe_mpi {
-template <typename T, typename transmit_type = uint64_t>
-void broadcast(const boost::mpi::communicator &comm, std::vector<T> &data, int root) {
+
+// Serialized broadcasts whose archive takes up more than this many bytes are
+// split into segments of about this size. Serialization, transfer and
+// deserialization of consecutive segments overlap, and only a few segments
+// are held in archives at any time.
+static const size_t broadcast_segment_bytes = size_t(1) << 20;
+
+// Number of segments in flight in a segmented broadcast
+static const size_t broadcast_segments_in_flight = 2;
+
+// Serialize data[pos], data[pos+1], ... into `buf` until it holds at least
+// broadcast_segment_bytes or all remaining elements, and return the number
+// of elements packed. Ragged containers are measured exactly beforehand and
+// packed in parallel blocks (see pack_blocks).
+template <typename T>
+size_t pack_segment(const boost::mpi::communicator &comm, const std::vector<T> &data, size_t pos,
+                    archive_buffer &buf, std::vector<archive_buffer> &blocks,
+                    std::true_type /* ragged */) {
+    typedef typename T::value_type value_type;
+    size_t count = 0, bytes = sizeof(uint64_t);
+    while (pos + count < data.size() && (count == 0 || bytes < broadcast_segment_bytes)) {
+        bytes += sizeof(uint64_t) + data[pos + count].size() * sizeof(value_type);
+        ++count;
+    }
+    pack_blocks(comm, data.data() + pos, count, buf, blocks);
+    return count;
+}
+
+// The archive size of other types is only known once they are serialized,
+// so serialize them one at a time
+template <typename T>
+size_t pack_segment(const boost::mpi::communicator &comm, const std::vector<T> &data, size_t pos,
+                    archive_buffer &buf, std::vector<archive_buffer> &,
+                    std::false_type /* ragged */) {
+    boost::mpi::packed_oarchive oa(comm, cleared(buf));
+    size_t count = 0;
+    while (pos + count < data.size() && (count == 0 || oa.size() < broadcast_segment_bytes)) {
+        oa << data[pos + count];
+        ++count;
+    }
+    return count;
+}
+
+// Deserialize the `count` elements packed by pack_segment into `dest`
+template <typename T>
+void unpack_broadcast_segment(const boost::mpi::communicator &comm, archive_buffer &buf,
+                              T *dest, size_t count, std::true_type /* ragged */) {
+    unpack_blocks(comm, buf, 0, dest, count);
+}
+
+template <typename T>
+void unpack_broadcast_segment(const boost::mpi::communicator &comm, archive_buffer &buf,
+                              T *dest, size_t count, std::false_type /* ragged */) {
+    boost::mpi::packed_iarchive ia(comm, buf);
+    for (size_t i = 0; i < count; ++i) {
+        ia >> dest[i];
+    }
+}
+
+// Root side of a segmented broadcast. Each segment is announced by a header
+// holding its number of elements and archive size, followed by the archive.
+// The first segment, holding `first_count` elements, has already been packed
+// into `first`. A segment whose archive doesn't fit into an int is announced
+// with a negative size instead, which aborts the broadcast.
+template <typename T>
+void send_segments(const boost::mpi::communicator &comm, const std::vector<T> &data,
+                   int root, archive_buffer &first, size_t first_count,
+                   instrument::recorder &rec) {
+    typedef std::integral_constant<bool, is_ragged<T>::value> ragged;
+    struct slot {
+        archive_buffer buf;
+        std::vector<archive_buffer> blocks;
+        int header[2];
+        MPI_Request reqs[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+    };
+    slot slots[broadcast_segments_in_flight];
+    slots[0].buf.swap(first);
+
+    size_t pos = 0;
+    for (size_t k = 0; pos < data.size(); ++k) {
+        slot &s = slots[k % broadcast_segments_in_flight];
+        // Wait for the segment that used this slot before
+        rec.enter(instrument::phase::transfer);
+        int status = MPI_Waitall(2, s.reqs, MPI_STATUSES_IGNORE);
+        if (status != 0) {
+            ERR << "MPI_Waitall returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+
+        size_t count = first_count;
+        if (k > 0) {
+            rec.enter(instrument::phase::serialize);
+            count = pack_segment(comm, data, pos, s.buf, s.blocks, ragged());
+        }
+        const bool fits = s.buf.size() <= static_cast<size_t>(std::numeric_limits<int>::max());
+        s.header[0] = static_cast<int>(count);
+        s.header[1] = fits ? static_cast<int>(s.buf.size()) : -1;
+        pos += count;
+
+        rec.enter(instrument::phase::transfer);
+        status = MPI_Ibcast(s.header, 2, MPI_INT, root, comm, &s.reqs[0]);
+        if (status == 0 && !fits) {
+            ERR << "broadcast: segment of " << count << " elements takes up "
+                << s.buf.size() << " bytes, which exceeds the int range" << std::endl;
+            break;
+        }
+        if (status == 0) {
+            rec.sent(s.buf.size());
+            status = MPI_Ibcast(s.buf.data(), s.header[1], MPI_PACKED, root, comm, &s.reqs[1]);
+        }
+        if (status != 0) {
+            ERR << "MPI_Ibcast returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+    }
+
+    for (slot &s : slots) {
+        int status = MPI_Waitall(2, s.reqs, MPI_STATUSES_IGNORE);
+        if (status != 0) {
+            ERR << "MPI_Waitall returned " << status << ", errno " << errno << std::endl;
+        }
+    }
+    // Hand the first slot's memory back to the workspace
+    first.swap(slots[0].buf);
+}
+
+// Receiving side of a segmented broadcast of `total` elements. The header of
+// the next segment and the archive of the current one are in flight while
+// the previous segment is deserialized.
+template <typename T>
+void recv_segments(const boost::mpi::communicator &comm, std::vector<T> &data,
+                   int root, size_t total, instrument::recorder &rec) {
+    typedef std::integral_constant<bool, is_ragged<T>::value> ragged;
+    struct slot {
+        archive_buffer buf;
+        int header[2];
+        MPI_Request reqs[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+        size_t offset = 0, count = 0;
+    };
+    slot slots[broadcast_segments_in_flight];
+    data.resize(total);
+
+    rec.enter(instrument::phase::transfer);
+    int status = MPI_Ibcast(slots[0].header, 2, MPI_INT, root, comm, &slots[0].reqs[0]);
+    size_t announced = 0;
+    for (size_t k = 0; status == 0; ++k) {
+        slot &s = slots[k % broadcast_segments_in_flight],
+            &next = slots[(k + 1) % broadcast_segments_in_flight],
+            &prev = slots[(k + broadcast_segments_in_flight - 1) % broadcast_segments_in_flight];
+
+        // Receive the header, then start receiving the archive and the next
+        // header, in the same order as the root
+        rec.enter(instrument::phase::transfer);
+        status = MPI_Wait(&s.reqs[0], MPI_STATUS_IGNORE);
+        if (status != 0) break;
+        if (s.header[1] < 0) {
+            // The root could not send this segment
+            for (slot &other : slots) {
+                MPI_Waitall(2, other.reqs, MPI_STATUSES_IGNORE);
+            }
+            ERR << "broadcast: root aborted a segmented broadcast after "
+                << announced << " of " << total << " elements" << std::endl;
+            return;
+        }
+        s.offset = announced;
+        s.count = static_cast<size_t>(s.header[0]);
+        announced += s.count;
+        s.buf.resize(static_cast<size_t>(s.header[1]));
+        rec.received(s.buf.size());
+        status = MPI_Ibcast(s.buf.data(), s.header[1], MPI_PACKED, root, comm, &s.reqs[1]);
+        if (status != 0) break;
+        const bool more = announced < total;
+        if (more) {
+            // The header of the segment that last used `next` has been
+            // read. Receiving the next header into it leaves that segment's
+            // archive alone, which may still be waiting to be unpacked below.
+            status = MPI_Ibcast(next.header, 2, MPI_INT, root, comm, &next.reqs[0]);
+            if (status != 0) break;
+        }
+
+        // Deserialize the previous segment while this one is in flight
+        if (k > 0) {
+            status = MPI_Wait(&prev.reqs[1], MPI_STATUS_IGNORE);
+            if (status != 0) break;
+            rec.enter(instrument::phase::deserialize);
+            unpack_broadcast_segment(comm, prev.buf, data.data() + prev.offset, prev.count, ragged());
+        }
+        if (!more) {
+            rec.enter(instrument::phase::transfer);
+            status = MPI_Wait(&s.reqs[1], MPI_STATUS_IGNORE);
+            if (status != 0) break;
+            rec.enter(instrument::phase::deserialize);
+            unpack_broadcast_segment(comm, s.buf, data.data() + s.offset, s.count, ragged());
+            return;
+        }
+    }
+    ERR << "MPI_Ibcast returned " << status << ", errno " << errno << std::endl;
+}
+
+
+// Broadcast `size` trivial (enough) elements at `data` on the root into `out`
+// on all other PEs, without initializing it first (see output.h). `data` is
+// ignored on all PEs except the root, `out` is not touched on the root.
+// Returns the number of elements broadcast.
+template <typename T, typename transmit_type = default_transmit_type<T>>
+size_t broadcast(const boost::mpi::communicator &comm, const T *data, size_t size,
+                 output<T> out, int root) {
+    static_assert(is_trivial_enough<T>::value, "output<T> requires trivial (enough) T");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    if (comm.size() < 2) return size;
+    instrument::recorder rec(comm, instrument::operation::broadcast);
+    rec.taken(instrument::path::trivial);
+    rec.enter(instrument::phase::size_exchange);
+    uint64_t count = size;
+    boost::mpi::broadcast(comm, count, root);
+
+    std::vector<T> discard;
+    T *ptr = const_cast<T*>(data);
+    if (comm.rank() != root) {
+        ptr = out.prepare(count);
+        if (ptr == nullptr && out.size() > 0) {
+            // Still take part in the broadcast, but discard the data
+            ERR << "broadcast: output buffer too small for " << count << " elements" << std::endl;
+            discard.resize(count);
+            ptr = discard.data();
+        }
+    }
+
+    rec.enter(instrument::phase::transfer);
+    if (comm.rank() == root) rec.sent(count * sizeof(T));
+    else rec.received(count * sizeof(T));
+    int status = bcast_large(ptr, count * sizeof(T)/sizeof(transmit_type),
+                             transmit_datatype<transmit_type>(), root, comm);
+    if (status != 0) {
+        ERR << "MPI_Bcast returned non-zero value " << status
+            << ", errno: " << errno << std::endl;
+    }
+    return count;
+}
+
+// Broadcast trivial (enough) data without its padding, see packed.h
+template <typename T>
+void broadcast_packed(const boost::mpi::communicator &comm, std::vector<T> &data, int root,
+                      workspace &ws) {
+    if (comm.rank() == root) {
+        pack(data, ws.packed);
+    }
+    broadcast<uint8_t>(comm, ws.packed.data(), ws.packed.size(), into(ws.packed_recv), root);
+    if (comm.rank() != root) {
+        unpack(ws.packed_recv, data);
+    }
+}
+
+
+// Pass the same workspace to repeated calls to avoid allocating scratch space
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void broadcast(const boost::mpi::communicator &comm, std::vector<T> &data, int root,
+               workspace &ws) {
     const bool trivial = is_trivial_enough<T>::value;
     static_assert(!trivial || boost::mpi::is_mpi_datatype<T>() ||
         ((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T)),
         "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
 
     if (comm.size() < 2) return;
+    if (packed_wire<T>::value) {
+        broadcast_packed<T>(comm, data, root, ws);
+        return;
+    }
+    instrument::recorder rec(comm, instrument::operation::broadcast);
     if (trivial) {
+        rec.taken(instrument::path::trivial);
+        rec.enter(instrument::phase::size_exchange);
         // MPI only supports "int" as size type, and the MPI Forum's reply to
         // the issue can be summed up as "deal with it" (they refer to user-
         // defined contiguous data types, e.g. ones that hold 1024 elements)
-        // MPI really hasn't moved on since the 90's...
-        int size = static_cast<int>(data.size());
+        // MPI really hasn't moved on since the 90's... bcast_large deals with
+        // it by splitting oversized broadcasts into chunks.
+        uint64_t size = data.size();
         // broadcast size and allocate space
-        boost::mpi::broadcast<int>(comm, size, root);
+        boost::mpi::broadcast(comm, size, root);
         data.resize(size); // harmless on root, required on others
         // broadcast elements as transmit_type
-        auto ptr = reinterpret_cast<transmit_type*>(data.data());
-        size = static_cast<int>(size * sizeof(T)/sizeof(transmit_type));
-        boost::mpi::broadcast(comm, ptr, size, root);
+        rec.enter(instrument::phase::transfer);
+        if (comm.rank() == root) rec.sent(data.size() * sizeof(T));
+        else rec.received(data.size() * sizeof(T));
+        int status = bcast_large(data.data(), size * sizeof(T)/sizeof(transmit_type),
+                                 transmit_datatype<transmit_type>(), root, comm);
+        if (status != 0) {
+            ERR << "MPI_Bcast returned non-zero value " << status
+                << ", errno: " << errno << std::endl;
+        }
     } else if (boost::mpi::is_mpi_datatype<T>()) {
         // We can use Boost.MPI directly to transmit MPI datatypes
         // But send size and data separately to avoid vector serialization
@@ -61,39 +346,193 @@ void broadcast(const boost::mpi::communicator &comm, std::vector<T> &data, int r
     } else {
         // Boost.MPI doesn't use MPI_Broadcast for types it doesn't know. WTF.
         // Therefore, we need to do the archive broadcast ourselves.
+        // The archive size is broadcast together with the first eager_limit
+        // bytes of the archive, so small archives need only one round.
+        // Vectors whose archive would exceed broadcast_segment_bytes are
+        // broadcast in segments instead, which is announced by a negative
+        // archive size. The root packs the first segment to find out.
+        typedef std::integral_constant<bool, is_ragged<T>::value> ragged;
+        rec.taken(ragged::value ? instrument::path::ragged : instrument::path::serialized);
+        eager_block block;
+        archive_buffer &send = ws.send_buffer, &recv = ws.recv_buffer;
+        size_t first_count = 0;
         if (comm.rank() == root) {
-            // Serialize data
-            boost::mpi::packed_oarchive oa(comm);
-            oa << data;
-            // Broadcast archive size
-            size_t archive_size = oa.size();
-            boost::mpi::broadcast(comm, archive_size, root);
-            // Broadcast archive data
-            auto sendptr = const_cast<void*>(oa.address());
-            int status = MPI_Bcast(sendptr, static_cast<int>(archive_size),
-                                   MPI_PACKED, root, comm);
-            if (status != 0) {
-                ERR << "MPI_Bcast returned non-zero value " << status
-                    << ", errno: " << errno << std::endl;
+            rec.enter(instrument::phase::serialize);
+            first_count = pack_segment(comm, data, 0, send, ws.block_buffers, ragged());
+            block.in_size = static_cast<int>(data.size());
+            if (first_count < data.size() ||
+                send.size() > static_cast<size_t>(std::numeric_limits<int>::max())) {
+                block.transmit_size = -1;
+            } else {
+                block.transmit_size = static_cast<int>(send.size());
+                memcpy(block.payload, send.data(), block.inline_size());
+            }
+        }
+
+        // Broadcast archive size and start of the archive
+        rec.enter(instrument::phase::size_exchange);
+        int status = MPI_Bcast(&block, sizeof(eager_block), MPI_BYTE, root, comm);
+        if (status != 0) {
+            ERR << "MPI_Bcast returned non-zero value " << status
+                << ", errno: " << errno << std::endl;
+            return;
+        }
+
+        if (block.transmit_size < 0) {
+            if (comm.rank() == root) {
+                send_segments(comm, data, root, send, first_count, rec);
+            } else {
+                recv_segments(comm, data, root, static_cast<size_t>(block.in_size), rec);
             }
+            return;
+        }
+
+        char *ptr;
+        if (comm.rank() == root) {
+            ptr = send.data();
         } else {
-            // Receive archive size and allocate space
-            size_t archive_size;
-            boost::mpi::broadcast(comm, archive_size, root);
-            boost::mpi::packed_iarchive ia(comm);
-            ia.resize(archive_size);
-            // Receive broadcast archive data
-            auto recvptr = ia.address();
-            int status = MPI_Bcast(recvptr, static_cast<int>(archive_size),
-                                   MPI_PACKED, root, comm);
+            // Allocate space and copy the part we already received
+            recv.resize(static_cast<size_t>(block.transmit_size));
+            ptr = recv.data();
+            memcpy(ptr, block.payload, block.inline_size());
+        }
+
+        // Broadcast the rest of the archive
+        if (comm.rank() == root) rec.sent(static_cast<size_t>(block.transmit_size));
+        else rec.received(static_cast<size_t>(block.transmit_size));
+        if (block.rest_size() > 0) {
+            rec.enter(instrument::phase::transfer);
+            status = MPI_Bcast(ptr + block.inline_size(), block.rest_size(),
+                               MPI_PACKED, root, comm);
             if (status != 0) {
                 ERR << "MPI_Bcast returned non-zero value " << status
                     << ", errno: " << errno << std::endl;
                 return;
             }
-            // Unpack received data
-            ia >> data;
+        }
+
+        // Unpack received data
+        if (comm.rank() != root) {
+            rec.enter(instrument::phase::deserialize);
+            data.resize(static_cast<size_t>(block.in_size));
+            unpack_broadcast_segment(comm, recv, data.data(), data.size(), ragged());
+        }
+    }
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void broadcast(const boost::mpi::communicator &comm, std::vector<T> &data, int root) {
+    workspace ws;
+    broadcast<T, transmit_type>(comm, data, root, ws);
+}
+
+// Compress trivial (enough) data with `codec` before broadcasting it, see
+// codec.h
+template <typename T, typename Codec>
+void broadcast(const boost::mpi::communicator &comm, std::vector<T> &data, int root,
+               const Codec &codec, workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "codecs require trivial (enough) T");
+    if (comm.rank() == root) {
+        codec::encode_frame(codec, data.data(), data.size(), ws.packed);
+    }
+    broadcast<uint8_t>(comm, ws.packed.data(), ws.packed.size(), into(ws.packed_recv), root);
+    if (comm.rank() != root) {
+        const uint8_t *frame = ws.packed_recv.data();
+        data.resize(codec::frame_count<T>(frame, ws.packed_recv.size()));
+        codec::decode_frame(codec, frame, ws.packed_recv.size(), data.data());
+    }
+}
+
+template <typename T, typename Codec>
+typename std::enable_if<codec::is_codec<Codec>::value>::type
+broadcast(const boost::mpi::communicator &comm, std::vector<T> &data, int root,
+          const Codec &codec) {
+    workspace ws;
+    broadcast(comm, data, root, codec, ws);
+}
+
+// Nonblocking variant of broadcast. `data` must stay alive until the returned
+// request has completed. For types that need serialization, the root packs
+// `data` right away and receivers deserialize it in wait().
+template <typename T, typename transmit_type = default_transmit_type<T>>
+request ibroadcast(const boost::mpi::communicator &comm, std::vector<T> &data, int root) {
+    const bool trivial = is_trivial_enough<T>::value;
+    static_assert(!trivial ||
+        ((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T)),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    struct state_t {
+        explicit state_t(const boost::mpi::communicator &comm) : oa(comm), ia(comm) {}
+        size_t size; // number of elements if trivial, archive size otherwise
+        vector_oarchive<T> oa;
+        vector_iarchive<T> ia;
+    };
+    request result;
+    if (comm.size() < 2) return result;
+
+    const bool is_root = (comm.rank() == root);
+    auto state = std::make_shared<state_t>(comm);
+    result.hold(state);
+
+    if (is_root) {
+        if (trivial) {
+            state->size = data.size();
+        } else {
+            state->oa << data;
+            state->size = state->oa.size();
         }
     }
+
+    // Step 1: broadcast size
+    const auto size_type = boost::mpi::get_mpi_datatype<size_t>();
+    MPI_Request req;
+    int status = MPI_Ibcast(&state->size, 1, size_type, root, comm, &req);
+    if (status != 0) {
+        ERR << "MPI_Ibcast returned non-zero value " << status
+            << ", errno: " << errno << std::endl;
+        return result;
+    }
+    result.add(req);
+
+    // Step 2: allocate space and broadcast the payload on the operation's own
+    // communicator, see request.h
+    const std::shared_ptr<MPI_Comm> dup = result.dup(comm);
+    result.then([state, dup, trivial, is_root, root, &data](request &r) {
+        void *ptr;
+        size_t count;
+        MPI_Datatype datatype;
+        if (trivial) {
+            data.resize(state->size); // harmless on root, required on others
+            ptr = data.data();
+            count = state->size * sizeof(T)/sizeof(transmit_type);
+            datatype = transmit_datatype<transmit_type>();
+        } else {
+            if (is_root) {
+                ptr = const_cast<void*>(state->oa.address());
+            } else {
+                state->ia.resize(state->size);
+                ptr = state->ia.address();
+            }
+            count = state->size;
+            datatype = MPI_PACKED;
+        }
+        if (count == 0) return;
+
+        std::vector<MPI_Request> reqs;
+        int status = ibcast_large(ptr, count, datatype, root, *dup, reqs);
+        if (status != 0) {
+            ERR << "MPI_Ibcast returned non-zero value " << status
+                << ", errno: " << errno << std::endl;
+        }
+        for (MPI_Request req : reqs) r.add(req);
+
+        // Step 3: unpack received data once the user waits for it
+        if (!trivial && !is_root) {
+            r.finally([state, &data]() {
+                state->ia >> data;
+            });
+        }
+    });
+    return result;
 }
 }
@@ -0,0 +1,290 @@
+#pragma once
+
+/*
+ * codec.h  -- Compress trivial data before transmitting it
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace unsafe_mpi {
+namespace codec {
+
+/*
+ * Codecs encode the elements of a trivial (enough) type into bytes before
+ * allgatherv, gatherv, broadcast, send or recv transmit them, and decode
+ * them on the receiving side. Derive from `base` and provide
+ *
+ *     // Append the encoding of `count` elements at `in` to `out`
+ *     template <typename T>
+ *     void encode(const T *in, size_t count, std::vector<uint8_t> &out) const;
+ *
+ *     // Decode `size` bytes at `in` into `count` elements at `out`
+ *     template <typename T>
+ *     void decode(const uint8_t *in, size_t size, T *out, size_t count) const;
+ *
+ * Messages smaller than `threshold` bytes are sent as they are, and so are
+ * those that the codec doesn't make smaller.
+ */
+struct base {
+    static const size_t default_threshold = 4096;
+
+    explicit base(size_t threshold = default_threshold) : threshold(threshold) {}
+
+    size_t threshold;
+};
+
+template <typename C>
+struct is_codec : public std::is_base_of<base, C> {};
+
+
+// Unsigned LEB128 varints, seven bits per byte
+inline void put_varint(uint64_t value, std::vector<uint8_t> &out) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline uint64_t get_varint(const uint8_t *&in) {
+    uint64_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+        const uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte < 0x80) return value;
+    }
+}
+
+
+/*
+ * Sorted integers: store the differences between consecutive elements as
+ * varints. Differences are zigzag-encoded, so unsorted input still works, but
+ * sorted keys and ID lists with small gaps shrink the most.
+ */
+struct delta_varint : public base {
+    using base::base;
+
+    template <typename T>
+    void encode(const T *in, size_t count, std::vector<uint8_t> &out) const {
+        static_assert(std::is_integral<T>::value && !std::is_same<T, bool>::value,
+                      "delta_varint requires an integer type");
+        typedef typename std::make_unsigned<T>::type U;
+        typedef typename std::make_signed<T>::type S;
+        U prev = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const U value = static_cast<U>(in[i]);
+            const int64_t delta = static_cast<S>(static_cast<U>(value - prev));
+            put_varint((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63), out);
+            prev = value;
+        }
+    }
+
+    template <typename T>
+    void decode(const uint8_t *in, size_t, T *out, size_t count) const {
+        typedef typename std::make_unsigned<T>::type U;
+        U prev = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const uint64_t zigzag = get_varint(in);
+            const uint64_t delta = (zigzag >> 1) ^ (0 - (zigzag & 1));
+            prev = static_cast<U>(prev + static_cast<U>(delta));
+            out[i] = static_cast<T>(prev);
+        }
+    }
+};
+
+
+/*
+ * Fast LZ77-style byte codec for repetitive data, in the spirit of LZ4. The
+ * output is a sequence of (literals, match) pairs: a token byte holding both
+ * lengths in four bits each, extended by bytes of 255 if they don't fit,
+ * followed by the literals and the match's 16-bit offset. The last sequence
+ * only has literals.
+ */
+struct lz : public base {
+    using base::base;
+
+    static const size_t min_match = 4;
+    static const int hash_bits = 12;
+
+    template <typename T>
+    void encode(const T *in, size_t count, std::vector<uint8_t> &out) const {
+        encode_bytes(reinterpret_cast<const uint8_t*>(in), count * sizeof(T), out);
+    }
+
+    template <typename T>
+    void decode(const uint8_t *in, size_t size, T *out, size_t count) const {
+        decode_bytes(in, size, reinterpret_cast<uint8_t*>(out), count * sizeof(T));
+    }
+
+    static void encode_bytes(const uint8_t *in, size_t size, std::vector<uint8_t> &out) {
+        // Most recent position + 1 of every hashed four-byte sequence, 0 if none
+        std::vector<uint32_t> table(size_t(1) << hash_bits, 0);
+        size_t pos = 0, anchor = 0;
+        while (size >= min_match && pos <= size - min_match) {
+            const uint32_t word = read32(in + pos);
+            uint32_t &entry = table[(word * 2654435761u) >> (32 - hash_bits)];
+            const size_t candidate = entry;
+            entry = static_cast<uint32_t>(pos + 1);
+            if (candidate == 0 || pos + 1 - candidate > 0xffff ||
+                read32(in + candidate - 1) != word) {
+                ++pos;
+                continue;
+            }
+
+            const size_t match = candidate - 1;
+            size_t length = min_match;
+            while (pos + length < size && in[match + length] == in[pos + length]) {
+                ++length;
+            }
+            put_sequence(in + anchor, pos - anchor, length, out);
+            const size_t offset = pos - match;
+            out.push_back(static_cast<uint8_t>(offset));
+            out.push_back(static_cast<uint8_t>(offset >> 8));
+            put_length(length - min_match, out);
+            pos += length;
+            anchor = pos;
+        }
+        put_sequence(in + anchor, size - anchor, min_match, out);
+    }
+
+    static void decode_bytes(const uint8_t *in, size_t size, uint8_t *out, size_t out_size) {
+        const uint8_t *end = in + size;
+        uint8_t *const out_end = out + out_size;
+        while (in < end) {
+            const uint8_t token = *in++;
+            const size_t literals = get_length(token >> 4, in);
+            memcpy(out, in, literals);
+            in += literals;
+            out += literals;
+            if (in >= end || out >= out_end) break;
+
+            const size_t offset = static_cast<size_t>(in[0]) | (static_cast<size_t>(in[1]) << 8);
+            in += 2;
+            const size_t length = get_length(token & 15, in) + min_match;
+            // Byte by byte, the match may overlap with its own output
+            const uint8_t *from = out - offset;
+            for (size_t i = 0; i < length; ++i) {
+                out[i] = from[i];
+            }
+            out += length;
+        }
+    }
+
+private:
+    static uint32_t read32(const uint8_t *ptr) {
+        uint32_t word;
+        memcpy(&word, ptr, sizeof(word));
+        return word;
+    }
+
+    // Token and literals of a sequence, the match length only goes into the
+    // token here, its extension bytes follow the offset
+    static void put_sequence(const uint8_t *literals, size_t count, size_t match_length,
+                             std::vector<uint8_t> &out) {
+        const size_t match_nibble = match_length - min_match;
+        out.push_back(static_cast<uint8_t>((std::min<size_t>(count, 15) << 4) |
+                                           std::min<size_t>(match_nibble, 15)));
+        put_length(count, out);
+        out.insert(out.end(), literals, literals + count);
+    }
+
+    // Lengths of 15 or more continue in extension bytes
+    static void put_length(size_t length, std::vector<uint8_t> &out) {
+        if (length < 15) return;
+        length -= 15;
+        while (length >= 255) {
+            out.push_back(255);
+            length -= 255;
+        }
+        out.push_back(static_cast<uint8_t>(length));
+    }
+
+    static size_t get_length(size_t nibble, const uint8_t *&in) {
+        size_t length = nibble;
+        if (nibble == 15) {
+            uint8_t byte;
+            do {
+                byte = *in++;
+                length += byte;
+            } while (byte == 255);
+        }
+        return length;
+    }
+};
+
+
+/*
+ * A frame is what actually goes over the wire: one byte saying whether the
+ * data is encoded, then either the raw elements or the number of elements as
+ * a varint followed by the codec's output.
+ */
+enum : uint8_t { frame_raw = 0, frame_encoded = 1 };
+
+// Replace the contents of `out` with a frame holding `count` elements at `in`
+template <typename T, typename Codec>
+void encode_frame(const Codec &codec, const T *in, size_t count, std::vector<uint8_t> &out) {
+    const size_t raw_size = count * sizeof(T);
+    out.clear();
+    if (raw_size >= codec.threshold) {
+        out.push_back(frame_encoded);
+        put_varint(count, out);
+        codec.encode(in, count, out);
+        if (out.size() < raw_size + 1) return;
+        // Not worth it
+        out.clear();
+    }
+    out.push_back(frame_raw);
+    out.resize(1 + raw_size);
+    if (raw_size > 0) memcpy(out.data() + 1, in, raw_size);
+}
+
+// Number of elements in the frame of `size` bytes at `in`
+template <typename T>
+size_t frame_count(const uint8_t *in, size_t size) {
+    if (size == 0) return 0;
+    if (in[0] == frame_raw) return (size - 1) / sizeof(T);
+    ++in;
+    return static_cast<size_t>(get_varint(in));
+}
+
+// Decode the frame of `size` bytes at `in` into `out`, which has room for
+// frame_count<T>(in, size) elements
+template <typename T, typename Codec>
+void decode_frame(const Codec &codec, const uint8_t *in, size_t size, T *out) {
+    if (size == 0) return;
+    const uint8_t *const end = in + size;
+    if (*in++ == frame_raw) {
+        if (end > in) memcpy(out, in, static_cast<size_t>(end - in));
+        return;
+    }
+    const size_t count = static_cast<size_t>(get_varint(in));
+    codec.decode(in, static_cast<size_t>(end - in), out, count);
+}
+
+// Decode the frames of all PEs, `sizes[i]` bytes at `data + displacements[i]`
+// each, into `out` in order of rank
+template <typename T, typename Codec>
+void decode_frames(const Codec &codec, const uint8_t *data, const std::vector<uint64_t> &sizes,
+                   const std::vector<size_t> &displacements, std::vector<T> &out) {
+    size_t total = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        total += frame_count<T>(data + displacements[i], sizes[i]);
+    }
+    out.resize(total);
+    T *ptr = out.data();
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        decode_frame(codec, data + displacements[i], sizes[i], ptr);
+        ptr += frame_count<T>(data + displacements[i], sizes[i]);
+    }
+}
+
+}
+}
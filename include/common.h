@@ -7,9 +7,17 @@
  * Published under the Boost Software License, Version 1.0
  */
 
+#include <mpi.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 
+#include <boost/mpi/datatype.hpp>
+
 namespace unsafe_mpi {
 
 /*
@@ -29,4 +37,83 @@ struct is_trivial_enough<std::pair<U,V>> :
         is_trivial_enough<U>::value && is_trivial_enough<V>::value
     > {};
 
+// Same for tuples, if all of their components are
+template <>
+struct is_trivial_enough<std::tuple<>> : public std::true_type {};
+
+template <typename Head, typename... Tail>
+struct is_trivial_enough<std::tuple<Head, Tail...>> :
+    public std::integral_constant<bool,
+        is_trivial_enough<Head>::value && is_trivial_enough<std::tuple<Tail...>>::value
+    > {};
+
+// And arrays of trivial enough elements
+template <typename U, size_t N>
+struct is_trivial_enough<std::array<U, N>> : public is_trivial_enough<U> {};
+
+
+/*
+ * A block of N opaque bytes. Used as transmit_type for element types whose
+ * size is not a multiple of four, so that they can still be sent as one MPI
+ * element each instead of byte by byte.
+ */
+template <size_t N>
+struct opaque_bytes {
+    char bytes[N];
+};
+
+/*
+ * The widest type that evenly divides T, used as default transmit_type.
+ * Sizes that are a multiple of 8 or 4 use uint64_t or uint32_t, tiny types
+ * their size-matched integer, everything else a block of sizeof(T) bytes.
+ */
+template <typename T>
+struct transmit_type_for {
+    typedef typename std::conditional<sizeof(T) % sizeof(uint64_t) == 0, uint64_t,
+            typename std::conditional<sizeof(T) % sizeof(uint32_t) == 0, uint32_t,
+            typename std::conditional<sizeof(T) == sizeof(uint16_t), uint16_t,
+            typename std::conditional<sizeof(T) == sizeof(uint8_t), uint8_t,
+                                      opaque_bytes<sizeof(T)>
+            >::type>::type>::type>::type type;
+};
+
+template <typename T>
+using default_transmit_type = typename transmit_type_for<T>::type;
+
+// MPI datatype used to transmit elements of type `transmit_type`, and the
+// number of basic MPI elements (as counted by MPI_Get_elements) in one of them
+template <typename transmit_type>
+struct transmit_datatype_traits {
+    static const size_t basic_elements = 1;
+
+    static MPI_Datatype get() {
+        return boost::mpi::get_mpi_datatype<transmit_type>();
+    }
+};
+
+// Contiguous datatypes are created and committed on first use and kept until
+// MPI_Finalize, like the ones Boost.MPI creates for its own types
+template <size_t N>
+struct transmit_datatype_traits<opaque_bytes<N>> {
+    static const size_t basic_elements = N;
+
+    static MPI_Datatype get() {
+        static const MPI_Datatype type = create();
+        return type;
+    }
+
+private:
+    static MPI_Datatype create() {
+        MPI_Datatype type;
+        MPI_Type_contiguous(static_cast<int>(N), MPI_BYTE, &type);
+        MPI_Type_commit(&type);
+        return type;
+    }
+};
+
+template <typename transmit_type>
+MPI_Datatype transmit_datatype() {
+    return transmit_datatype_traits<transmit_type>::get();
+}
+
 }
@@ -10,8 +10,10 @@
 #include <errno.h>
 #include <mpi.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <numeric>
 #include <vector>
 
@@ -23,87 +25,322 @@
 #include <boost/serialization/string.hpp>
 #include <boost/serialization/vector.hpp>
 
+#include "archive.h"
+#include "codec.h"
 #include "common.h"
+#include "instrumentation.h"
+#include "large_count.h"
+#include "output.h"
+#include "packed.h"
+#include "private_comm.h"
+#include "request.h"
+#include "tuning.h"
 #include "tuple_serialization.h"
+#include "workspace.h"
 
 namespace unsafe_mpi {
 
-template <typename T, typename transmit_type = uint64_t>
+/*
+ * Binomial tree gatherv: every PE collects the data of its subtree in rank
+ * order relative to the root, and passes it on to its parent. The sizes of
+ * the subtrees come from MPI_Probe, so the total must fit into an int. The
+ * root reorders the data into `recvptr` in the end, which is cheap for the
+ * small messages this is meant for. Messages go over the private duplicate
+ * of `comm`, so that probing can't match the caller's messages.
+ */
+inline int gatherv_tree(const boost::mpi::communicator &comm, const void *sendptr,
+                        uint64_t sendsize, void *recvptr, MPI_Datatype datatype,
+                        const int root, const std::vector<size_t> &displacements) {
+    const size_t p = static_cast<size_t>(comm.size()), rank = static_cast<size_t>(comm.rank());
+    const size_t extent = datatype_extent(datatype), relative = (rank + p - root) % p;
+    char *out = static_cast<char*>(recvptr);
+    const MPI_Comm tree = private_comm(comm);
+    if (sendptr == MPI_IN_PLACE) {
+        sendptr = out + displacements[rank] * extent;
+        sendsize = displacements[rank+1] - displacements[rank];
+    }
+    std::vector<char> buffer(static_cast<const char*>(sendptr),
+                             static_cast<const char*>(sendptr) + sendsize * extent);
+
+    for (size_t mask = 1; mask < p; mask *= 2) {
+        if (relative & mask) {
+            const int parent = static_cast<int>((relative - mask + root) % p);
+            return MPI_Send(buffer.data(), static_cast<int>(buffer.size()), MPI_BYTE,
+                            parent, 0, tree);
+        }
+        if (relative + mask >= p) continue;
+        const int child = static_cast<int>((relative + mask + root) % p);
+        MPI_Status status;
+        int ret = MPI_Probe(child, 0, tree, &status);
+        if (ret != 0) return ret;
+        int count;
+        MPI_Get_count(&status, MPI_BYTE, &count);
+        const size_t offset = buffer.size();
+        buffer.resize(offset + static_cast<size_t>(count));
+        ret = MPI_Recv(buffer.data() + offset, count, MPI_BYTE, child, 0,
+                       tree, MPI_STATUS_IGNORE);
+        if (ret != 0) return ret;
+    }
+
+    // Root: the buffer holds PEs root, ..., p-1, then 0, ..., root-1
+    const size_t head = (displacements[p] - displacements[root]) * extent;
+    memcpy(out + displacements[root] * extent, buffer.data(), head);
+    memcpy(out, buffer.data() + head, displacements[root] * extent);
+    return 0;
+}
+
+/*
+ * Gatherv with the sizes and displacements in ws.sizes64 and
+ * ws.displacements64, which are only significant on the root, in elements of
+ * `datatype`. `sendptr` may be MPI_IN_PLACE on the root. Unless told
+ * otherwise, the root picks the algorithm with select_gatherv, see tuning.h.
+ */
+inline int gatherv_sized(const boost::mpi::communicator &comm, const void *sendptr,
+                         uint64_t sendsize, void *recvptr, MPI_Datatype datatype,
+                         const int root, workspace &ws,
+                         gatherv_algorithm algorithm = gatherv_algorithm::automatic) {
+    const std::vector<uint64_t> &sizes = ws.sizes64;
+    const std::vector<size_t> &displacements = ws.displacements64;
+
+    // Only the root knows the sizes, so it decides and tells the others
+    int decision[2] = { static_cast<int>(algorithm), 0 };
+    if (comm.rank() == root) {
+        decision[1] = !fits_count(displacements.back());
+        if (algorithm == gatherv_algorithm::automatic) {
+            decision[0] = static_cast<int>(select_gatherv(sizes, datatype_extent(datatype)));
+        }
+        if (decision[1] && decision[0] == static_cast<int>(gatherv_algorithm::tree)) {
+            decision[0] = static_cast<int>(gatherv_algorithm::native);
+        }
+    }
+#if UNSAFE_MPI_LARGE_COUNT
+    // MPI_Gatherv_c handles all sizes, only the algorithm needs to be sent.
+    // The root may have replaced an explicit tree by native, only native is
+    // known on all PEs.
+    if (algorithm != gatherv_algorithm::native) {
+        boost::mpi::broadcast(comm, decision, 1, root);
+    }
+    decision[1] = 1;
+#else
+    boost::mpi::broadcast(comm, decision, 2, root);
+#endif
+
+    if (static_cast<gatherv_algorithm>(decision[0]) == gatherv_algorithm::tree) {
+        return gatherv_tree(comm, sendptr, sendsize, recvptr, datatype, root, displacements);
+    }
+    if (!decision[1]) {
+        ws.sizes.assign(sizes.begin(), sizes.end());
+        ws.displacements.assign(displacements.begin(), displacements.end());
+        return MPI_Gatherv(sendptr, static_cast<int>(sendsize), datatype,
+                           recvptr, ws.sizes.data(), ws.displacements.data(),
+                           datatype, root, comm);
+    }
+    std::vector<size_t> counts(sizes.begin(), sizes.end());
+    return gatherv_large(sendptr, sendsize, recvptr, counts, displacements,
+                         datatype, root, comm);
+}
+
+// Gather into `out` without initializing it first, see output.h. `out` is
+// only used on the root.
+template <typename T, typename transmit_type = default_transmit_type<T>>
 void gatherv_trivial(const boost::mpi::communicator &comm,
-                            const std::vector<T> &in, std::vector<T> &out,
-                            const int root) {
+                            const std::vector<T> &in, output<T> out,
+                            const int root, workspace &ws) {
 
     static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
                   "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+    instrument::recorder rec(comm, instrument::operation::gatherv);
+    rec.taken(instrument::path::trivial);
+    rec.sent(in.size() * sizeof(T));
 
-    // exchange sizes
-    const int factor = sizeof(T) / sizeof(transmit_type);
-    const int sendsize = static_cast<int>(in.size() * factor);
+    // exchange sizes, 64 bit because there may be more than 2^31 elements
+    rec.enter(instrument::phase::size_exchange);
+    const size_t factor = sizeof(T) / sizeof(transmit_type);
+    const uint64_t sendsize = in.size() * factor;
 
-    const auto datatype = boost::mpi::get_mpi_datatype<transmit_type>();
+    const auto datatype = transmit_datatype<transmit_type>();
     const auto sendptr = reinterpret_cast<const transmit_type*>(in.data());
+    transmit_type *recvptr = nullptr;
+    std::vector<T> discard;
 
+    std::vector<uint64_t> &sizes = ws.sizes64;
+    std::vector<size_t> &displacements = ws.displacements64;
+    sizes.clear();
+    displacements.assign(1, 0);
     if (comm.rank() == root) {
         // Receive sizes
-        std::vector<int> sizes;
-        sizes.reserve(static_cast<size_t>(comm.size()));
         boost::mpi::gather(comm, sendsize, sizes, root);
 
         // Calculate displacements from spaces
-        std::vector<int> displacements(sizes.size() + 1);
+        displacements.resize(sizes.size() + 1);
         std::partial_sum(sizes.begin(), sizes.end(), displacements.begin() + 1);
-        const int outsize = displacements.back();
         // Allocate space
         // in terms of #elements -> divide by factor
-        out.resize(outsize / factor);
-
-        auto recvptr = reinterpret_cast<transmit_type*>(out.data());
-        MPI_Gatherv(sendptr, sendsize, datatype,
-                    recvptr, sizes.data(), displacements.data(),
-                    datatype, root, comm);
+        T *outptr = out.prepare(displacements.back() / factor);
+        if (outptr == nullptr && out.size() > 0) {
+            // Still take part in the gather, but discard the data
+            ERR << "gatherv: output buffer too small for " << out.size() << " elements" << std::endl;
+            discard.resize(out.size());
+            outptr = discard.data();
+        }
+        rec.received(out.size() * sizeof(T));
+        recvptr = reinterpret_cast<transmit_type*>(outptr);
     } else {
         // send size, then gather
         boost::mpi::gather(comm, sendsize, root);
-        MPI_Gatherv(sendptr, sendsize, datatype,
-                    nullptr, nullptr, nullptr,
-                    datatype, root, comm);
     }
+
+    rec.enter(instrument::phase::transfer);
+    int status = gatherv_sized(comm, sendptr, sendsize, recvptr, datatype, root, ws);
+    if (status != 0) {
+        ERR << "MPI_Gatherv returned " << status << ", errno " << errno << std::endl;
+    }
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void gatherv_trivial(const boost::mpi::communicator &comm,
+                            const std::vector<T> &in, output<T> out,
+                            const int root) {
+    workspace ws;
+    gatherv_trivial<T, transmit_type>(comm, in, out, root, ws);
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void gatherv_trivial(const boost::mpi::communicator &comm,
+                            const std::vector<T> &in, std::vector<T> &out,
+                            const int root, workspace &ws) {
+    gatherv_trivial<T, transmit_type>(comm, in, output<T>(out), root, ws);
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void gatherv_trivial(const boost::mpi::communicator &comm,
+                            const std::vector<T> &in, std::vector<T> &out,
+                            const int root) {
+    workspace ws;
+    gatherv_trivial<T, transmit_type>(comm, in, out, root, ws);
+}
+
+
+/*
+ * In-place gatherv of trivial (enough) data: on the root, `data` holds the
+ * root's elements on entry, and those of all PEs in order of rank on return.
+ * The root's elements are moved to their place within `data` and the others
+ * are received around them with MPI_IN_PLACE, so the root doesn't need a
+ * second copy of its data. On all other PEs, `data` is sent and left as is.
+ * Growing an uninitialized_vector<T> (see output.h) also saves zeroing the
+ * new elements.
+ */
+template <typename T, typename transmit_type = default_transmit_type<T>, typename Alloc>
+void gatherv_in_place(const boost::mpi::communicator &comm, std::vector<T, Alloc> &data,
+                      const int root, workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "gatherv_in_place requires trivial (enough) T");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+    instrument::recorder rec(comm, instrument::operation::gatherv);
+    rec.taken(instrument::path::trivial);
+    rec.sent(data.size() * sizeof(T));
+
+    rec.enter(instrument::phase::size_exchange);
+    const size_t factor = sizeof(T) / sizeof(transmit_type);
+    const size_t count = data.size();
+    const uint64_t sendsize = count * factor;
+    const auto datatype = transmit_datatype<transmit_type>();
+    const void *sendptr = data.data();
+    transmit_type *recvptr = nullptr;
+
+    std::vector<uint64_t> &sizes = ws.sizes64;
+    std::vector<size_t> &displacements = ws.displacements64;
+    sizes.clear();
+    displacements.assign(1, 0);
+    if (comm.rank() == root) {
+        boost::mpi::gather(comm, sendsize, sizes, root);
+        displacements.resize(sizes.size() + 1);
+        std::partial_sum(sizes.begin(), sizes.end(), displacements.begin() + 1);
+
+        // Make room and move the local elements to their place
+        const size_t offset = displacements[root] / factor;
+        data.resize(displacements.back() / factor);
+        if (offset > 0 && count > 0) {
+            std::copy_backward(data.begin(), data.begin() + count, data.begin() + offset + count);
+        }
+        rec.received(data.size() * sizeof(T));
+        sendptr = MPI_IN_PLACE;
+        recvptr = reinterpret_cast<transmit_type*>(data.data());
+    } else {
+        boost::mpi::gather(comm, sendsize, root);
+    }
+
+    rec.enter(instrument::phase::transfer);
+    int status = gatherv_sized(comm, sendptr, sendsize, recvptr, datatype, root, ws);
+    if (status != 0) {
+        ERR << "MPI_Gatherv returned " << status << ", errno " << errno << std::endl;
+    }
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>, typename Alloc>
+void gatherv_in_place(const boost::mpi::communicator &comm, std::vector<T, Alloc> &data,
+                      const int root) {
+    workspace ws;
+    gatherv_in_place<T, transmit_type>(comm, data, root, ws);
 }
 
 // UNTESTED, mostly copied from allgatherv
 template <typename T>
-void gatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out, const int root) {
+void gatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                       std::vector<T> &out, const int root, workspace &ws) {
+    instrument::recorder rec(comm, instrument::operation::gatherv);
+    rec.taken(is_ragged<T>::value ? instrument::path::ragged : instrument::path::serialized);
+
     // Step 1: serialize input data
-    boost::mpi::packed_oarchive oa(comm);
+    rec.enter(instrument::phase::serialize);
+    archive_buffer &send = ws.send_buffer;
     if (!in.empty())
-        oa << in;
+        pack_blocks(comm, in.data(), in.size(), send, ws.block_buffers);
 
     // Step 2: exchange sizes (archives' .size() is measured in bytes)
+    // Both sizes are gathered together to save a round of latency
     // Need to cast to int because this is what MPI uses as size_t...
     const int in_size = static_cast<int>(in.size()),
-        transmit_size = (in.empty() ? 0 : static_cast<int>(oa.size()));
+        transmit_size = (in.empty() ? 0 : static_cast<int>(send.size()));
+    const int meta[2] = {in_size, transmit_size};
     // If in.empty(), transmit_size is 0 so we don't really care
-    auto sendptr = const_cast<void*>(oa.address());
+    auto sendptr = send.data();
+    rec.sent(static_cast<size_t>(transmit_size));
 
+    rec.enter(instrument::phase::size_exchange);
     if (comm.rank() == root) {
         const size_t comm_size = static_cast<size_t>(comm.size());
-        std::vector<int> in_sizes(comm_size), transmit_sizes(comm_size);
-        boost::mpi::gather<int>(comm, in_size,       in_sizes.data(), root);
-        boost::mpi::gather<int>(comm, transmit_size, transmit_sizes.data(), root);
+        std::vector<int> &all_meta = ws.recv_meta;
+        all_meta.resize(2 * comm_size);
+        int status = MPI_Gather(const_cast<int*>(meta), 2, MPI_INT,
+                                all_meta.data(), 2, MPI_INT, root, comm);
+        if (status != 0) {
+            ERR << "MPI_Gather returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
 
         // Step 3: calculate displacements from sizes (prefix sum)
-        std::vector<int> displacements(comm_size + 1);
-        displacements[0] = sizeof(boost::mpi::packed_iarchive);
-        for (size_t i = 1; i <= comm_size; ++i) {
-            displacements[i] = displacements[i-1] + transmit_sizes[i-1];
+        std::vector<int> &in_sizes = ws.sizes, &transmit_sizes = ws.rest_sizes,
+            &displacements = ws.displacements;
+        in_sizes.resize(comm_size);
+        transmit_sizes.resize(comm_size);
+        displacements.resize(comm_size + 1);
+        displacements[0] = 0;
+        for (size_t i = 0; i < comm_size; ++i) {
+            in_sizes[i] = all_meta[2 * i];
+            transmit_sizes[i] = all_meta[2 * i + 1];
+            displacements[i+1] = displacements[i] + transmit_sizes[i];
         }
 
         // Step 4: allocate space for result and MPI_Allgatherv
-        char* recv = new char[displacements.back()];
+        archive_buffer &recv = ws.recv_buffer;
+        recv.resize(static_cast<size_t>(displacements.back()));
+        rec.received(recv.size());
+        rec.enter(instrument::phase::transfer);
 
-        int status = MPI_Gatherv(sendptr, transmit_size, MPI_PACKED, recv,
-                                 transmit_sizes.data(), displacements.data(),
-                                 MPI_PACKED, root, comm);
+        status = MPI_Gatherv(sendptr, transmit_size, MPI_PACKED, recv.data(),
+                             transmit_sizes.data(), displacements.data(),
+                             MPI_PACKED, root, comm);
 
         if (status != 0) {
             ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
@@ -112,36 +349,21 @@ void gatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T
 
 
         // Step 5: deserialize received data
-        // Preallocate storage to prevent reallocations
-        std::vector<T> temp;
-        auto largest_size = *std::max_element(in_sizes.begin(), in_sizes.end());
-        temp.reserve(largest_size);
-        out.reserve(std::accumulate(in_sizes.begin(), in_sizes.end(), 0));
-
-        // Deserialize archives one by one, inserting elements at the end of ̀out̀
-        for (size_t i = 0; i < comm_size; ++i) {
-            if (in_sizes[i] == 0) {
-                // We can ignore processes which didn't have anything to send
-                continue;
-            }
-            boost::mpi::packed_iarchive archive(comm);
-            const size_t transmit_size_i = static_cast<size_t>(transmit_sizes[i]);
-            archive.resize(transmit_size_i);
-            memcpy(archive.address(), recv + displacements[i], transmit_size_i);
-
-            temp.clear();
-            temp.resize(in_sizes[i]);
-            archive >> temp;
-            out.insert(out.end(), temp.begin(), temp.end());
-        }
+        rec.enter(instrument::phase::deserialize);
+        unpack_archives<T>(comm, recv, in_sizes, displacements, out, ws.offsets);
 
     } else {
-        boost::mpi::gather<int>(comm, in_size, root);
-        boost::mpi::gather<int>(comm, transmit_size, root);
+        int status = MPI_Gather(const_cast<int*>(meta), 2, MPI_INT,
+                                nullptr, 2, MPI_INT, root, comm);
+        if (status != 0) {
+            ERR << "MPI_Gather returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
 
-        int status = MPI_Gatherv(sendptr, transmit_size, MPI_PACKED,
-                                 nullptr, nullptr, nullptr,
-                                 MPI_PACKED, root, comm);
+        rec.enter(instrument::phase::transfer);
+        status = MPI_Gatherv(sendptr, transmit_size, MPI_PACKED,
+                             nullptr, nullptr, nullptr,
+                             MPI_PACKED, root, comm);
         if (status != 0) {
             ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
             return;
@@ -153,12 +375,226 @@ void gatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T
 }
 
 
-template <typename T, typename transmit_type = uint64_t>
+template <typename T>
+void gatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out, const int root) {
+    workspace ws;
+    gatherv_serialize(comm, in, out, root, ws);
+}
+
+
+// Gather trivial (enough) data without its padding, see packed.h
+template <typename T>
+void gatherv_packed(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                    std::vector<T> &out, const int root, workspace &ws) {
+    pack(in, ws.packed);
+    gatherv_trivial<uint8_t>(comm, ws.packed, into(ws.packed_recv), root, ws);
+    if (comm.rank() == root) {
+        unpack(ws.packed_recv, out);
+    }
+}
+
+
+// Pass the same workspace to repeated calls to avoid allocating scratch space
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void gatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out,
+             const int root, workspace &ws) {
+    if (packed_wire<T>::value) {
+        gatherv_packed<T>(comm, in, out, root, ws);
+    } else if (is_trivial_enough<T>::value) {
+        gatherv_trivial<T, transmit_type>(comm, in, out, root, ws);
+    } else {
+        gatherv_serialize<T>(comm, in, out, root, ws);
+    }
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
 void gatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out, const int root) {
+    workspace ws;
+    gatherv<T, transmit_type>(comm, in, out, root, ws);
+}
+
+// Gather trivial (enough) data into a raw buffer or a vector with any
+// allocator, or append it to a vector, see output.h
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void gatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, output<T> out,
+             const int root, workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "output<T> requires trivial (enough) T");
+    gatherv_trivial<T, transmit_type>(comm, in, out, root, ws);
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void gatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, output<T> out,
+             const int root) {
+    workspace ws;
+    gatherv<T, transmit_type>(comm, in, out, root, ws);
+}
+
+
+// Compress trivial (enough) data with `codec` before gathering it, see
+// codec.h. The sizes of the compressed frames are exchanged instead of the
+// sizes of the data.
+template <typename T, typename Codec>
+void gatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out,
+             const int root, const Codec &codec, workspace &ws) {
+    static_assert(is_trivial_enough<T>::value, "codecs require trivial (enough) T");
+    codec::encode_frame(codec, in.data(), in.size(), ws.packed);
+    gatherv_trivial<uint8_t>(comm, ws.packed, into(ws.packed_recv), root, ws);
+    if (comm.rank() == root) {
+        // gatherv_trivial leaves the frame sizes and their offsets in ws
+        codec::decode_frames(codec, ws.packed_recv.data(), ws.sizes64, ws.displacements64, out);
+    }
+}
+
+template <typename T, typename Codec>
+typename std::enable_if<codec::is_codec<Codec>::value>::type
+gatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out,
+        const int root, const Codec &codec) {
+    workspace ws;
+    gatherv(comm, in, out, root, codec, ws);
+}
+
+
+// Nonblocking variant of gatherv_trivial. `in` and `out` must stay alive
+// until the returned request has completed.
+template <typename T, typename transmit_type = default_transmit_type<T>>
+request igatherv_trivial(const boost::mpi::communicator &comm,
+                         const std::vector<T> &in, std::vector<T> &out,
+                         const int root) {
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    struct state_t {
+        int sendsize;
+        std::vector<int> sizes, displacements;
+    };
+    const int factor = sizeof(T) / sizeof(transmit_type);
+    const bool is_root = (comm.rank() == root);
+    auto state = std::make_shared<state_t>();
+    state->sendsize = static_cast<int>(in.size() * factor);
+    if (is_root) state->sizes.resize(static_cast<size_t>(comm.size()));
+
+    request result;
+    result.hold(state);
+
+    // exchange sizes
+    MPI_Request req;
+    int status = MPI_Igather(&state->sendsize, 1, MPI_INT, state->sizes.data(), 1, MPI_INT,
+                             root, comm, &req);
+    if (status != 0) {
+        ERR << "MPI_Igather returned " << status << ", errno " << errno << std::endl;
+        return result;
+    }
+    result.add(req);
+
+    // gather the data on the operation's own communicator, see request.h
+    const std::shared_ptr<MPI_Comm> dup = result.dup(comm);
+    const auto sendptr = reinterpret_cast<const transmit_type*>(in.data());
+    result.then([state, dup, sendptr, factor, is_root, root, &out](request &r) {
+        const auto datatype = transmit_datatype<transmit_type>();
+        transmit_type *recvptr = nullptr;
+        if (is_root) {
+            // Calculate displacements from sizes and allocate space
+            state->displacements.resize(state->sizes.size() + 1);
+            std::partial_sum(state->sizes.begin(), state->sizes.end(),
+                             state->displacements.begin() + 1);
+            out.resize(state->displacements.back() / factor);
+            recvptr = reinterpret_cast<transmit_type*>(out.data());
+        }
+        MPI_Request req;
+        int status = MPI_Igatherv(sendptr, state->sendsize, datatype,
+                                  recvptr, state->sizes.data(), state->displacements.data(),
+                                  datatype, root, *dup, &req);
+        if (status != 0) {
+            ERR << "MPI_Igatherv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        r.add(req);
+    });
+    return result;
+}
+
+
+// Nonblocking variant of gatherv_serialize. Input is serialized right away,
+// so `in` may be destroyed immediately. Deserialization happens in wait().
+template <typename T>
+request igatherv_serialize(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out, const int root) {
+    struct state_t {
+        archive_buffer send;
+        int meta[2]; // number of elements, archive size
+        std::vector<int> all_meta, in_sizes, transmit_sizes, displacements;
+        archive_buffer recv;
+    };
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    const bool is_root = (comm.rank() == root);
+    auto state = std::make_shared<state_t>();
+
+    // Step 1: serialize input data
+    if (!in.empty())
+        pack_blocks(comm, in.data(), in.size(), state->send);
+    state->meta[0] = static_cast<int>(in.size());
+    state->meta[1] = (in.empty() ? 0 : static_cast<int>(state->send.size()));
+    if (is_root) state->all_meta.resize(2 * comm_size);
+
+    request result;
+    result.hold(state);
+
+    // Step 2: gather both sizes in one go
+    MPI_Request req;
+    int status = MPI_Igather(state->meta, 2, MPI_INT, state->all_meta.data(), 2, MPI_INT,
+                             root, comm, &req);
+    if (status != 0) {
+        ERR << "MPI_Igather returned " << status << ", errno " << errno << std::endl;
+        return result;
+    }
+    result.add(req);
+
+    // Step 3: calculate displacements and start data exchange on the
+    // operation's own communicator, see request.h
+    const boost::mpi::communicator comm_copy = comm;
+    const std::shared_ptr<MPI_Comm> dup = result.dup(comm);
+    result.then([state, comm_copy, dup, comm_size, is_root, root, &out](request &r) {
+        if (is_root) {
+            state->in_sizes.resize(comm_size);
+            state->transmit_sizes.resize(comm_size);
+            state->displacements.resize(comm_size + 1);
+            state->displacements[0] = 0;
+            for (size_t i = 0; i < comm_size; ++i) {
+                state->in_sizes[i] = state->all_meta[2 * i];
+                state->transmit_sizes[i] = state->all_meta[2 * i + 1];
+                state->displacements[i+1] = state->displacements[i] + state->transmit_sizes[i];
+            }
+            state->recv.resize(static_cast<size_t>(state->displacements.back()));
+        }
+
+        auto sendptr = state->send.data();
+        MPI_Request req;
+        int status = MPI_Igatherv(sendptr, state->meta[1], MPI_PACKED, state->recv.data(),
+                                  state->transmit_sizes.data(), state->displacements.data(),
+                                  MPI_PACKED, root, *dup, &req);
+        if (status != 0) {
+            ERR << "MPI_Igatherv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        r.add(req);
+
+        // Step 4: deserialize received data once the user waits for it
+        if (is_root) {
+            r.finally([state, comm_copy, &out]() {
+                unpack_archives<T>(comm_copy, state->recv, state->in_sizes,
+                                   state->displacements, out);
+            });
+        }
+    });
+    return result;
+}
+
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+request igatherv(const boost::mpi::communicator &comm, const std::vector<T> &in, std::vector<T> &out, const int root) {
     if (is_trivial_enough<T>::value) {
-        gatherv_trivial<T, transmit_type>(comm, in, out, root);
+        return igatherv_trivial<T, transmit_type>(comm, in, out, root);
     } else {
-        gatherv_serialize<T>(comm, in, out, root);
+        return igatherv_serialize<T>(comm, in, out, root);
     }
 }
 
@@ -0,0 +1,331 @@
+#pragma once
+
+/*
+ * hierarchical.h  -- Node-aware allgatherv and broadcast for trivial types
+ *
+ * The communicator is split into nodes, i.e. groups of PEs that share memory.
+ * Only one PE per node, its leader, exchanges data with other nodes. The
+ * result is stored once per node in an MPI-3 shared memory window, from which
+ * all PEs of the node read it.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/communicator.hpp>
+
+#include "common.h"
+#include "large_count.h"
+
+namespace unsafe_mpi {
+
+/*
+ * Node structure of a communicator. Creating it is collective and involves
+ * several communicator splits, so keep it around and reuse it.
+ *
+ * `ranks_per_node` splits nodes further into groups of at most this many PEs,
+ * e.g. one per socket. This also allows testing with several nodes on a
+ * single machine.
+ */
+class hierarchy {
+public:
+    explicit hierarchy(const boost::mpi::communicator &comm, int ranks_per_node = 0)
+        : comm_(comm)
+    {
+        MPI_Comm node;
+        int status = MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, comm.rank(),
+                                         MPI_INFO_NULL, &node);
+        if (status != 0) {
+            ERR << "MPI_Comm_split_type returned " << status << ", errno " << errno << std::endl;
+        }
+        if (ranks_per_node > 0) {
+            int node_rank;
+            MPI_Comm_rank(node, &node_rank);
+            MPI_Comm group;
+            MPI_Comm_split(node, node_rank / ranks_per_node, node_rank, &group);
+            MPI_Comm_free(&node);
+            node = group;
+        }
+        node_ = boost::mpi::communicator(node, boost::mpi::comm_take_ownership);
+
+        // The leader is the node's lowest rank. Leaders are ordered by rank.
+        MPI_Comm leaders;
+        MPI_Comm_split(comm, is_leader() ? 0 : MPI_UNDEFINED, comm.rank(), &leaders);
+        int index = 0;
+        if (is_leader()) {
+            leaders_ = boost::mpi::communicator(leaders, boost::mpi::comm_take_ownership);
+            index = leaders_.rank();
+        }
+
+        // Node index of every PE, which is its leader's rank in leaders()
+        boost::mpi::broadcast(node_, index, 0);
+        boost::mpi::all_gather(comm, index, node_of_);
+        num_nodes_ = static_cast<size_t>(*std::max_element(node_of_.begin(), node_of_.end())) + 1;
+        contiguous_ = std::is_sorted(node_of_.begin(), node_of_.end());
+    }
+
+    const boost::mpi::communicator& comm() const { return comm_; }
+    // PEs on the same node as this one
+    const boost::mpi::communicator& node() const { return node_; }
+    // Communicator of all node leaders, only valid if is_leader()
+    const boost::mpi::communicator& leaders() const { return leaders_; }
+
+    bool is_leader() const { return node_.rank() == 0; }
+    size_t num_nodes() const { return num_nodes_; }
+    // Index of the node that PE `rank` of comm() is on
+    int node_of(int rank) const { return node_of_[static_cast<size_t>(rank)]; }
+    // Whether every node holds a consecutive range of ranks
+    bool contiguous() const { return contiguous_; }
+
+private:
+    boost::mpi::communicator comm_, node_, leaders_;
+    std::vector<int> node_of_;
+    size_t num_nodes_;
+    bool contiguous_;
+};
+
+
+/*
+ * An array of trivial elements in a shared memory window, allocated by the
+ * node leader and accessible to all PEs of the node. Creating and destroying
+ * it is collective over the node.
+ */
+template <typename T>
+class shared_vector {
+    static_assert(is_trivial_enough<T>::value,
+        "shared_vector requires a trivial enough element type");
+
+public:
+    shared_vector() = default;
+
+    shared_vector(const boost::mpi::communicator &node, size_t size)
+        : node_(node), size_(size)
+    {
+        const MPI_Aint bytes = static_cast<MPI_Aint>(node.rank() == 0 ? size * sizeof(T) : 0);
+        void *base;
+        int status = MPI_Win_allocate_shared(bytes, sizeof(T), MPI_INFO_NULL, node, &base, &win_);
+        if (status != 0) {
+            ERR << "MPI_Win_allocate_shared returned " << status << ", errno " << errno << std::endl;
+            win_ = MPI_WIN_NULL;
+            size_ = 0;
+            return;
+        }
+        MPI_Aint leader_bytes;
+        int disp_unit;
+        MPI_Win_shared_query(win_, 0, &leader_bytes, &disp_unit, &base);
+        data_ = static_cast<T*>(base);
+        // Passive target epoch for the lifetime of the window, so that sync()
+        // can order plain loads and stores with MPI_Win_sync
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, win_);
+    }
+
+    ~shared_vector() {
+        if (win_ != MPI_WIN_NULL) {
+            MPI_Win_unlock_all(win_);
+            MPI_Win_free(&win_);
+        }
+    }
+
+    shared_vector(shared_vector &&other) { *this = std::move(other); }
+    shared_vector& operator=(shared_vector &&other) {
+        std::swap(node_, other.node_);
+        std::swap(win_, other.win_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+    shared_vector(const shared_vector&) = delete;
+    shared_vector& operator=(const shared_vector&) = delete;
+
+    // Collective over the node: make all writes so far visible to every PE
+    void sync() {
+        MPI_Win_sync(win_);
+        MPI_Barrier(node_);
+        MPI_Win_sync(win_);
+    }
+
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+private:
+    boost::mpi::communicator node_;
+    MPI_Win win_ = MPI_WIN_NULL;
+    T *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+
+// Leaders exchange the data of their nodes, each of which is spread over
+// several ranges of `out`. Every node's ranges are described by a derived
+// datatype over elements of transmit_type, so that ranges of any size can be
+// sent and received directly with one message per pair of leaders.
+template <typename T, typename transmit_type>
+int exchange_node_ranges(const hierarchy &h, const std::vector<uint64_t> &sizes,
+                         const std::vector<size_t> &offsets, T *out) {
+    const size_t num_nodes = h.num_nodes();
+    const size_t factor = sizeof(T) / sizeof(transmit_type);
+    const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+
+    // One block per non-empty range, of a type that covers the whole range
+    std::vector<std::vector<int>> lengths(num_nodes);
+    std::vector<std::vector<MPI_Aint>> displacements(num_nodes);
+    std::vector<std::vector<MPI_Datatype>> range_types(num_nodes);
+    std::vector<std::unique_ptr<large_datatype>> ranges;
+    for (size_t r = 0; r < sizes.size(); ++r) {
+        if (sizes[r] == 0) continue;
+        const size_t node = static_cast<size_t>(h.node_of(static_cast<int>(r)));
+        ranges.emplace_back(new large_datatype(sizes[r] * factor, datatype));
+        lengths[node].push_back(ranges.back()->count());
+        displacements[node].push_back(static_cast<MPI_Aint>(offsets[r] * sizeof(T)));
+        range_types[node].push_back(ranges.back()->type());
+    }
+
+    std::vector<MPI_Datatype> types(num_nodes);
+    for (size_t k = 0; k < num_nodes; ++k) {
+        MPI_Type_create_struct(static_cast<int>(lengths[k].size()), lengths[k].data(),
+                               displacements[k].data(), range_types[k].data(), &types[k]);
+        MPI_Type_commit(&types[k]);
+    }
+    ranges.clear();
+
+    // Send our node's ranges to every other leader, receive theirs. The send
+    // and receive ranges are disjoint parts of `out`. leaders() is private
+    // to the hierarchy, so the messages can't be confused with the caller's.
+    const boost::mpi::communicator &leaders = h.leaders();
+    const int self = leaders.rank();
+    std::vector<MPI_Request> requests;
+    int status = 0;
+    for (int k = 0; k < static_cast<int>(num_nodes) && status == 0; ++k) {
+        if (k == self) continue;
+        MPI_Request req;
+        status = MPI_Irecv(out, 1, types[static_cast<size_t>(k)], k, 0, leaders, &req);
+        if (status != 0) break;
+        requests.push_back(req);
+        status = MPI_Isend(out, 1, types[static_cast<size_t>(self)], k, 0, leaders, &req);
+        if (status != 0) break;
+        requests.push_back(req);
+    }
+    const int wait_status = MPI_Waitall(static_cast<int>(requests.size()), requests.data(),
+                                        MPI_STATUSES_IGNORE);
+
+    for (MPI_Datatype &type : types) {
+        MPI_Type_free(&type);
+    }
+    return status != 0 ? status : wait_status;
+}
+
+
+/*
+ * Allgatherv whose result is stored once per node. Every PE writes its input
+ * into the node's shared output, and only the leaders communicate. Collective
+ * over h.comm(); the result must also be destroyed collectively per node.
+ */
+template <typename T, typename transmit_type = default_transmit_type<T>>
+shared_vector<T> allgatherv_hierarchical(const hierarchy &h, const std::vector<T> &in) {
+    static_assert(is_trivial_enough<T>::value,
+        "allgatherv_hierarchical requires a trivial enough element type");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    // Step 1: exchange sizes, everyone needs them to know where to write
+    const boost::mpi::communicator &comm = h.comm();
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    const uint64_t in_size = in.size();
+    std::vector<uint64_t> sizes(comm_size);
+    boost::mpi::all_gather(comm, in_size, sizes.data());
+    std::vector<size_t> offsets(comm_size + 1);
+    offsets[0] = 0;
+    std::partial_sum(sizes.begin(), sizes.end(), offsets.begin() + 1);
+
+    // Step 2: allocate shared output and gather the node's data in it
+    shared_vector<T> out(h.node(), offsets.back());
+    std::copy(in.begin(), in.end(), out.data() + offsets[static_cast<size_t>(comm.rank())]);
+    out.sync();
+
+    // Step 3: leaders exchange the data of their nodes
+    if (h.is_leader() && h.num_nodes() > 1) {
+        int status;
+        if (h.contiguous()) {
+            // Node k holds the k-th consecutive range of ranks
+            const size_t factor = sizeof(T) / sizeof(transmit_type);
+            std::vector<size_t> counts(h.num_nodes(), 0), displacements(h.num_nodes() + 1, 0);
+            for (size_t r = 0; r < comm_size; ++r) {
+                counts[static_cast<size_t>(h.node_of(static_cast<int>(r)))] += sizes[r] * factor;
+            }
+            std::partial_sum(counts.begin(), counts.end(), displacements.begin() + 1);
+
+            const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+            if (fits_count(displacements.back())) {
+                std::vector<int> int_counts(counts.begin(), counts.end()),
+                    int_displacements(displacements.begin(), displacements.end());
+                status = MPI_Allgatherv(MPI_IN_PLACE, 0, datatype, out.data(),
+                                        int_counts.data(), int_displacements.data(),
+                                        datatype, h.leaders());
+            } else {
+                status = allgatherv_large(MPI_IN_PLACE, 0, out.data(), counts, displacements,
+                                          datatype, h.leaders());
+            }
+        } else {
+            status = exchange_node_ranges<T, transmit_type>(h, sizes, offsets, out.data());
+        }
+        if (status != 0) {
+            ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
+        }
+    }
+    out.sync();
+    return out;
+}
+
+
+/*
+ * Broadcast whose result is stored once per node. The root writes `data` into
+ * its node's shared copy, from which the leaders broadcast it to the other
+ * nodes. `data` is only read on the root. Collective over h.comm().
+ */
+template <typename T, typename transmit_type = default_transmit_type<T>>
+shared_vector<T> broadcast_hierarchical(const hierarchy &h, const std::vector<T> &data, int root) {
+    static_assert(is_trivial_enough<T>::value,
+        "broadcast_hierarchical requires a trivial enough element type");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    const boost::mpi::communicator &comm = h.comm();
+    uint64_t size = data.size();
+    boost::mpi::broadcast(comm, size, root);
+
+    shared_vector<T> out(h.node(), size);
+    if (comm.rank() == root) {
+        std::copy(data.begin(), data.end(), out.data());
+    }
+    out.sync();
+
+    if (h.is_leader() && h.num_nodes() > 1) {
+        int status = bcast_large(out.data(), size * sizeof(T)/sizeof(transmit_type),
+                                 transmit_datatype<transmit_type>(), h.node_of(root),
+                                 h.leaders());
+        if (status != 0) {
+            ERR << "MPI_Bcast returned " << status << ", errno " << errno << std::endl;
+        }
+    }
+    out.sync();
+    return out;
+}
+
+}
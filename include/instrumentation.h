@@ -0,0 +1,185 @@
+#pragma once
+
+/*
+ * instrumentation.h  -- Optional per-operation timing and byte counts
+ *
+ * Define UNSAFE_MPI_INSTRUMENT before including unsafe_mpi.h to record, per
+ * communicator and operation, how often each code path was taken, how many
+ * bytes were sent and received, and how much time went into each phase.
+ * Without it, all hooks are empty and compile to nothing.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <mpi.h>
+
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <ostream>
+
+#include <boost/mpi/communicator.hpp>
+
+namespace unsafe_mpi {
+namespace instrument {
+
+enum class operation { allgatherv, gatherv, broadcast, send, recv, allreduce, reduce_scatter, count };
+enum class phase { serialize, size_exchange, transfer, deserialize, count };
+enum class path { trivial, serialized, ragged, count };
+
+static const size_t num_operations = static_cast<size_t>(operation::count);
+static const size_t num_phases = static_cast<size_t>(phase::count);
+static const size_t num_paths = static_cast<size_t>(path::count);
+
+inline const char* name(operation op) {
+    static const char* names[] = { "allgatherv", "gatherv", "broadcast", "send", "recv",
+                                    "allreduce", "reduce_scatter" };
+    return names[static_cast<size_t>(op)];
+}
+
+inline const char* name(phase p) {
+    static const char* names[] = { "serialize", "size_exchange", "transfer", "deserialize" };
+    return names[static_cast<size_t>(p)];
+}
+
+inline const char* name(path p) {
+    static const char* names[] = { "trivial", "serialized", "ragged" };
+    return names[static_cast<size_t>(p)];
+}
+
+struct op_stats {
+    uint64_t calls[num_paths] = {};
+    uint64_t bytes_sent = 0, bytes_received = 0;
+    double seconds[num_phases] = {};
+};
+
+struct comm_stats {
+    op_stats ops[num_operations];
+};
+
+#ifdef UNSAFE_MPI_INSTRUMENT
+
+// Statistics of all communicators. Not thread-safe.
+inline std::map<MPI_Comm, comm_stats>& registry() {
+    static std::map<MPI_Comm, comm_stats> stats;
+    return stats;
+}
+
+// Records one call of an operation. Time is attributed to the phase set last.
+class recorder {
+public:
+    recorder(const boost::mpi::communicator &comm, operation op)
+        : stats_(registry()[comm].ops[static_cast<size_t>(op)]) {}
+
+    ~recorder() { stop(); }
+
+    void enter(phase p) {
+        const double now = MPI_Wtime();
+        if (active_) stats_.seconds[current_] += now - start_;
+        current_ = static_cast<size_t>(p);
+        start_ = now;
+        active_ = true;
+    }
+
+    void stop() {
+        if (active_) stats_.seconds[current_] += MPI_Wtime() - start_;
+        active_ = false;
+    }
+
+    void taken(path p) { ++stats_.calls[static_cast<size_t>(p)]; }
+    void sent(size_t bytes) { stats_.bytes_sent += bytes; }
+    void received(size_t bytes) { stats_.bytes_received += bytes; }
+
+private:
+    op_stats &stats_;
+    size_t current_ = 0;
+    double start_ = 0;
+    bool active_ = false;
+};
+
+#else
+
+class recorder {
+public:
+    recorder(const boost::mpi::communicator &, operation) {}
+    void enter(phase) {}
+    void stop() {}
+    void taken(path) {}
+    void sent(size_t) {}
+    void received(size_t) {}
+};
+
+#endif
+
+// Statistics of the calling PE for `comm`. All zero if instrumentation is
+// disabled.
+inline comm_stats local_stats(const boost::mpi::communicator &comm) {
+#ifdef UNSAFE_MPI_INSTRUMENT
+    auto it = registry().find(comm);
+    if (it != registry().end()) return it->second;
+#else
+    (void)comm;
+#endif
+    return comm_stats();
+}
+
+// Clear the statistics of `comm` on the calling PE
+inline void reset(const boost::mpi::communicator &comm) {
+#ifdef UNSAFE_MPI_INSTRUMENT
+    registry().erase(comm);
+#else
+    (void)comm;
+#endif
+}
+
+// Collective: sum up the statistics of all PEs of `comm` and print them on
+// PE 0. Phase times are the sum over all PEs, followed by the maximum.
+inline void report(const boost::mpi::communicator &comm, std::ostream &out) {
+    const comm_stats local = local_stats(comm);
+
+    const size_t num_counters = num_operations * (num_paths + 2),
+        num_times = num_operations * num_phases;
+    uint64_t counters[num_counters], total_counters[num_counters];
+    double times[num_times], total_times[num_times], max_times[num_times];
+    for (size_t op = 0; op < num_operations; ++op) {
+        const op_stats &s = local.ops[op];
+        for (size_t p = 0; p < num_paths; ++p) {
+            counters[op * (num_paths + 2) + p] = s.calls[p];
+        }
+        counters[op * (num_paths + 2) + num_paths] = s.bytes_sent;
+        counters[op * (num_paths + 2) + num_paths + 1] = s.bytes_received;
+        for (size_t p = 0; p < num_phases; ++p) {
+            times[op * num_phases + p] = s.seconds[p];
+        }
+    }
+
+    MPI_Reduce(counters, total_counters, static_cast<int>(num_counters), MPI_UINT64_T, MPI_SUM, 0, comm);
+    MPI_Reduce(times, total_times, static_cast<int>(num_times), MPI_DOUBLE, MPI_SUM, 0, comm);
+    MPI_Reduce(times, max_times, static_cast<int>(num_times), MPI_DOUBLE, MPI_MAX, 0, comm);
+    if (comm.rank() != 0) return;
+
+    out << "operation";
+    for (size_t p = 0; p < num_paths; ++p) out << ',' << name(static_cast<path>(p));
+    out << ",bytes_sent,bytes_received";
+    for (size_t p = 0; p < num_phases; ++p) {
+        out << ',' << name(static_cast<phase>(p)) << "_s_sum,"
+            << name(static_cast<phase>(p)) << "_s_max";
+    }
+    out << std::endl;
+
+    for (size_t op = 0; op < num_operations; ++op) {
+        out << name(static_cast<operation>(op));
+        for (size_t c = 0; c < num_paths + 2; ++c) {
+            out << ',' << total_counters[op * (num_paths + 2) + c];
+        }
+        for (size_t p = 0; p < num_phases; ++p) {
+            out << ',' << std::setprecision(6) << total_times[op * num_phases + p]
+                << ',' << max_times[op * num_phases + p];
+        }
+        out << std::endl;
+    }
+}
+
+}
+}
@@ -0,0 +1,393 @@
+#pragma once
+
+/*
+ * large_count.h  -- Transfers of more than INT_MAX elements
+ *
+ * Classic MPI calls take their counts and displacements as int. The helpers
+ * in here accept size_t counts and use the MPI-4 large-count functions (the
+ * ones with a _c suffix) where available. Otherwise, messages that are too
+ * large are split into chunks, which are all started at once using
+ * nonblocking operations so that they are in flight at the same time.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <vector>
+
+#include "private_comm.h"
+
+// MPI-4 introduced large-count variants of all communication functions
+#if MPI_VERSION >= 4
+#define UNSAFE_MPI_LARGE_COUNT 1
+#else
+#define UNSAFE_MPI_LARGE_COUNT 0
+#endif
+
+// Largest count passed to a single classic MPI call. Lower it to exercise the
+// large-count code paths with small inputs.
+#ifndef UNSAFE_MPI_MAX_COUNT
+#define UNSAFE_MPI_MAX_COUNT INT_MAX
+#endif
+
+namespace unsafe_mpi {
+
+static const size_t max_count = UNSAFE_MPI_MAX_COUNT;
+
+// Size of the chunks that oversized messages are split into if the MPI
+// library does not support large counts
+static const size_t chunk_bytes = size_t(1) << 26;
+
+inline bool fits_count(size_t count) {
+    return count <= max_count;
+}
+
+inline size_t datatype_extent(MPI_Datatype datatype) {
+    MPI_Aint lb, extent;
+    MPI_Type_get_extent(datatype, &lb, &extent);
+    return static_cast<size_t>(extent);
+}
+
+// Number of elements of `datatype` per chunk
+inline size_t chunk_count(MPI_Datatype datatype) {
+    const size_t extent = std::max<size_t>(datatype_extent(datatype), 1);
+    return std::min(max_count, std::max<size_t>(chunk_bytes / extent, 1));
+}
+
+/*
+ * Describes `count` elements of `base` as `count()` elements of `type()`,
+ * with count() fitting into an int. Oversized counts are expressed by a
+ * derived datatype covering all elements, which is freed in the destructor.
+ * Use this where a message must not be split, e.g. for the probe protocol.
+ */
+class large_datatype {
+public:
+    large_datatype(size_t count, MPI_Datatype base)
+        : type_(base), count_(static_cast<int>(count)), owned_(false)
+    {
+        if (fits_count(count)) return;
+
+        // count / max_count blocks of max_count elements, then the rest
+        const size_t blocks = count / max_count, rest = count % max_count;
+        MPI_Datatype block_type, blocks_type;
+        MPI_Type_contiguous(static_cast<int>(max_count), base, &block_type);
+        MPI_Type_contiguous(static_cast<int>(blocks), block_type, &blocks_type);
+        MPI_Type_free(&block_type);
+        if (rest == 0) {
+            type_ = blocks_type;
+        } else {
+            MPI_Datatype rest_type;
+            MPI_Type_contiguous(static_cast<int>(rest), base, &rest_type);
+            int blocklengths[2] = { 1, 1 };
+            MPI_Aint displacements[2] = {
+                0, static_cast<MPI_Aint>(blocks * max_count * datatype_extent(base)) };
+            MPI_Datatype types[2] = { blocks_type, rest_type };
+            MPI_Type_create_struct(2, blocklengths, displacements, types, &type_);
+            MPI_Type_free(&blocks_type);
+            MPI_Type_free(&rest_type);
+        }
+        MPI_Type_commit(&type_);
+        count_ = 1;
+        owned_ = true;
+    }
+
+    ~large_datatype() {
+        if (owned_) MPI_Type_free(&type_);
+    }
+
+    large_datatype(const large_datatype&) = delete;
+    large_datatype& operator=(const large_datatype&) = delete;
+
+    MPI_Datatype type() const { return type_; }
+    int count() const { return count_; }
+
+private:
+    MPI_Datatype type_;
+    int count_;
+    bool owned_;
+};
+
+
+// Start one nonblocking operation per chunk of the `count` elements at `buf`.
+// `start(ptr, chunk, request)` starts the operation on `chunk` elements at
+// `ptr` and returns the MPI error code.
+template <typename F>
+int start_chunks(const void *buf, size_t count, MPI_Datatype datatype,
+                 std::vector<MPI_Request> &requests, F start) {
+    const size_t extent = datatype_extent(datatype), chunk = chunk_count(datatype);
+    const char *ptr = static_cast<const char*>(buf);
+    for (size_t offset = 0; offset < count; offset += chunk) {
+        const int n = static_cast<int>(std::min(chunk, count - offset));
+        MPI_Request req;
+        int status = start(const_cast<char*>(ptr + offset * extent), n, &req);
+        if (status != 0) return status;
+        requests.push_back(req);
+    }
+    return 0;
+}
+
+inline int wait_chunks(std::vector<MPI_Request> &requests) {
+    return MPI_Waitall(static_cast<int>(requests.size()), requests.data(),
+                       MPI_STATUSES_IGNORE);
+}
+
+
+// MPI_Isend for any number of elements, adds its requests to `requests`
+inline int isend_large(const void *buf, size_t count, MPI_Datatype datatype, int dest, int tag,
+                       MPI_Comm comm, std::vector<MPI_Request> &requests) {
+    void *ptr = const_cast<void*>(buf);
+    MPI_Request req;
+    int status;
+    if (fits_count(count)) {
+        status = MPI_Isend(ptr, static_cast<int>(count), datatype, dest, tag, comm, &req);
+    } else {
+#if UNSAFE_MPI_LARGE_COUNT
+        status = MPI_Isend_c(ptr, static_cast<MPI_Count>(count), datatype, dest, tag, comm, &req);
+#else
+        return start_chunks(buf, count, datatype, requests,
+            [&](void *chunk, int n, MPI_Request *r) {
+                return MPI_Isend(chunk, n, datatype, dest, tag, comm, r);
+            });
+#endif
+    }
+    if (status == 0) requests.push_back(req);
+    return status;
+}
+
+
+// MPI_Irecv for any number of elements, matching isend_large and send_large.
+// `src` and `tag` must not be wildcards if the message may be split.
+inline int irecv_large(void *buf, size_t count, MPI_Datatype datatype, int src, int tag,
+                       MPI_Comm comm, std::vector<MPI_Request> &requests) {
+    MPI_Request req;
+    int status;
+    if (fits_count(count)) {
+        status = MPI_Irecv(buf, static_cast<int>(count), datatype, src, tag, comm, &req);
+    } else {
+#if UNSAFE_MPI_LARGE_COUNT
+        status = MPI_Irecv_c(buf, static_cast<MPI_Count>(count), datatype, src, tag, comm, &req);
+#else
+        return start_chunks(buf, count, datatype, requests,
+            [&](void *chunk, int n, MPI_Request *r) {
+                return MPI_Irecv(chunk, n, datatype, src, tag, comm, r);
+            });
+#endif
+    }
+    if (status == 0) requests.push_back(req);
+    return status;
+}
+
+
+// Like irecv_large, but matches the message (or all of its chunks) with
+// MPI_Mprobe before returning, so that no other receive can take them
+// afterwards. Blocks until the sender has started sending all chunks.
+inline int imrecv_large(void *buf, size_t count, MPI_Datatype datatype, int src, int tag,
+                        MPI_Comm comm, std::vector<MPI_Request> &requests) {
+    auto start = [&](void *chunk, size_t n, MPI_Request *r) {
+        MPI_Message msg;
+        int status = MPI_Mprobe(src, tag, comm, &msg, MPI_STATUS_IGNORE);
+        if (status != 0) return status;
+#if UNSAFE_MPI_LARGE_COUNT
+        return MPI_Imrecv_c(chunk, static_cast<MPI_Count>(n), datatype, &msg, r);
+#else
+        return MPI_Imrecv(chunk, static_cast<int>(n), datatype, &msg, r);
+#endif
+    };
+#if UNSAFE_MPI_LARGE_COUNT
+    const bool whole = true;
+#else
+    const bool whole = fits_count(count);
+#endif
+    if (whole) {
+        MPI_Request req;
+        int status = start(buf, count, &req);
+        if (status == 0) requests.push_back(req);
+        return status;
+    }
+    return start_chunks(buf, count, datatype, requests,
+        [&](void *chunk, int n, MPI_Request *r) {
+            return start(chunk, static_cast<size_t>(n), r);
+        });
+}
+
+
+// MPI_Ibcast for any number of elements, adds its requests to `requests`
+inline int ibcast_large(void *buf, size_t count, MPI_Datatype datatype, int root,
+                        MPI_Comm comm, std::vector<MPI_Request> &requests) {
+    MPI_Request req;
+    int status;
+    if (fits_count(count)) {
+        status = MPI_Ibcast(buf, static_cast<int>(count), datatype, root, comm, &req);
+    } else {
+#if UNSAFE_MPI_LARGE_COUNT
+        status = MPI_Ibcast_c(buf, static_cast<MPI_Count>(count), datatype, root, comm, &req);
+#else
+        return start_chunks(buf, count, datatype, requests,
+            [&](void *chunk, int n, MPI_Request *r) {
+                return MPI_Ibcast(chunk, n, datatype, root, comm, r);
+            });
+#endif
+    }
+    if (status == 0) requests.push_back(req);
+    return status;
+}
+
+
+// MPI_Send for any number of elements
+inline int send_large(const void *buf, size_t count, MPI_Datatype datatype,
+                      int dest, int tag, MPI_Comm comm) {
+    if (fits_count(count)) {
+        return MPI_Send(const_cast<void*>(buf), static_cast<int>(count), datatype, dest, tag, comm);
+    }
+    std::vector<MPI_Request> requests;
+    int status = isend_large(buf, count, datatype, dest, tag, comm, requests);
+    if (status != 0) return status;
+    return wait_chunks(requests);
+}
+
+
+// MPI_Recv for any number of elements, matching send_large. If the message
+// was split into chunks, `status` describes the first one.
+inline int recv_large(void *buf, size_t count, MPI_Datatype datatype,
+                      int src, int tag, MPI_Comm comm, MPI_Status *status) {
+    if (fits_count(count)) {
+        return MPI_Recv(buf, static_cast<int>(count), datatype, src, tag, comm, status);
+    }
+#if UNSAFE_MPI_LARGE_COUNT
+    return MPI_Recv_c(buf, static_cast<MPI_Count>(count), datatype, src, tag, comm, status);
+#else
+    // Receive the first chunk on its own so that wildcards are resolved
+    // before the other chunks are matched
+    MPI_Status first_status;
+    const size_t first = chunk_count(datatype);
+    int ret = MPI_Recv(buf, static_cast<int>(first), datatype, src, tag, comm, &first_status);
+    if (ret != 0) return ret;
+    if (status != MPI_STATUS_IGNORE) *status = first_status;
+
+    std::vector<MPI_Request> requests;
+    char *rest = static_cast<char*>(buf) + first * datatype_extent(datatype);
+    ret = irecv_large(rest, count - first, datatype, first_status.MPI_SOURCE,
+                      first_status.MPI_TAG, comm, requests);
+    if (ret != 0) return ret;
+    return wait_chunks(requests);
+#endif
+}
+
+
+// MPI_Bcast for any number of elements
+inline int bcast_large(void *buf, size_t count, MPI_Datatype datatype, int root, MPI_Comm comm) {
+    if (fits_count(count)) {
+        return MPI_Bcast(buf, static_cast<int>(count), datatype, root, comm);
+    }
+    std::vector<MPI_Request> requests;
+    int status = ibcast_large(buf, count, datatype, root, comm, requests);
+    if (status != 0) return status;
+    return wait_chunks(requests);
+}
+
+
+// Number of elements of `datatype` in the message described by `status`.
+// `basic_elements` is the number of basic elements in one `datatype`.
+inline size_t get_count_large(const MPI_Status &status, MPI_Datatype datatype,
+                              size_t basic_elements) {
+#if UNSAFE_MPI_LARGE_COUNT
+    (void)basic_elements;
+    MPI_Count count;
+    MPI_Get_count_c(&status, datatype, &count);
+    return static_cast<size_t>(count);
+#else
+    int count;
+    MPI_Get_count(&status, datatype, &count);
+    if (count != MPI_UNDEFINED) return static_cast<size_t>(count);
+    MPI_Count elements;
+    MPI_Get_elements_x(&status, datatype, &elements);
+    return static_cast<size_t>(elements) / basic_elements;
+#endif
+}
+
+
+// MPI_Allgatherv with size_t counts and displacements. `sendbuf` may be
+// MPI_IN_PLACE.
+inline int allgatherv_large(const void *sendbuf, size_t sendcount, void *recvbuf,
+                            const std::vector<size_t> &counts,
+                            const std::vector<size_t> &displacements,
+                            MPI_Datatype datatype, MPI_Comm comm) {
+    const size_t comm_size = counts.size();
+#if UNSAFE_MPI_LARGE_COUNT
+    std::vector<MPI_Count> c_counts(counts.begin(), counts.end());
+    std::vector<MPI_Aint> c_displs(displacements.begin(), displacements.begin() + comm_size);
+    return MPI_Allgatherv_c(sendbuf, static_cast<MPI_Count>(sendcount), datatype, recvbuf,
+                            c_counts.data(), c_displs.data(), datatype, comm);
+#else
+    // One broadcast per PE straight into its part of the output, with all
+    // chunks of all PEs in flight at once
+    (void)sendcount;
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    const size_t extent = datatype_extent(datatype);
+    char *out = static_cast<char*>(recvbuf);
+    std::vector<MPI_Request> requests;
+    for (size_t i = 0; i < comm_size; ++i) {
+        const int root = static_cast<int>(i);
+        if (root == rank && sendbuf != MPI_IN_PLACE) {
+            std::copy_n(static_cast<const char*>(sendbuf), counts[i] * extent,
+                        out + displacements[i] * extent);
+        }
+        int status = ibcast_large(out + displacements[i] * extent, counts[i], datatype,
+                                  root, comm, requests);
+        if (status != 0) return status;
+    }
+    return wait_chunks(requests);
+#endif
+}
+
+
+// MPI_Gatherv with size_t counts and displacements, which are only
+// significant on the root. `sendbuf` may be MPI_IN_PLACE on the root.
+inline int gatherv_large(const void *sendbuf, size_t sendcount, void *recvbuf,
+                         const std::vector<size_t> &counts,
+                         const std::vector<size_t> &displacements,
+                         MPI_Datatype datatype, int root, MPI_Comm comm) {
+#if UNSAFE_MPI_LARGE_COUNT
+    std::vector<MPI_Count> c_counts(counts.begin(), counts.end());
+    std::vector<MPI_Aint> c_displs(displacements.begin(), displacements.begin() + counts.size());
+    return MPI_Gatherv_c(sendbuf, static_cast<MPI_Count>(sendcount), datatype, recvbuf,
+                         c_counts.data(), c_displs.data(), datatype, root, comm);
+#else
+    // Point-to-point on the private communicator, so that the messages cannot
+    // be confused with the caller's
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    const MPI_Comm gather = private_comm(comm);
+    int status = 0;
+
+    const size_t extent = datatype_extent(datatype);
+    std::vector<MPI_Request> requests;
+    if (rank == root) {
+        char *out = static_cast<char*>(recvbuf);
+        for (size_t i = 0; i < counts.size() && status == 0; ++i) {
+            const int src = static_cast<int>(i);
+            if (src == root) {
+                if (sendbuf == MPI_IN_PLACE) continue;
+                std::copy_n(static_cast<const char*>(sendbuf), counts[i] * extent,
+                            out + displacements[i] * extent);
+                continue;
+            }
+            status = irecv_large(out + displacements[i] * extent, counts[i], datatype,
+                                 src, 0, gather, requests);
+        }
+    } else {
+        status = isend_large(sendbuf, sendcount, datatype, root, 0, gather, requests);
+    }
+    if (status == 0) status = wait_chunks(requests);
+    return status;
+#endif
+}
+
+}
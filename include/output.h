@@ -0,0 +1,127 @@
+#pragma once
+
+/*
+ * output.h  -- Receive targets that are not zero-filled before receiving
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace unsafe_mpi {
+
+/*
+ * Allocator adaptor that default-initializes elements instead of value-
+ * initializing them. resize() on a vector using it leaves trivial elements
+ * uninitialized, so that receive buffers are not zero-filled just to be
+ * overwritten by MPI. This also leaves the first touch of its pages to the
+ * receive operation, i.e. to the process that actually uses the data.
+ */
+template <typename T, typename A = std::allocator<T>>
+class default_init_allocator : public A {
+    typedef std::allocator_traits<A> traits;
+public:
+    template <typename U>
+    struct rebind {
+        typedef default_init_allocator<U, typename traits::template rebind_alloc<U>> other;
+    };
+
+    using A::A;
+    default_init_allocator() = default;
+    template <typename U>
+    default_init_allocator(const default_init_allocator<U, typename traits::template rebind_alloc<U>> &other)
+        : A(other) {}
+
+    template <typename U>
+    void construct(U *ptr) noexcept(std::is_nothrow_default_constructible<U>::value) {
+        ::new(static_cast<void*>(ptr)) U;
+    }
+    template <typename U, typename... Args>
+    void construct(U *ptr, Args&&... args) {
+        traits::construct(static_cast<A&>(*this), ptr, std::forward<Args>(args)...);
+    }
+};
+
+// A vector whose resize() does not initialize trivial elements
+template <typename T>
+using uninitialized_vector = std::vector<T, default_init_allocator<T>>;
+
+
+/*
+ * Where a receive operation stores its elements: `count` elements at a raw
+ * pointer, or a vector with any allocator that is either overwritten or
+ * appended to. Receive operations call prepare() once they know how many
+ * elements arrive, and write directly to the memory it returns.
+ *
+ * Only for trivial (enough) types, as elements are written bitwise.
+ */
+template <typename T>
+class output {
+public:
+    // Write at most `capacity` elements to `data`
+    output(T *data, size_t capacity)
+        : data_(data), capacity_(capacity), size_(0), vector_(nullptr), offset_(0),
+          grow_(nullptr) {}
+
+    // Write to `vec`, replacing its contents, or after its contents if `append`
+    template <typename Alloc>
+    output(std::vector<T, Alloc> &vec, bool append = false)
+        : data_(nullptr), capacity_(0), size_(0), vector_(&vec),
+          offset_(append ? vec.size() : 0), grow_(&grow<Alloc>) {}
+
+    // Make room for `count` elements and return where to write them, or
+    // nullptr if a raw buffer is too small. May also return nullptr if
+    // `count` is zero.
+    T* prepare(size_t count) {
+        size_ = count;
+        if (grow_ != nullptr) {
+            return grow_(vector_, offset_ + count) + offset_;
+        }
+        return (count <= capacity_) ? data_ : nullptr;
+    }
+
+    // Number of elements received
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    template <typename Alloc>
+    static T* grow(void *vec, size_t size) {
+        auto &v = *static_cast<std::vector<T, Alloc>*>(vec);
+        v.resize(size);
+        return v.data();
+    }
+
+    T *data_;
+    size_t capacity_, size_;
+    void *vector_;
+    size_t offset_;
+    T* (*grow_)(void*, size_t);
+};
+
+// Receive into `capacity` elements at `data`
+template <typename T>
+output<T> into(T *data, size_t capacity) {
+    return output<T>(data, capacity);
+}
+
+// Receive into `vec`, replacing its contents
+template <typename T, typename Alloc>
+output<T> into(std::vector<T, Alloc> &vec) {
+    return output<T>(vec);
+}
+
+// Receive into `vec` after its current contents
+template <typename T, typename Alloc>
+output<T> append_to(std::vector<T, Alloc> &vec) {
+    return output<T>(vec, true);
+}
+
+}
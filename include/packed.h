@@ -0,0 +1,249 @@
+#pragma once
+
+/*
+ * packed.h  -- Strip padding from trivial types on the wire
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/mpl/bool.hpp>
+#include <boost/serialization/nvp.hpp>
+#include <boost/serialization/serialization.hpp>
+
+#include "common.h"
+#include "tuple_serialization.h"
+
+namespace unsafe_mpi {
+
+/*
+ * Opt-in packed wire mode: trivial (enough) types for which this is true are
+ * transmitted without their padding by allgatherv, gatherv, broadcast, send
+ * and recv. For instance, std::pair<uint64_t, uint32_t> takes up 16 bytes in
+ * memory, but only 12 on the wire.
+ *
+ * Packing visits the members in the order of the type's serialize() method,
+ * so that pairs, tuples, arrays and structs that already have one work as
+ * is. Both sides need to agree, so specialize it for all PEs:
+ *
+ *     namespace unsafe_mpi {
+ *     template <> struct packed_wire<std::pair<uint64_t, uint32_t>>
+ *         : public std::true_type {};
+ *     }
+ */
+template <typename T>
+struct packed_wire : public std::false_type {};
+
+
+namespace packing {
+
+/*
+ * Calls `f` on every arithmetic or enum member of an object. Looks like an
+ * archive to serialize() methods, but doesn't actually serialize anything.
+ */
+template <typename F>
+class visitor {
+public:
+    typedef boost::mpl::bool_<false> is_loading;
+    typedef boost::mpl::bool_<true> is_saving;
+
+    explicit visitor(F &f) : f_(f) {}
+
+    template <typename U>
+    visitor& operator&(const U &u) {
+        visit(const_cast<U&>(u));
+        return *this;
+    }
+
+    template <typename U>
+    visitor& operator<<(const U &u) {
+        return *this & u;
+    }
+
+    template <typename U>
+    visitor& operator>>(U &u) {
+        return *this & u;
+    }
+
+    template <typename U>
+    void visit(U &u) {
+        visit(u, std::integral_constant<bool,
+              std::is_arithmetic<U>::value || std::is_enum<U>::value>());
+    }
+
+    template <typename U, typename V>
+    void visit(std::pair<U, V> &p) {
+        visit(p.first);
+        visit(p.second);
+    }
+
+    template <typename... Args>
+    void visit(std::tuple<Args...> &t) {
+        visit_tuple<0>(t, std::integral_constant<bool, (0 < sizeof...(Args))>());
+    }
+
+    template <typename U, size_t N>
+    void visit(std::array<U, N> &a) {
+        for (U &u : a) visit(u);
+    }
+
+    template <typename U, size_t N>
+    void visit(U (&a)[N]) {
+        for (U &u : a) visit(u);
+    }
+
+    template <typename U>
+    void visit(boost::serialization::nvp<U> &p) {
+        visit(p.value());
+    }
+
+private:
+    template <typename U>
+    void visit(U &u, std::true_type) {
+        f_(u);
+    }
+
+    template <typename U>
+    void visit(U &u, std::false_type) {
+        boost::serialization::serialize_adl(*this, u, 0);
+    }
+
+    template <size_t I, typename Tuple>
+    void visit_tuple(Tuple &t, std::true_type) {
+        visit(std::get<I>(t));
+        visit_tuple<I + 1>(t, std::integral_constant<bool,
+                           (I + 1 < std::tuple_size<Tuple>::value)>());
+    }
+
+    template <size_t I, typename Tuple>
+    void visit_tuple(Tuple &, std::false_type) {}
+
+    F &f_;
+};
+
+struct measure {
+    size_t size = 0;
+
+    template <typename U>
+    void operator()(const U &) {
+        size += sizeof(U);
+    }
+};
+
+struct gather {
+    uint8_t *out;
+
+    template <typename U>
+    void operator()(const U &u) {
+        memcpy(out, &u, sizeof(U));
+        out += sizeof(U);
+    }
+};
+
+struct scatter {
+    const uint8_t *in;
+
+    template <typename U>
+    void operator()(U &u) {
+        memcpy(&u, in, sizeof(U));
+        in += sizeof(U);
+    }
+};
+
+template <typename T, typename F>
+void visit(const T &t, F &f) {
+    visitor<F> v(f);
+    v.visit(const_cast<T&>(t));
+}
+
+template <typename T>
+size_t size(std::true_type) {
+    static_assert(is_trivial_enough<T>::value, "packed_wire<T> requires trivial (enough) T");
+    // The layout is the same for all elements, so measure it once
+    static const size_t size = [] {
+        measure f;
+        visit(T(), f);
+        return f.size;
+    }();
+    return size;
+}
+
+template <typename T>
+size_t size(std::false_type) {
+    return sizeof(T);
+}
+
+// The members of every element are copied with fixed-size memcpys, which the
+// compiler turns into plain loads and stores
+template <typename T>
+void pack(const T *in, size_t count, uint8_t *out, std::true_type) {
+    gather f{out};
+    for (size_t i = 0; i < count; ++i) {
+        visit(in[i], f);
+    }
+}
+
+template <typename T>
+void pack(const T *, size_t, uint8_t *, std::false_type) {}
+
+template <typename T>
+void unpack(const uint8_t *in, size_t count, T *out, std::true_type) {
+    scatter f{in};
+    for (size_t i = 0; i < count; ++i) {
+        visit(out[i], f);
+    }
+}
+
+template <typename T>
+void unpack(const uint8_t *, size_t, T *, std::false_type) {}
+
+template <typename T>
+using enabled = std::integral_constant<bool, packed_wire<T>::value>;
+
+}
+
+
+// Number of bytes an element of type T takes up on the wire
+template <typename T>
+size_t packed_size() {
+    return packing::size<T>(packing::enabled<T>());
+}
+
+// Pack `count` elements starting at `in` into `out`, which must have room for
+// count * packed_size<T>() bytes. Does nothing unless packed_wire<T>.
+template <typename T>
+void pack(const T *in, size_t count, uint8_t *out) {
+    packing::pack(in, count, out, packing::enabled<T>());
+}
+
+// Pack all of `in` into `out`, replacing its contents
+template <typename T>
+void pack(const std::vector<T> &in, std::vector<uint8_t> &out) {
+    out.resize(in.size() * packed_size<T>());
+    pack(in.data(), in.size(), out.data());
+}
+
+// Restore `count` elements from packed data at `in`. Padding bytes of `out`
+// are left as they are. Does nothing unless packed_wire<T>.
+template <typename T>
+void unpack(const uint8_t *in, size_t count, T *out) {
+    packing::unpack(in, count, out, packing::enabled<T>());
+}
+
+// Restore all elements from `in` into `out`, replacing its contents
+template <typename T, typename Alloc>
+void unpack(const std::vector<uint8_t, Alloc> &in, std::vector<T> &out) {
+    out.resize(in.size() / packed_size<T>());
+    unpack(in.data(), out.size(), out.data());
+}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * parallel.h  -- Minimal helpers for thread-parallel local work
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace unsafe_mpi {
+
+// Number of threads to use for local work, at most `max_useful`
+inline size_t num_threads(size_t max_useful) {
+    size_t hw = std::thread::hardware_concurrency();
+    return std::max<size_t>(1, std::min(hw, max_useful));
+}
+
+// Split [0, n) into `threads` contiguous blocks and call f(begin, end) for
+// each of them in parallel. Block 0 runs on the calling thread.
+template <typename F>
+void parallel_for(size_t n, size_t threads, F f) {
+    threads = std::max<size_t>(1, std::min(threads, n));
+    if (threads == 1) {
+        f(size_t{0}, n);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t t = 1; t < threads; ++t) {
+        const size_t begin = n * t / threads, end = n * (t + 1) / threads;
+        workers.emplace_back([&f, begin, end]() { f(begin, end); });
+    }
+    f(size_t{0}, n / threads);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+}
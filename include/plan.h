@@ -0,0 +1,199 @@
+#pragma once
+
+/*
+ * plan.h  -- Persistent allgatherv and gatherv for repeated calls with the
+ *            same sizes
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/datatype.hpp>
+
+#include "common.h"
+
+// MPI-4 introduced persistent collectives
+#if MPI_VERSION >= 4
+#define UNSAFE_MPI_PERSISTENT_COLLECTIVES 1
+#else
+#define UNSAFE_MPI_PERSISTENT_COLLECTIVES 0
+#endif
+
+namespace unsafe_mpi {
+
+/*
+ * An allgatherv where every PE contributes the same number of elements each
+ * time. The size exchange, displacement computation and allocation of the
+ * output happen once, in the constructor. Afterwards, write the local data to
+ * in() and call execute() to gather everyone's data into out().
+ *
+ * Uses MPI_Allgatherv_init where available. Do not resize in() or out(), the
+ * persistent request is bound to their storage.
+ */
+template <typename T, typename transmit_type=default_transmit_type<T>>
+class allgatherv_plan {
+    static_assert(is_trivial_enough<T>::value,
+        "allgatherv_plan requires a trivial enough element type");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+public:
+    allgatherv_plan(const boost::mpi::communicator &comm, size_t local_size)
+        : comm_(comm), in_(local_size)
+    {
+        // exchange sizes and compute displacements, see allgatherv_unsafe
+        const size_t comm_size = static_cast<size_t>(comm.size());
+        const size_t factor = sizeof(T) / sizeof(transmit_type);
+        in_size_ = static_cast<int>(local_size * factor);
+        sizes_.resize(comm_size);
+        boost::mpi::all_gather(comm, in_size_, sizes_.data());
+
+        displacements_.resize(comm_size + 1);
+        displacements_[0] = 0;
+        std::partial_sum(sizes_.begin(), sizes_.end(), displacements_.begin() + 1);
+        out_.resize(static_cast<size_t>(displacements_.back()) / factor);
+
+#if UNSAFE_MPI_PERSISTENT_COLLECTIVES
+        const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+        int status = MPI_Allgatherv_init(in_.data(), in_size_, datatype, out_.data(),
+                                         sizes_.data(), displacements_.data(), datatype,
+                                         comm_, MPI_INFO_NULL, &request_);
+        if (status != 0) {
+            ERR << "MPI_Allgatherv_init returned " << status << ", errno " << errno << std::endl;
+            request_ = MPI_REQUEST_NULL;
+        }
+#endif
+    }
+
+    ~allgatherv_plan() {
+        if (request_ != MPI_REQUEST_NULL) {
+            MPI_Request_free(&request_);
+        }
+    }
+
+    allgatherv_plan(const allgatherv_plan&) = delete;
+    allgatherv_plan& operator=(const allgatherv_plan&) = delete;
+
+    // Local input, holds local_size elements
+    std::vector<T>& in() { return in_; }
+    // Result of the last execute()
+    const std::vector<T>& out() const { return out_; }
+    std::vector<T>& out() { return out_; }
+
+    void execute() {
+        int status;
+        if (request_ != MPI_REQUEST_NULL) {
+            status = MPI_Start(&request_);
+            if (status == 0)
+                status = MPI_Wait(&request_, MPI_STATUS_IGNORE);
+        } else {
+            const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+            status = MPI_Allgatherv(in_.data(), in_size_, datatype, out_.data(),
+                                    sizes_.data(), displacements_.data(), datatype,
+                                    comm_);
+        }
+        if (status != 0) {
+            ERR << "MPI_Allgatherv returned " << status << ", errno " << errno << std::endl;
+        }
+    }
+
+private:
+    boost::mpi::communicator comm_;
+    std::vector<T> in_, out_;
+    int in_size_;
+    std::vector<int> sizes_, displacements_;
+    MPI_Request request_ = MPI_REQUEST_NULL;
+};
+
+
+/*
+ * Same for gatherv: only the root's out() receives data.
+ */
+template <typename T, typename transmit_type=default_transmit_type<T>>
+class gatherv_plan {
+    static_assert(is_trivial_enough<T>::value,
+        "gatherv_plan requires a trivial enough element type");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+        "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+public:
+    gatherv_plan(const boost::mpi::communicator &comm, size_t local_size, int root)
+        : comm_(comm), in_(local_size), root_(root)
+    {
+        // exchange sizes and compute displacements, see gatherv_trivial
+        const size_t factor = sizeof(T) / sizeof(transmit_type);
+        in_size_ = static_cast<int>(local_size * factor);
+        if (comm.rank() == root) {
+            sizes_.resize(static_cast<size_t>(comm.size()));
+            boost::mpi::gather(comm, in_size_, sizes_.data(), root);
+
+            displacements_.resize(sizes_.size() + 1);
+            displacements_[0] = 0;
+            std::partial_sum(sizes_.begin(), sizes_.end(), displacements_.begin() + 1);
+            out_.resize(static_cast<size_t>(displacements_.back()) / factor);
+        } else {
+            boost::mpi::gather(comm, in_size_, root);
+        }
+
+#if UNSAFE_MPI_PERSISTENT_COLLECTIVES
+        const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+        int status = MPI_Gatherv_init(in_.data(), in_size_, datatype, out_.data(),
+                                      sizes_.data(), displacements_.data(), datatype,
+                                      root_, comm_, MPI_INFO_NULL, &request_);
+        if (status != 0) {
+            ERR << "MPI_Gatherv_init returned " << status << ", errno " << errno << std::endl;
+            request_ = MPI_REQUEST_NULL;
+        }
+#endif
+    }
+
+    ~gatherv_plan() {
+        if (request_ != MPI_REQUEST_NULL) {
+            MPI_Request_free(&request_);
+        }
+    }
+
+    gatherv_plan(const gatherv_plan&) = delete;
+    gatherv_plan& operator=(const gatherv_plan&) = delete;
+
+    // Local input, holds local_size elements
+    std::vector<T>& in() { return in_; }
+    // Result of the last execute(), empty except on the root
+    const std::vector<T>& out() const { return out_; }
+    std::vector<T>& out() { return out_; }
+
+    void execute() {
+        int status;
+        if (request_ != MPI_REQUEST_NULL) {
+            status = MPI_Start(&request_);
+            if (status == 0)
+                status = MPI_Wait(&request_, MPI_STATUS_IGNORE);
+        } else {
+            const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+            status = MPI_Gatherv(in_.data(), in_size_, datatype, out_.data(),
+                                 sizes_.data(), displacements_.data(), datatype,
+                                 root_, comm_);
+        }
+        if (status != 0) {
+            ERR << "MPI_Gatherv returned " << status << ", errno " << errno << std::endl;
+        }
+    }
+
+private:
+    boost::mpi::communicator comm_;
+    std::vector<T> in_, out_;
+    int root_, in_size_;
+    std::vector<int> sizes_, displacements_;
+    MPI_Request request_ = MPI_REQUEST_NULL;
+};
+
+}
@@ -7,32 +7,248 @@
  * Published under the Boost Software License, Version 1.0
  */
 
+#include <errno.h>
+#include <mpi.h>
+
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include <boost/mpi/communicator.hpp>
+#include <boost/mpi/datatype.hpp>
+#include <boost/mpi/packed_iarchive.hpp>
+#include <boost/mpi/packed_oarchive.hpp>
+
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
 
+#include "codec.h"
 #include "common.h"
+#include "instrumentation.h"
+#include "large_count.h"
+#include "output.h"
+#include "packed.h"
+#include "request.h"
+#include "tuple_serialization.h"
+#include "workspace.h"
 
 namespace unsafe_mpi {
 
+// Wire protocol of send() and recv(), both sides need to use the same one
+enum class protocol {
+    // Send the number of elements first, then the data in a second message
+    size_message,
+    // Send everything in a single message, the receiver uses MPI_Mprobe to
+    // learn its size. Saves a round of latency for small messages.
+    probe
+};
+
+
+// Pack the element count and elements into `buf`, which is the message of the
+// probe protocol for types that need serialization
+template <typename T>
+void pack_probe(const boost::mpi::communicator &comm, const T *data, const size_t size,
+                archive_buffer &buf) {
+    boost::mpi::packed_oarchive oa(comm, cleared(buf));
+    oa << size;
+    for (size_t i = 0; i < size; ++i) {
+        oa << data[i];
+    }
+}
+
+
+// Send `size` elements of type `T` starting at `data` to `dest` as a single
+// message, to be received with recv_probe. The archive of serialized types is
+// built in `ws`.
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void send_probe(const boost::mpi::communicator &comm, int dest, int tag, const T *data, const size_t size,
+                workspace &ws) {
+    const bool trivial = is_trivial_enough<T>::value;
+    static_assert(!trivial || (sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    instrument::recorder rec(comm, instrument::operation::send);
+    int status;
+    if (trivial) {
+        rec.taken(instrument::path::trivial);
+        rec.enter(instrument::phase::transfer);
+        rec.sent(size * sizeof(T));
+        // the receiver infers the number of elements from the message size
+        // This has to be a single message, so oversized ones are described by
+        // a derived datatype instead of being split
+        auto sendptr = reinterpret_cast<const transmit_type*>(data);
+        const large_datatype type(size * sizeof(T)/sizeof(transmit_type),
+                                  transmit_datatype<transmit_type>());
+        status = MPI_Send(const_cast<transmit_type*>(sendptr), type.count(), type.type(),
+                          dest, tag, comm);
+    } else {
+        rec.taken(instrument::path::serialized);
+        rec.enter(instrument::phase::serialize);
+        // pack element count and elements into one archive
+        pack_probe(comm, data, size, ws.send_buffer);
+        rec.enter(instrument::phase::transfer);
+        rec.sent(ws.send_buffer.size());
+        status = MPI_Send(ws.send_buffer.data(), static_cast<int>(ws.send_buffer.size()),
+                          MPI_PACKED, dest, tag, comm);
+    }
+    if (status != 0) {
+        ERR << "MPI_Send returned " << status << ", errno " << errno << std::endl;
+    }
+}
+
+
+// Start sending `size` elements at `data` to `dest` like send_probe, but with
+// MPI_Issend, whose request only completes once the receive has started. The
+// archive of serialized types is built in `buf`. `data` (for trivial types)
+// or `buf` must stay alive until `req` has completed.
+template <typename T, typename transmit_type = default_transmit_type<T>>
+int issend_probe(const boost::mpi::communicator &comm, int dest, int tag, const T *data,
+                 const size_t size, archive_buffer &buf, MPI_Request *req) {
+    const bool trivial = is_trivial_enough<T>::value;
+    static_assert(!trivial || (sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    instrument::recorder rec(comm, instrument::operation::send);
+    if (trivial) {
+        rec.taken(instrument::path::trivial);
+        rec.enter(instrument::phase::transfer);
+        rec.sent(size * sizeof(T));
+        auto sendptr = reinterpret_cast<const transmit_type*>(data);
+        const large_datatype type(size * sizeof(T)/sizeof(transmit_type),
+                                  transmit_datatype<transmit_type>());
+        return MPI_Issend(const_cast<transmit_type*>(sendptr), type.count(), type.type(),
+                          dest, tag, comm, req);
+    } else {
+        rec.taken(instrument::path::serialized);
+        rec.enter(instrument::phase::serialize);
+        pack_probe(comm, data, size, buf);
+        rec.enter(instrument::phase::transfer);
+        rec.sent(buf.size());
+        return MPI_Issend(buf.data(), static_cast<int>(buf.size()), MPI_PACKED,
+                          dest, tag, comm, req);
+    }
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void send_probe(const boost::mpi::communicator &comm, int dest, int tag, const T *data, const size_t size) {
+    workspace ws;
+    send_probe<T, transmit_type>(comm, dest, tag, data, size, ws);
+}
+
+
+// Receive the probe protocol message `msg`, which was matched by MPI_Mprobe
+// or MPI_Improbe with `status`, into `data`
+template <typename T, typename transmit_type = default_transmit_type<T>>
+int recv_matched(const boost::mpi::communicator &comm, MPI_Message &msg, MPI_Status &status,
+                 std::vector<T> &data, workspace &ws, instrument::recorder &rec) {
+    const bool trivial = is_trivial_enough<T>::value;
+    int ret, count;
+    if (trivial) {
+        const MPI_Datatype datatype = transmit_datatype<transmit_type>();
+        const size_t units = get_count_large(status, datatype,
+            transmit_datatype_traits<transmit_type>::basic_elements);
+        data.resize(units * sizeof(transmit_type) / sizeof(T));
+        rec.received(data.size() * sizeof(T));
+        const large_datatype type(units, datatype);
+        ret = MPI_Mrecv(data.data(), type.count(), type.type(), &msg, &status);
+    } else {
+        MPI_Get_count(&status, MPI_PACKED, &count);
+        boost::mpi::packed_iarchive ia(comm, cleared(ws.recv_buffer));
+        ia.resize(static_cast<size_t>(count));
+        rec.received(static_cast<size_t>(count));
+        ret = MPI_Mrecv(ia.address(), count, MPI_PACKED, &msg, &status);
+        if (ret == 0) {
+            rec.enter(instrument::phase::deserialize);
+            size_t size;
+            ia >> size;
+            data.resize(size);
+            for (size_t i = 0; i < size; ++i) {
+                ia >> data[i];
+            }
+        }
+    }
+    return ret;
+}
+
+
+// Receive a message sent by send_probe, sizing `data` from the probed message.
+// The archive of serialized types is received into `ws`.
+template <typename T, typename transmit_type = default_transmit_type<T>>
+boost::mpi::status recv_probe(const boost::mpi::communicator &comm, int src, int tag, std::vector<T> &data,
+                              workspace &ws) {
+    const bool trivial = is_trivial_enough<T>::value;
+    static_assert(!trivial || (sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    // Use a matched probe so that no other receive can steal the message
+    // between probing and receiving it
+    instrument::recorder rec(comm, instrument::operation::recv);
+    rec.taken(trivial ? instrument::path::trivial : instrument::path::serialized);
+    rec.enter(instrument::phase::transfer);
+    MPI_Message msg;
+    MPI_Status status;
+    int ret = MPI_Mprobe(src, tag, comm, &msg, &status);
+    if (ret != 0) {
+        ERR << "MPI_Mprobe returned " << ret << ", errno " << errno << std::endl;
+        return status;
+    }
+
+    ret = recv_matched<T, transmit_type>(comm, msg, status, data, ws, rec);
+    if (ret != 0) {
+        ERR << "MPI_Mrecv returned " << ret << ", errno " << errno << std::endl;
+    }
+    return status;
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+boost::mpi::status recv_probe(const boost::mpi::communicator &comm, int src, int tag, std::vector<T> &data) {
+    workspace ws;
+    return recv_probe<T, transmit_type>(comm, src, tag, data, ws);
+}
+
+
 // Send `size` elements of type `T` starting at `data` to `dest` via `comm` with `tag`,
 // using trivial type `transmit_type` if `T` is Standard Layout
-template <typename T, typename transmit_type = uint64_t>
-void send(const boost::mpi::communicator &comm, int dest, int tag, const T *data, const size_t size) {
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void send(const boost::mpi::communicator &comm, int dest, int tag, const T *data, const size_t size,
+          protocol proto = protocol::size_message) {
     const bool trivial = is_trivial_enough<T>::value;
     static_assert(!trivial || (sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
                   "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
 
+    if (packed_wire<T>::value) {
+        // Send without padding, see packed.h
+        std::vector<uint8_t> bytes(size * packed_size<T>());
+        pack(data, size, bytes.data());
+        send<uint8_t>(comm, dest, tag, bytes.data(), bytes.size(), proto);
+        return;
+    }
+    if (proto == protocol::probe) {
+        send_probe<T, transmit_type>(comm, dest, tag, data, size);
+        return;
+    }
+
+    // Bytes of serialized types are not counted, Boost.MPI packs them internally
+    instrument::recorder rec(comm, instrument::operation::send);
+    rec.taken(trivial ? instrument::path::trivial : instrument::path::serialized);
+
     // send size
+    rec.enter(instrument::phase::size_exchange);
     comm.send(dest, tag, size);
+    rec.sent(sizeof(size));
     if (size == 0) return; // nothing to send
 
     // send actual data
+    rec.enter(instrument::phase::transfer);
     if (trivial) {
+        rec.sent(size * sizeof(T));
         auto sendptr = reinterpret_cast<const transmit_type*>(data);
         auto sendsize = size * sizeof(T)/sizeof(transmit_type);
-        comm.send(dest, tag, sendptr, static_cast<int>(sendsize));
+        int status = send_large(sendptr, sendsize, transmit_datatype<transmit_type>(),
+                                dest, tag, comm);
+        if (status != 0) {
+            ERR << "MPI_Send returned " << status << ", errno " << errno << std::endl;
+        }
     } else {
         comm.send(dest, tag, data, static_cast<int>(size));
     }
@@ -40,33 +256,254 @@ void send(const boost::mpi::communicator &comm, int dest, int tag, const T *data
 
 
 // convenience wrapper for vectors
-template <typename T, typename transmit_type = uint64_t>
-void send(const boost::mpi::communicator &comm, int dest, int tag, const std::vector<T> &data) {
-    send<T, transmit_type>(comm, dest, tag, data.data(), data.size());
+template <typename T, typename transmit_type = default_transmit_type<T>>
+void send(const boost::mpi::communicator &comm, int dest, int tag, const std::vector<T> &data,
+          protocol proto = protocol::size_message) {
+    send<T, transmit_type>(comm, dest, tag, data.data(), data.size(), proto);
 }
 
 
-template <typename T, typename transmit_type = uint64_t>
-boost::mpi::status recv(const boost::mpi::communicator &comm, int src, int tag, std::vector<T> &data) {
+template <typename T, typename transmit_type = default_transmit_type<T>>
+boost::mpi::status recv(const boost::mpi::communicator &comm, int src, int tag, std::vector<T> &data,
+                        protocol proto = protocol::size_message) {
     const bool trivial = is_trivial_enough<T>::value;
     static_assert(!trivial || (sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
                   "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
 
+    if (packed_wire<T>::value) {
+        std::vector<uint8_t> bytes;
+        auto status = recv<uint8_t>(comm, src, tag, bytes, proto);
+        unpack(bytes, data);
+        return status;
+    }
+    if (proto == protocol::probe) {
+        return recv_probe<T, transmit_type>(comm, src, tag, data);
+    }
+
+    // Bytes of serialized types are not counted, Boost.MPI unpacks them internally
+    instrument::recorder rec(comm, instrument::operation::recv);
+    rec.taken(trivial ? instrument::path::trivial : instrument::path::serialized);
+
     auto size = data.size(); // for the type deduction
     // receive size and resize
+    rec.enter(instrument::phase::size_exchange);
     auto status = comm.recv(src, tag, size);
+    rec.received(sizeof(size));
     if (size == 0) return status; // nothing coming...
 
     data.resize(size);
 
     // receive actual data
+    rec.enter(instrument::phase::transfer);
     if (trivial) {
+        rec.received(size * sizeof(T));
         auto recvptr = reinterpret_cast<transmit_type*>(data.data());
         auto recvsize = size * sizeof(T)/sizeof(transmit_type);
-        return comm.recv(src, tag, recvptr, static_cast<int>(recvsize));
+        int ret = recv_large(recvptr, recvsize, transmit_datatype<transmit_type>(),
+                             status.source(), tag, comm, &static_cast<MPI_Status&>(status));
+        if (ret != 0) {
+            ERR << "MPI_Recv returned " << ret << ", errno " << errno << std::endl;
+        }
+        return status;
     } else {
         return comm.recv(src, tag, data.data(), static_cast<int>(size));
     }
 }
 
+
+// Receive trivial (enough) data sent by send() into `out` without
+// initializing it first, see output.h. Only supports protocol::size_message.
+template <typename T, typename transmit_type = default_transmit_type<T>>
+boost::mpi::status recv(const boost::mpi::communicator &comm, int src, int tag, output<T> out) {
+    static_assert(is_trivial_enough<T>::value, "output<T> requires trivial (enough) T");
+    static_assert((sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    instrument::recorder rec(comm, instrument::operation::recv);
+    rec.taken(instrument::path::trivial);
+
+    // receive size and make room
+    rec.enter(instrument::phase::size_exchange);
+    size_t size;
+    auto status = comm.recv(src, tag, size);
+    rec.received(sizeof(size));
+    if (size == 0) {
+        out.prepare(0);
+        return status; // nothing coming...
+    }
+
+    std::vector<T> discard;
+    T *ptr = out.prepare(size);
+    if (ptr == nullptr && out.size() > 0) {
+        // Receive the message anyway so that it does not match a later recv
+        ERR << "recv: output buffer too small for " << size << " elements" << std::endl;
+        discard.resize(size);
+        ptr = discard.data();
+    }
+
+    // receive actual data from the same source, which matters for MPI_ANY_SOURCE
+    rec.enter(instrument::phase::transfer);
+    rec.received(size * sizeof(T));
+    auto recvptr = reinterpret_cast<transmit_type*>(ptr);
+    auto recvsize = size * sizeof(T)/sizeof(transmit_type);
+    int ret = recv_large(recvptr, recvsize, transmit_datatype<transmit_type>(),
+                         status.source(), tag, comm, &static_cast<MPI_Status&>(status));
+    if (ret != 0) {
+        ERR << "MPI_Recv returned " << ret << ", errno " << errno << std::endl;
+    }
+    return status;
+}
+
+
+// Compress trivial (enough) data with `codec` before sending it, see codec.h.
+// Receive it with recv() and the same codec.
+template <typename T, typename Codec>
+typename std::enable_if<codec::is_codec<Codec>::value>::type
+send(const boost::mpi::communicator &comm, int dest, int tag, const T *data, const size_t size,
+     const Codec &codec) {
+    static_assert(is_trivial_enough<T>::value, "codecs require trivial (enough) T");
+    std::vector<uint8_t> frame;
+    codec::encode_frame(codec, data, size, frame);
+    send<uint8_t>(comm, dest, tag, frame);
+}
+
+template <typename T, typename Codec>
+typename std::enable_if<codec::is_codec<Codec>::value>::type
+send(const boost::mpi::communicator &comm, int dest, int tag, const std::vector<T> &data,
+     const Codec &codec) {
+    send(comm, dest, tag, data.data(), data.size(), codec);
+}
+
+template <typename T, typename Codec>
+typename std::enable_if<codec::is_codec<Codec>::value, boost::mpi::status>::type
+recv(const boost::mpi::communicator &comm, int src, int tag, std::vector<T> &data,
+     const Codec &codec) {
+    static_assert(is_trivial_enough<T>::value, "codecs require trivial (enough) T");
+    std::vector<uint8_t> frame;
+    auto status = recv<uint8_t>(comm, src, tag, frame);
+    data.resize(codec::frame_count<T>(frame.data(), frame.size()));
+    codec::decode_frame(codec, frame.data(), frame.size(), data.data());
+    return status;
+}
+
+
+// Nonblocking variant of send. `data` must stay alive until the returned
+// request has completed. Matches recv() and irecv().
+template <typename T, typename transmit_type = default_transmit_type<T>>
+request isend(const boost::mpi::communicator &comm, int dest, int tag, const T *data, const size_t size) {
+    const bool trivial = is_trivial_enough<T>::value;
+    static_assert(!trivial || (sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    auto size_ptr = std::make_shared<size_t>(size);
+    request result;
+    result.hold(size_ptr);
+
+    // send size
+    MPI_Request req;
+    int status = MPI_Isend(size_ptr.get(), 1, boost::mpi::get_mpi_datatype<size_t>(),
+                           dest, tag, comm, &req);
+    if (status != 0) {
+        ERR << "MPI_Isend returned " << status << ", errno " << errno << std::endl;
+        return result;
+    }
+    result.add(req);
+    if (size == 0) return result; // nothing to send
+
+    // send actual data
+    if (trivial) {
+        auto sendptr = reinterpret_cast<const transmit_type*>(data);
+        auto sendsize = size * sizeof(T)/sizeof(transmit_type);
+        std::vector<MPI_Request> reqs;
+        status = isend_large(sendptr, sendsize, transmit_datatype<transmit_type>(),
+                             dest, tag, comm, reqs);
+        if (status != 0) {
+            ERR << "MPI_Isend returned " << status << ", errno " << errno << std::endl;
+        }
+        for (MPI_Request r : reqs) result.add(r);
+    } else {
+        result.add(comm.isend(dest, tag, data, static_cast<int>(size)));
+    }
+    return result;
+}
+
+
+// convenience wrapper for vectors
+template <typename T, typename transmit_type = default_transmit_type<T>>
+request isend(const boost::mpi::communicator &comm, int dest, int tag, const std::vector<T> &data) {
+    return isend<T, transmit_type>(comm, dest, tag, data.data(), data.size());
+}
+
+
+// Nonblocking variant of recv. `data` must stay alive until the returned
+// request has completed. Matches send() and isend().
+//
+// The size message is matched by a probe phase of the request (see
+// request.h), in the order the irecvs were started, and the payload right
+// after it, so no other receive can get between them. Once the size has
+// arrived, test() waits for the payload to be sent, which the sender does
+// right after. Serialized data is deserialized in wait().
+template <typename T, typename transmit_type = default_transmit_type<T>>
+request irecv(const boost::mpi::communicator &comm, int src, int tag, std::vector<T> &data) {
+    const bool trivial = is_trivial_enough<T>::value;
+    static_assert(!trivial || (sizeof(T)/sizeof(transmit_type)) * sizeof(transmit_type) == sizeof(T),
+                  "Invalid transmit_type for element type (sizeof(transmit_type) is not a multiple of sizeof(T))");
+
+    request result;
+    const boost::mpi::communicator comm_copy = comm;
+    result.probe(comm, src, tag, [comm_copy, trivial, &data](request &r, MPI_Message &msg,
+                                                             MPI_Status &probe_status) {
+        // receive size
+        size_t size;
+        int status = MPI_Mrecv(&size, 1, boost::mpi::get_mpi_datatype<size_t>(), &msg, &probe_status);
+        if (status != 0) {
+            ERR << "MPI_Mrecv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        data.resize(size);
+        if (size == 0) return; // nothing coming...
+
+        // match the payload right away, from the same source and with the same
+        // tag, which matters for wildcards
+        const int source = probe_status.MPI_SOURCE, msg_tag = probe_status.MPI_TAG;
+        if (trivial) {
+            auto recvptr = reinterpret_cast<transmit_type*>(data.data());
+            auto recvsize = size * sizeof(T)/sizeof(transmit_type);
+            std::vector<MPI_Request> reqs;
+            status = imrecv_large(recvptr, recvsize, transmit_datatype<transmit_type>(),
+                                  source, msg_tag, comm_copy, reqs);
+            if (status != 0) {
+                ERR << "MPI_Imrecv returned " << status << ", errno " << errno << std::endl;
+            }
+            for (MPI_Request req : reqs) r.add(req);
+            return;
+        }
+
+        // isend() sends the elements as a single archive via Boost.MPI
+        status = MPI_Mprobe(source, msg_tag, comm_copy, &msg, &probe_status);
+        if (status != 0) {
+            ERR << "MPI_Mprobe returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        int count;
+        MPI_Get_count(&probe_status, MPI_PACKED, &count);
+        auto ia = std::make_shared<boost::mpi::packed_iarchive>(comm_copy);
+        ia->resize(static_cast<size_t>(count));
+        MPI_Request req;
+        status = MPI_Imrecv(ia->address(), count, MPI_PACKED, &msg, &req);
+        if (status != 0) {
+            ERR << "MPI_Imrecv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        r.add(req);
+        r.hold(ia);
+        r.finally([ia, size, &data]() {
+            for (size_t i = 0; i < size; ++i) {
+                *ia >> data[i];
+            }
+        });
+    });
+    return result;
+}
+
 }
@@ -0,0 +1,62 @@
+#pragma once
+
+/*
+ * private_comm.h  -- Cached duplicates of communicators for internal messages
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+namespace unsafe_mpi {
+
+namespace detail {
+
+inline int free_private_comm(MPI_Comm, int, void *attribute, void *) {
+    MPI_Comm *dup = static_cast<MPI_Comm*>(attribute);
+    const int status = MPI_Comm_free(dup);
+    delete dup;
+    return status;
+}
+
+// Attribute key under which a communicator's private duplicate is cached.
+// Duplicates of the communicator don't inherit it.
+inline int private_comm_keyval() {
+    static const int keyval = [] {
+        int key = MPI_KEYVAL_INVALID;
+        MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, free_private_comm, &key, nullptr);
+        return key;
+    }();
+    return keyval;
+}
+
+}
+
+/*
+ * A duplicate of `comm` for the point-to-point messages of the algorithms in
+ * this library, which thus can't be matched by the caller's receives, not
+ * even with MPI_ANY_TAG, and vice versa. It is created on first use, which is
+ * collective over `comm`, cached as an attribute of `comm` and freed along
+ * with it.
+ */
+inline MPI_Comm private_comm(MPI_Comm comm) {
+    const int keyval = detail::private_comm_keyval();
+    void *attribute = nullptr;
+    int found = 0;
+    MPI_Comm_get_attr(comm, keyval, &attribute, &found);
+    if (found) return *static_cast<MPI_Comm*>(attribute);
+
+    MPI_Comm *dup = new MPI_Comm;
+    int status = MPI_Comm_dup(comm, dup);
+    if (status != 0) {
+        ERR << "MPI_Comm_dup returned " << status << ", errno " << errno << std::endl;
+        delete dup;
+        return comm;
+    }
+    MPI_Comm_set_attr(comm, keyval, dup);
+    return *dup;
+}
+
+}
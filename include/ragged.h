@@ -0,0 +1,142 @@
+#pragma once
+
+/*
+ * ragged.h  -- Flat wire format for vectors of strings and vectors
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "common.h"
+
+namespace unsafe_mpi {
+
+/*
+ * Ragged containers are variable-length sequences of trivial enough
+ * elements, such as std::string or std::vector<int>. A vector of them does not
+ * need Boost.Serialization, it can be sent as the element lengths followed by
+ * all elements' contents concatenated:
+ *
+ *   uint64_t n | uint64_t length[n] | contents of element 0 | ... | element n-1
+ */
+template <typename T>
+struct is_ragged : public std::false_type {};
+
+template <typename C, typename Traits, typename Alloc>
+struct is_ragged<std::basic_string<C, Traits, Alloc>> :
+    public std::integral_constant<bool, is_trivial_enough<C>::value> {};
+
+// std::vector<bool> is not contiguous and has no data(), so it is not ragged
+template <typename U, typename Alloc>
+struct is_ragged<std::vector<U, Alloc>> :
+    public std::integral_constant<bool,
+        is_trivial_enough<U>::value && !std::is_same<U, bool>::value
+    > {};
+
+
+namespace detail {
+
+// Writable pointer to a ragged element's contents. std::basic_string::data()
+// is only writable from C++17 on, but its storage is contiguous since C++11.
+template <typename U, typename Alloc>
+U *ragged_data(std::vector<U, Alloc> &elem) {
+    return elem.data();
+}
+
+template <typename C, typename Traits, typename Alloc>
+C *ragged_data(std::basic_string<C, Traits, Alloc> &elem) {
+    return &elem[0];
+}
+
+}
+
+
+// Number of bytes pack_ragged will need for in[0], ..., in[n-1]
+template <typename T>
+size_t ragged_size(const T *in, size_t n) {
+    typedef typename T::value_type value_type;
+    size_t bytes = (n + 1) * sizeof(uint64_t);
+    for (size_t i = 0; i < n; ++i) {
+        bytes += in[i].size() * sizeof(value_type);
+    }
+    return bytes;
+}
+
+template <typename T>
+size_t ragged_size(const std::vector<T> &in) {
+    return ragged_size(in.data(), in.size());
+}
+
+
+// Append the flat representation of in[0], ..., in[count-1] to `buf`, which
+// may be any vector of char
+template <typename T, typename Buffer>
+void pack_ragged(const T *in, size_t count, Buffer &buf) {
+    typedef typename T::value_type value_type;
+    size_t pos = buf.size();
+    buf.resize(pos + ragged_size(in, count));
+    char *header = buf.data() + pos, *payload = header + (count + 1) * sizeof(uint64_t);
+
+    const uint64_t n = count;
+    memcpy(header, &n, sizeof(uint64_t));
+    header += sizeof(uint64_t);
+    for (size_t i = 0; i < count; ++i) {
+        const T &elem = in[i];
+        const uint64_t length = elem.size();
+        const size_t bytes = elem.size() * sizeof(value_type);
+        memcpy(header, &length, sizeof(uint64_t));
+        header += sizeof(uint64_t);
+        if (bytes > 0) {
+            memcpy(payload, elem.data(), bytes);
+            payload += bytes;
+        }
+    }
+}
+
+
+template <typename T, typename Buffer>
+void pack_ragged(const std::vector<T> &in, Buffer &buf) {
+    pack_ragged(in.data(), in.size(), buf);
+}
+
+
+// Number of elements packed at `buf`
+inline size_t ragged_count(const char *buf) {
+    uint64_t n;
+    memcpy(&n, buf, sizeof(uint64_t));
+    return static_cast<size_t>(n);
+}
+
+
+// Rebuild the elements packed at `buf` into dest[0], ..., dest[n-1], where n
+// is ragged_count(buf). Returns the number of bytes consumed.
+template <typename T>
+size_t unpack_ragged(const char *buf, T *dest) {
+    typedef typename T::value_type value_type;
+    const size_t n = ragged_count(buf);
+    const char *header = buf + sizeof(uint64_t),
+        *payload = header + n * sizeof(uint64_t);
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t length;
+        memcpy(&length, header, sizeof(uint64_t));
+        header += sizeof(uint64_t);
+
+        // The payload need not be aligned for value_type, so copy bytewise
+        dest[i].resize(length);
+        const size_t bytes = length * sizeof(value_type);
+        if (bytes > 0) {
+            memcpy(detail::ragged_data(dest[i]), payload, bytes);
+            payload += bytes;
+        }
+    }
+    return static_cast<size_t>(payload - buf);
+}
+
+}
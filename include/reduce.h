@@ -0,0 +1,517 @@
+#pragma once
+
+/*
+ * reduce.h  -- Element-wise allreduce and reduce_scatter for std::vector
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/datatype.hpp>
+#include <boost/mpi/operations.hpp>
+
+#include "common.h"
+#include "instrumentation.h"
+#include "large_count.h"
+#include "private_comm.h"
+
+namespace unsafe_mpi {
+namespace ops {
+
+/*
+ * Element-wise operations that combine pairs, tuples and arrays component by
+ * component, and scalars with `Base::apply`. Vectors of arithmetic types,
+ * and of pairs and arrays of a single arithmetic type, are reduced with the
+ * corresponding built-in MPI operation, or with a plain loop over scalars
+ * that the compiler can vectorize.
+ */
+template <typename Base>
+struct componentwise {
+    template <typename U>
+    U operator()(const U &a, const U &b) const {
+        return combine(a, b);
+    }
+
+private:
+    template <typename U>
+    static U combine(const U &a, const U &b) {
+        return Base::apply(a, b);
+    }
+
+    template <typename U, typename V>
+    static std::pair<U, V> combine(const std::pair<U, V> &a, const std::pair<U, V> &b) {
+        return std::pair<U, V>(combine(a.first, b.first), combine(a.second, b.second));
+    }
+
+    template <typename U, size_t N>
+    static std::array<U, N> combine(const std::array<U, N> &a, const std::array<U, N> &b) {
+        std::array<U, N> result;
+        for (size_t i = 0; i < N; ++i) {
+            result[i] = combine(a[i], b[i]);
+        }
+        return result;
+    }
+
+    template <typename... Args>
+    static std::tuple<Args...> combine(const std::tuple<Args...> &a, const std::tuple<Args...> &b) {
+        std::tuple<Args...> result;
+        combine_tuple<0>(a, b, result, std::integral_constant<bool, (0 < sizeof...(Args))>());
+        return result;
+    }
+
+    template <size_t I, typename Tuple>
+    static void combine_tuple(const Tuple &a, const Tuple &b, Tuple &result, std::true_type) {
+        std::get<I>(result) = combine(std::get<I>(a), std::get<I>(b));
+        combine_tuple<I + 1>(a, b, result, std::integral_constant<bool,
+                             (I + 1 < std::tuple_size<Tuple>::value)>());
+    }
+
+    template <size_t I, typename Tuple>
+    static void combine_tuple(const Tuple &, const Tuple &, Tuple &, std::false_type) {}
+};
+
+struct add {
+    template <typename U>
+    static U apply(const U &a, const U &b) { return a + b; }
+};
+
+struct multiply {
+    template <typename U>
+    static U apply(const U &a, const U &b) { return a * b; }
+};
+
+struct minimum {
+    template <typename U>
+    static U apply(const U &a, const U &b) { return b < a ? b : a; }
+};
+
+struct maximum {
+    template <typename U>
+    static U apply(const U &a, const U &b) { return a < b ? b : a; }
+};
+
+typedef componentwise<add> plus;
+typedef componentwise<multiply> multiplies;
+typedef componentwise<minimum> min;
+typedef componentwise<maximum> max;
+
+// The built-in MPI operation that does the same as Op on scalars, if any
+template <typename Op>
+struct builtin : public std::false_type {
+    static MPI_Op op() { return MPI_OP_NULL; }
+};
+
+template <>
+struct builtin<plus> : public std::true_type {
+    static MPI_Op op() { return MPI_SUM; }
+};
+
+template <>
+struct builtin<multiplies> : public std::true_type {
+    static MPI_Op op() { return MPI_PROD; }
+};
+
+template <>
+struct builtin<min> : public std::true_type {
+    static MPI_Op op() { return MPI_MIN; }
+};
+
+template <>
+struct builtin<max> : public std::true_type {
+    static MPI_Op op() { return MPI_MAX; }
+};
+
+}
+
+
+/*
+ * T viewed as an array of `count` scalars of type `type`, if possible: true
+ * for arithmetic types, and for pairs of two and arrays of any number of the
+ * same such type (without padding). `count` is 0 for all others.
+ */
+template <typename T>
+struct flat {
+    typedef T type;
+    static const size_t count = std::is_arithmetic<T>::value ? 1 : 0;
+};
+
+template <typename U>
+struct flat<std::pair<U, U>> {
+    typedef typename flat<U>::type type;
+    static const size_t count =
+        (sizeof(std::pair<U, U>) == 2 * sizeof(U)) ? 2 * flat<U>::count : 0;
+};
+
+template <typename U, size_t N>
+struct flat<std::array<U, N>> {
+    typedef typename flat<U>::type type;
+    static const size_t count = N * flat<U>::count;
+};
+
+// Whether vectors of T can be reduced with Op scalar by scalar
+template <typename T, typename Op>
+struct reduce_flat : public std::false_type {};
+
+template <typename T, typename Base>
+struct reduce_flat<T, ops::componentwise<Base>>
+    : public std::integral_constant<bool, (flat<T>::count > 0)> {};
+
+
+namespace detail {
+
+template <typename T, typename Op>
+void reduce_local(const T *in, T *inout, size_t count, const Op &op, std::true_type) {
+    // Plain loop over scalars without aliasing, gets vectorized
+    typedef typename flat<T>::type S;
+    const S *a = reinterpret_cast<const S*>(in);
+    S *b = reinterpret_cast<S*>(inout);
+    const size_t n = count * flat<T>::count;
+    for (size_t i = 0; i < n; ++i) {
+        b[i] = op(a[i], b[i]);
+    }
+}
+
+template <typename T, typename Op>
+void reduce_local(const T *in, T *inout, size_t count, const Op &op, std::false_type) {
+    for (size_t i = 0; i < count; ++i) {
+        inout[i] = op(in[i], inout[i]);
+    }
+}
+
+}
+
+// inout[i] = op(in[i], inout[i]) for all i < count, like MPI does
+template <typename T, typename Op>
+void reduce_local(const T *in, T *inout, size_t count, const Op &op) {
+    detail::reduce_local(in, inout, count, op,
+                         std::integral_constant<bool, reduce_flat<T, Op>::value>());
+}
+
+
+/*
+ * An MPI operation for Op on elements of type T, created with MPI_Op_create
+ * and freed when going out of scope. Like Boost.MPI's, it calls the functor
+ * through a static pointer, so only one reduction with the same T and Op may
+ * run at a time.
+ */
+template <typename T, typename Op>
+class user_op {
+public:
+    user_op(const Op &op, bool commutative) {
+        current() = &op;
+        MPI_Op_create(&apply, commutative ? 1 : 0, &op_);
+    }
+
+    ~user_op() {
+        MPI_Op_free(&op_);
+    }
+
+    user_op(const user_op&) = delete;
+    user_op& operator=(const user_op&) = delete;
+
+    MPI_Op get() const {
+        return op_;
+    }
+
+private:
+    static const Op*& current() {
+        static const Op *op = nullptr;
+        return op;
+    }
+
+    static void apply(void *in, void *inout, int *len, MPI_Datatype *) {
+        reduce_local(static_cast<const T*>(in), static_cast<T*>(inout),
+                     static_cast<size_t>(*len), *current());
+    }
+
+    MPI_Op op_;
+};
+
+
+// Algorithms for allreduce and reduce_scatter
+enum class reduce_algorithm {
+    // ring for long vectors with commutative user-defined operations,
+    // native otherwise
+    automatic,
+    // MPI_Allreduce or MPI_Reduce_scatter
+    native,
+    // Reduce-scatter and allgather around a ring of PEs in p-1 steps each.
+    // Sends and receives about 2n elements in total per PE, independent of
+    // the number of PEs, which is optimal. Needs a commutative operation.
+    ring
+};
+
+// automatic uses the ring algorithm for vectors of at least this many bytes
+static const size_t ring_reduce_bytes = size_t(1) << 20;
+
+
+namespace detail {
+
+template <typename T, typename Op>
+bool use_ring(const boost::mpi::communicator &comm, size_t count, reduce_algorithm algorithm) {
+    const bool commutative = boost::mpi::is_commutative<Op, T>::value;
+    switch (algorithm) {
+    case reduce_algorithm::native:
+        return false;
+    case reduce_algorithm::ring:
+        return commutative && comm.size() > 1;
+    default:
+        return commutative && comm.size() > 2 && !ops::builtin<Op>::value &&
+            count * sizeof(T) >= ring_reduce_bytes;
+    }
+}
+
+// Split `count` elements into one block per PE, the first count % p blocks
+// get one more element. Returns p + 1 displacements.
+inline std::vector<size_t> even_blocks(size_t count, size_t num_blocks) {
+    std::vector<size_t> displacements(num_blocks + 1);
+    for (size_t i = 0; i <= num_blocks; ++i) {
+        displacements[i] = i * (count / num_blocks) + std::min(i, count % num_blocks);
+    }
+    return displacements;
+}
+
+// Send a block to the right neighbor and receive one from the left on
+// `ring`, the private duplicate of `comm`
+template <typename T>
+int sendrecv_block(const boost::mpi::communicator &comm, MPI_Comm ring, const T *send,
+                   size_t send_count, T *recv, size_t recv_count) {
+    typedef default_transmit_type<T> transmit_type;
+    const size_t factor = sizeof(T) / sizeof(transmit_type);
+    const int rank = comm.rank(), size = comm.size();
+    const large_datatype send_type(send_count * factor, transmit_datatype<transmit_type>()),
+        recv_type(recv_count * factor, transmit_datatype<transmit_type>());
+    return MPI_Sendrecv(const_cast<T*>(send), send_type.count(), send_type.type(),
+                        (rank + 1) % size, 0,
+                        recv, recv_type.count(), recv_type.type(),
+                        (rank + size - 1) % size, 0,
+                        ring, MPI_STATUS_IGNORE);
+}
+
+// Reduce `data` in place so that block i (between displacements i and i+1)
+// holds the result on PE i. In step s, PE r passes the partial result of
+// block r-s-1 to its right neighbor and adds its own data to block r-s-2.
+template <typename T, typename Op>
+int ring_reduce_scatter(const boost::mpi::communicator &comm, T *data,
+                        const std::vector<size_t> &displacements, const Op &op) {
+    const size_t p = static_cast<size_t>(comm.size()), rank = static_cast<size_t>(comm.rank());
+    size_t largest = 0;
+    for (size_t i = 0; i < p; ++i) {
+        largest = std::max(largest, displacements[i+1] - displacements[i]);
+    }
+    std::vector<T> incoming(largest);
+    const MPI_Comm ring = private_comm(comm);
+    for (size_t step = 0; step + 1 < p; ++step) {
+        const size_t send_block = (rank + 2 * p - step - 1) % p,
+            recv_block = (rank + 2 * p - step - 2) % p;
+        const size_t recv_count = displacements[recv_block+1] - displacements[recv_block];
+        int status = sendrecv_block(comm, ring, data + displacements[send_block],
+                                    displacements[send_block+1] - displacements[send_block],
+                                    incoming.data(), recv_count);
+        if (status != 0) return status;
+        unsafe_mpi::reduce_local(incoming.data(), data + displacements[recv_block], recv_count, op);
+    }
+    return 0;
+}
+
+// Pass the blocks around the ring until every PE has all of them, starting
+// with block i on PE i
+template <typename T>
+int ring_allgather(const boost::mpi::communicator &comm, T *data,
+                   const std::vector<size_t> &displacements) {
+    const size_t p = static_cast<size_t>(comm.size()), rank = static_cast<size_t>(comm.rank());
+    const MPI_Comm ring = private_comm(comm);
+    for (size_t step = 0; step + 1 < p; ++step) {
+        const size_t send_block = (rank + p - step) % p, recv_block = (rank + 2 * p - step - 1) % p;
+        int status = sendrecv_block(comm, ring, data + displacements[send_block],
+                                    displacements[send_block+1] - displacements[send_block],
+                                    data + displacements[recv_block],
+                                    displacements[recv_block+1] - displacements[recv_block]);
+        if (status != 0) return status;
+    }
+    return 0;
+}
+
+// Run `f(datatype, op, factor)` with the MPI datatype and operation to reduce
+// vectors of T with Op, where every element of T consists of `factor`
+// elements of the datatype
+template <typename T, typename Op, typename F>
+int with_mpi_op(const Op &op, F f, std::true_type) {
+    typedef typename flat<T>::type S;
+    (void)op;
+    return f(boost::mpi::get_mpi_datatype<S>(), ops::builtin<Op>::op(), flat<T>::count);
+}
+
+template <typename T, typename Op, typename F>
+int with_mpi_op(const Op &op, F f, std::false_type) {
+    const user_op<T, Op> mpi_op(op, boost::mpi::is_commutative<Op, T>::value);
+    return f(transmit_datatype<opaque_bytes<sizeof(T)>>(), mpi_op.get(), size_t(1));
+}
+
+template <typename T, typename Op>
+using use_builtin = std::integral_constant<bool,
+    ops::builtin<Op>::value && reduce_flat<T, Op>::value &&
+    boost::mpi::is_mpi_datatype<typename flat<T>::type>::value>;
+
+}
+
+
+/*
+ * Reduce `in` element-wise across all PEs with `op` and store the result in
+ * `out` on all PEs. `in` must have the same length everywhere. T needs to be
+ * trivial (enough), and `op` a binary functor on T. It is assumed to be
+ * non-commutative unless boost::mpi::is_commutative says otherwise, which it
+ * does for the operations in unsafe_mpi::ops.
+ */
+template <typename T, typename Op>
+void allreduce(const boost::mpi::communicator &comm, const std::vector<T> &in,
+               std::vector<T> &out, const Op &op,
+               reduce_algorithm algorithm = reduce_algorithm::automatic) {
+    static_assert(is_trivial_enough<T>::value, "allreduce requires trivial (enough) T");
+    instrument::recorder rec(comm, instrument::operation::allreduce);
+    rec.taken(instrument::path::trivial);
+    rec.enter(instrument::phase::transfer);
+    rec.sent(in.size() * sizeof(T));
+    rec.received(in.size() * sizeof(T));
+
+    if (detail::use_ring<T, Op>(comm, in.size(), algorithm)) {
+        out = in;
+        const auto displacements = detail::even_blocks(in.size(), static_cast<size_t>(comm.size()));
+        int status = detail::ring_reduce_scatter(comm, out.data(), displacements, op);
+        if (status == 0) {
+            status = detail::ring_allgather(comm, out.data(), displacements);
+        }
+        if (status != 0) {
+            ERR << "MPI_Sendrecv returned " << status << ", errno " << errno << std::endl;
+        }
+        return;
+    }
+
+    out.resize(in.size());
+    int status = detail::with_mpi_op<T>(op, [&](MPI_Datatype datatype, MPI_Op mpi_op, size_t factor) {
+        // Element-wise, so oversized vectors can simply be reduced in parts
+        const size_t total = in.size() * factor, unit = sizeof(T) / factor;
+        const char *sendptr = reinterpret_cast<const char*>(in.data());
+        char *recvptr = reinterpret_cast<char*>(out.data());
+        for (size_t pos = 0; pos < total; pos += max_count) {
+            const size_t count = std::min(max_count, total - pos);
+            int status = MPI_Allreduce(const_cast<char*>(sendptr + pos * unit), recvptr + pos * unit,
+                                       static_cast<int>(count), datatype, mpi_op, comm);
+            if (status != 0) return status;
+        }
+        return 0;
+    }, detail::use_builtin<T, Op>());
+    if (status != 0) {
+        ERR << "MPI_Allreduce returned " << status << ", errno " << errno << std::endl;
+    }
+}
+
+
+/*
+ * Reduce `in` element-wise across all PEs with `op`, and store the first
+ * counts[0] elements of the result in `out` on PE 0, the next counts[1] on
+ * PE 1, and so on. The counts have to add up to the length of `in`, which
+ * must be the same on all PEs. Requirements on T and `op` are the same as
+ * for allreduce.
+ */
+template <typename T, typename Op>
+void reduce_scatter(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                    const std::vector<size_t> &counts, std::vector<T> &out, const Op &op,
+                    reduce_algorithm algorithm = reduce_algorithm::automatic) {
+    static_assert(is_trivial_enough<T>::value, "reduce_scatter requires trivial (enough) T");
+    instrument::recorder rec(comm, instrument::operation::reduce_scatter);
+    rec.taken(instrument::path::trivial);
+    rec.enter(instrument::phase::transfer);
+    rec.sent(in.size() * sizeof(T));
+
+    const size_t rank = static_cast<size_t>(comm.rank());
+    std::vector<size_t> displacements(counts.size() + 1, 0);
+    for (size_t i = 0; i < counts.size(); ++i) {
+        displacements[i+1] = displacements[i] + counts[i];
+    }
+    out.resize(counts[rank]);
+    rec.received(out.size() * sizeof(T));
+
+    if (detail::use_ring<T, Op>(comm, in.size(), algorithm)) {
+        if (comm.size() == 1) {
+            std::copy(in.begin(), in.end(), out.begin());
+            return;
+        }
+        std::vector<T> buffer(in);
+        int status = detail::ring_reduce_scatter(comm, buffer.data(), displacements, op);
+        if (status != 0) {
+            ERR << "MPI_Sendrecv returned " << status << ", errno " << errno << std::endl;
+            return;
+        }
+        std::copy(buffer.begin() + displacements[rank], buffer.begin() + displacements[rank+1],
+                  out.begin());
+        return;
+    }
+
+    std::vector<int> recv_counts(counts.size());
+    int status = detail::with_mpi_op<T>(op, [&](MPI_Datatype datatype, MPI_Op mpi_op, size_t factor) {
+        // Element-wise, so oversized vectors can be reduced in windows of at
+        // most max_count units. Every PE receives the part of its block that
+        // falls into the window, in order, and the operation is still applied
+        // in rank order, so this is correct for non-commutative operations.
+        const size_t total = in.size() * factor, unit = sizeof(T) / factor;
+        const char *sendptr = reinterpret_cast<const char*>(in.data());
+        char *recvptr = reinterpret_cast<char*>(out.data());
+        for (size_t pos = 0; pos < total; pos += max_count) {
+            const size_t end = std::min(total, pos + max_count);
+            for (size_t i = 0; i < counts.size(); ++i) {
+                const size_t lo = std::max(displacements[i] * factor, pos),
+                    hi = std::min(displacements[i+1] * factor, end);
+                recv_counts[i] = static_cast<int>(hi > lo ? hi - lo : 0);
+            }
+            int status = MPI_Reduce_scatter(const_cast<char*>(sendptr + pos * unit), recvptr,
+                                            recv_counts.data(), datatype, mpi_op, comm);
+            if (status != 0) return status;
+            recvptr += static_cast<size_t>(recv_counts[rank]) * unit;
+        }
+        return 0;
+    }, detail::use_builtin<T, Op>());
+    if (status != 0) {
+        ERR << "MPI_Reduce_scatter returned " << status << ", errno " << errno << std::endl;
+    }
+}
+
+// Same as above, but with blocks of (almost) the same size: PE i receives
+// in.size() / p elements, plus one if i < in.size() % p
+template <typename T, typename Op>
+void reduce_scatter(const boost::mpi::communicator &comm, const std::vector<T> &in,
+                    std::vector<T> &out, const Op &op,
+                    reduce_algorithm algorithm = reduce_algorithm::automatic) {
+    const auto displacements = detail::even_blocks(in.size(), static_cast<size_t>(comm.size()));
+    std::vector<size_t> counts(static_cast<size_t>(comm.size()));
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] = displacements[i+1] - displacements[i];
+    }
+    reduce_scatter(comm, in, counts, out, op, algorithm);
+}
+
+}
+
+
+namespace boost {
+namespace mpi {
+
+// The element-wise operations are commutative for all types
+template <typename Base, typename T>
+struct is_commutative<unsafe_mpi::ops::componentwise<Base>, T> : public mpl::true_ {};
+
+}
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+/*
+ * request.h  -- Handle for nonblocking operations consisting of several
+ *               communication phases
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/mpi/request.hpp>
+
+#include "common.h"
+
+namespace unsafe_mpi {
+
+/*
+ * A nonblocking operation is a chain of phases. Each phase consists of some
+ * MPI requests, and once all of them have completed, the continuation set with
+ * then() is run to start the next phase. The last step, usually deserializing
+ * received data, is deferred until wait() is called.
+ *
+ * Phases after the first are started whenever the request is tested or
+ * waited on, so different PEs may start the phases of concurrent operations
+ * in different orders. Collectives in these phases therefore run on a
+ * duplicate of the communicator that belongs to the operation alone, see
+ * dup(). For the same reason, a PE may only block in wait() while all other
+ * unfinished requests of its thread can start their next phase, else it could
+ * hold up another PE waiting for one of them. As long as there are such
+ * requests, wait() keeps testing all of them instead of blocking.
+ *
+ * Instead of requests, a phase can wait for a message to arrive, see probe()
+ * and irecv() in point-to-point.h. Such phases match messages in the order the
+ * requests were started, like posted MPI receives.
+ *
+ * The request owns all state required by the operation (sizes, displacements,
+ * archives, ...). Input and output vectors passed to the operation must stay
+ * alive until wait() has returned. Destroying an unfinished request waits for
+ * it to complete.
+ */
+class request {
+public:
+    typedef std::function<void(request&)> continuation;
+    // Called with the message matched by a probe phase
+    typedef std::function<void(request&, MPI_Message&, MPI_Status&)> match_handler;
+
+    request() {}
+    request(request &&other) { *this = std::move(other); }
+    request& operator=(request &&other) {
+        if (this != &other) {
+            if (!done_) wait();
+            reqs_ = std::move(other.reqs_);
+            boost_reqs_ = std::move(other.boost_reqs_);
+            statuses_ = std::move(other.statuses_);
+            probe_ = std::move(other.probe_);
+            probe_comm_ = other.probe_comm_;
+            probe_src_ = other.probe_src_;
+            probe_tag_ = other.probe_tag_;
+            next_ = std::move(other.next_);
+            finish_ = std::move(other.finish_);
+            state_ = std::move(other.state_);
+            comms_ = std::move(other.comms_);
+            if (!other.done_) {
+                auto &list = unfinished();
+                std::replace(list.begin(), list.end(), &other, this);
+            }
+            done_ = other.done_;
+            other.reqs_.clear();
+            other.boost_reqs_.clear();
+            other.probe_ = nullptr;
+            other.next_ = nullptr;
+            other.finish_ = nullptr;
+            other.comms_.clear();
+            other.done_ = true;
+        }
+        return *this;
+    }
+    request(const request&) = delete;
+    request& operator=(const request&) = delete;
+
+    ~request() {
+        if (!done_) wait();
+    }
+
+    // Advance the operation without blocking. Returns true once all
+    // communication has completed (wait() will then not block)
+    bool test() {
+        while (true) {
+            if (!reqs_.empty()) {
+                int flag = 0;
+                statuses_.resize(reqs_.size());
+                int status = MPI_Testall(static_cast<int>(reqs_.size()), reqs_.data(),
+                                         &flag, statuses_.data());
+                if (status != 0) {
+                    ERR << "MPI_Testall returned " << status << ", errno " << errno << std::endl;
+                }
+                if (!flag) return false;
+                reqs_.clear();
+            }
+            while (!boost_reqs_.empty()) {
+                if (!boost_reqs_.back().test()) return false;
+                boost_reqs_.pop_back();
+            }
+            if (probe_) {
+                if (!match(false)) return false;
+                continue;
+            }
+            if (!next_) return true;
+            run_next();
+        }
+    }
+
+    // Block until the operation has completed
+    void wait() {
+        while (others_need_progress() && !test()) {
+            const auto &list = unfinished();
+            for (size_t i = 0; i < list.size(); ++i) {
+                if (list[i] != this) list[i]->test();
+            }
+        }
+        while (true) {
+            if (!reqs_.empty()) {
+                statuses_.resize(reqs_.size());
+                int status = MPI_Waitall(static_cast<int>(reqs_.size()), reqs_.data(),
+                                         statuses_.data());
+                if (status != 0) {
+                    ERR << "MPI_Waitall returned " << status << ", errno " << errno << std::endl;
+                }
+                reqs_.clear();
+            }
+            for (auto &req : boost_reqs_) {
+                req.wait();
+            }
+            boost_reqs_.clear();
+            if (probe_) {
+                match(true);
+                continue;
+            }
+            if (!next_) break;
+            run_next();
+        }
+        if (finish_) {
+            auto finish = std::move(finish_);
+            finish_ = nullptr;
+            finish();
+        }
+        state_.reset();
+        comms_.clear();
+        if (!done_) {
+            auto &list = unfinished();
+            list.erase(std::remove(list.begin(), list.end(), this), list.end());
+            done_ = true;
+        }
+    }
+
+    // Whether wait() has already been called
+    bool done() const { return done_; }
+
+    // Interface for the operations building on this
+    void add(MPI_Request req) {
+        mark_unfinished();
+        reqs_.push_back(req);
+    }
+
+    void add(boost::mpi::request req) {
+        mark_unfinished();
+        boost_reqs_.push_back(std::move(req));
+    }
+
+    // Once all requests of the current phase have completed, match a message
+    // from `src` with `tag` on `comm` (wildcards allowed) and pass it to `fn`,
+    // which may add the requests of the next phase
+    void probe(MPI_Comm comm, int src, int tag, match_handler fn) {
+        mark_unfinished();
+        probe_ = std::move(fn);
+        probe_comm_ = comm;
+        probe_src_ = src;
+        probe_tag_ = tag;
+    }
+
+    // Run `cont` once all requests of the current phase have completed
+    void then(continuation cont) {
+        mark_unfinished();
+        next_ = std::move(cont);
+    }
+
+    // Run `fin` in wait(), after all communication has completed
+    void finally(std::function<void()> fin) {
+        mark_unfinished();
+        finish_ = std::move(fin);
+    }
+
+    // Keep `state` alive until the operation has completed
+    void hold(std::shared_ptr<void> state) {
+        state_ = std::move(state);
+    }
+
+    // Start duplicating `comm` with MPI_Comm_idup as part of the current
+    // phase. Collective over `comm`, so all PEs must start it at the same
+    // point, i.e., not within a continuation. The duplicate can be used from
+    // the next phase on and is freed once the operation has completed.
+    std::shared_ptr<MPI_Comm> dup(MPI_Comm comm) {
+        MPI_Comm *dup = new MPI_Comm(MPI_COMM_NULL);
+        MPI_Request req;
+        int status = MPI_Comm_idup(comm, dup, &req);
+        if (status != 0) {
+            ERR << "MPI_Comm_idup returned " << status << ", errno " << errno << std::endl;
+            *dup = comm;
+            return std::shared_ptr<MPI_Comm>(dup);
+        }
+        add(req);
+        std::shared_ptr<MPI_Comm> result(dup, [](MPI_Comm *c) {
+            MPI_Comm_free(c);
+            delete c;
+        });
+        comms_.push_back(result);
+        return result;
+    }
+
+    // Statuses of the requests of the phase that completed last, in the order
+    // they were added. Only valid within a continuation.
+    const std::vector<MPI_Status>& statuses() const { return statuses_; }
+
+private:
+    // Requests of this thread that have been started but not waited for
+    static std::vector<request*>& unfinished() {
+        static thread_local std::vector<request*> list;
+        return list;
+    }
+
+    void mark_unfinished() {
+        if (done_) {
+            done_ = false;
+            unfinished().push_back(this);
+        }
+    }
+
+    // Whether another unfinished request has a phase left to start
+    bool others_need_progress() const {
+        for (const request *other : unfinished()) {
+            if (other != this && (other->next_ || other->probe_)) return true;
+        }
+        return false;
+    }
+
+    // Whether an earlier request's probe phase could match a message from
+    // `src` with `tag` on `comm`
+    bool claimed_earlier(MPI_Comm comm, int src, int tag) const {
+        for (const request *other : unfinished()) {
+            if (other == this) return false;
+            if (other->probe_ && other->probe_comm_ == comm &&
+                (other->probe_src_ == MPI_ANY_SOURCE || other->probe_src_ == src) &&
+                (other->probe_tag_ == MPI_ANY_TAG || other->probe_tag_ == tag)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Match the message of the probe phase and run its handler. Without
+    // `block`, returns false if there is no message that this request may take.
+    bool match(bool block) {
+        MPI_Message msg;
+        MPI_Status status;
+        int flag = 1, ret;
+        if (block) {
+            // Only called if no other request has a probe phase pending
+            ret = MPI_Mprobe(probe_src_, probe_tag_, probe_comm_, &msg, &status);
+        } else {
+            // Let earlier requests take their messages first, then check that
+            // the next message is not one of theirs
+            const auto &list = unfinished();
+            for (size_t i = 0; i < list.size() && list[i] != this; ++i) {
+                if (list[i]->probe_) list[i]->test();
+            }
+            ret = MPI_Iprobe(probe_src_, probe_tag_, probe_comm_, &flag, &status);
+            if (ret == 0 && flag) {
+                if (claimed_earlier(probe_comm_, status.MPI_SOURCE, status.MPI_TAG)) return false;
+                ret = MPI_Improbe(status.MPI_SOURCE, status.MPI_TAG, probe_comm_,
+                                  &flag, &msg, &status);
+            }
+        }
+        if (ret != 0) {
+            ERR << (block ? "MPI_Mprobe" : "MPI_Improbe") << " returned " << ret
+                << ", errno " << errno << std::endl;
+            probe_ = nullptr;
+            return true;
+        }
+        if (!flag) return false;
+        auto handler = std::move(probe_);
+        probe_ = nullptr;
+        handler(*this, msg, status);
+        return true;
+    }
+
+    void run_next() {
+        auto cont = std::move(next_);
+        next_ = nullptr;
+        cont(*this);
+    }
+
+    std::vector<MPI_Request> reqs_;
+    std::vector<boost::mpi::request> boost_reqs_;
+    std::vector<MPI_Status> statuses_;
+    match_handler probe_;
+    MPI_Comm probe_comm_ = MPI_COMM_NULL;
+    int probe_src_ = MPI_ANY_SOURCE, probe_tag_ = MPI_ANY_TAG;
+    continuation next_;
+    std::function<void()> finish_;
+    std::shared_ptr<void> state_;
+    std::vector<std::shared_ptr<MPI_Comm>> comms_;
+    bool done_ = true;
+};
+
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+/*
+ * sort.h  -- Distributed sample sort for trivial types
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/communicator.hpp>
+
+#include "allgatherv.h"
+#include "alltoallv.h"
+#include "common.h"
+#include "output.h"
+#include "parallel.h"
+#include "workspace.h"
+
+namespace unsafe_mpi {
+
+// Number of samples per PE (for PEs holding an average share of the data)
+// from which sort() picks its splitters
+static const size_t sort_oversampling = 64;
+
+// The local sort uses at most one thread per this many elements
+static const size_t parallel_sort_threshold = size_t(1) << 16;
+
+/*
+ * A sample of the element at position `index` of the locally sorted data of
+ * PE `rank`. Comparing samples by (value, rank, index) makes all elements
+ * distinct, so that runs of equal keys can be split between PEs.
+ */
+template <typename T>
+struct sort_sample {
+    T value;
+    uint64_t rank;
+    uint64_t index;
+};
+
+template <typename T>
+struct is_trivial_enough<sort_sample<T>> : public is_trivial_enough<T> {};
+
+
+namespace detail {
+
+template <typename T, typename Compare>
+struct sample_less {
+    Compare comp;
+
+    bool operator()(const sort_sample<T> &a, const sort_sample<T> &b) const {
+        if (comp(a.value, b.value)) return true;
+        if (comp(b.value, a.value)) return false;
+        return a.rank < b.rank || (a.rank == b.rank && a.index < b.index);
+    }
+};
+
+// Merge the sorted runs [bounds[i], bounds[i+1]) of `in` into `out`, which
+// has room for all of them. Equal elements are taken from earlier runs first.
+template <typename T, typename Compare>
+void multiway_merge(const T *in, const std::vector<size_t> &bounds, T *out, Compare comp) {
+    const size_t runs = bounds.size() - 1;
+    std::vector<size_t> pos(bounds.begin(), bounds.end() - 1);
+    // Min-heap of the runs that still have elements, by their current head
+    auto later = [&](size_t a, size_t b) {
+        if (comp(in[pos[b]], in[pos[a]])) return true;
+        if (comp(in[pos[a]], in[pos[b]])) return false;
+        return a > b;
+    };
+    std::vector<size_t> heap;
+    heap.reserve(runs);
+    for (size_t i = 0; i < runs; ++i) {
+        if (bounds[i] < bounds[i+1]) heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+    while (heap.size() > 1) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        const size_t run = heap.back();
+        *out++ = in[pos[run]++];
+        if (pos[run] < bounds[run+1]) {
+            std::push_heap(heap.begin(), heap.end(), later);
+        } else {
+            heap.pop_back();
+        }
+    }
+    if (!heap.empty()) {
+        std::copy(in + pos[heap[0]], in + bounds[heap[0] + 1], out);
+    }
+}
+
+// std::sort, or with `threads` > 1, sort blocks in parallel and merge them
+template <typename T, typename Compare>
+void local_sort(std::vector<T> &data, Compare comp, size_t threads) {
+    if (threads == 0) threads = num_threads(data.size() / parallel_sort_threshold);
+    threads = std::min(threads, std::max<size_t>(1, data.size() / parallel_sort_threshold));
+    if (threads <= 1) {
+        std::sort(data.begin(), data.end(), comp);
+        return;
+    }
+
+    std::vector<size_t> bounds(threads + 1);
+    for (size_t i = 0; i <= threads; ++i) {
+        bounds[i] = data.size() * i / threads;
+    }
+    parallel_for(threads, threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            std::sort(data.begin() + bounds[i], data.begin() + bounds[i+1], comp);
+        }
+    });
+    std::vector<T> merged(data.size());
+    multiway_merge(data.data(), bounds, merged.data(), comp);
+    data.swap(merged);
+}
+
+}
+
+
+/*
+ * Sort the elements of all PEs' `data` globally with `comp`: afterwards, each
+ * PE's `data` is sorted, and all elements on PE i precede those on PE i+1.
+ * T needs to be trivial (enough). PEs end up with roughly the same number of
+ * elements, even if there are many equal keys.
+ *
+ * This is a sample sort: sort locally, allgatherv a sample of every PE's data
+ * and pick p-1 splitters from it, send the elements between two splitters to
+ * their PE straight from the sorted input with one alltoallv, and merge the
+ * p sorted runs received. Samples are ordered by (key, PE, position), so
+ * that a splitter can fall into a run of equal keys.
+ *
+ * `threads` threads sort locally, 0 means as many as there are cores. The
+ * MPI calls are all made from the calling thread.
+ */
+template <typename T, typename Compare = std::less<T>>
+void sort(const boost::mpi::communicator &comm, std::vector<T> &data, Compare comp,
+          workspace &ws, size_t threads = 1) {
+    static_assert(is_trivial_enough<T>::value, "sort requires trivial (enough) T");
+    const size_t comm_size = static_cast<size_t>(comm.size());
+    const uint64_t rank = static_cast<uint64_t>(comm.rank());
+
+    // Step 1: sort locally
+    detail::local_sort(data, comp, threads);
+    if (comm_size == 1) return;
+
+    // Step 2: sample regularly from the sorted data, proportionally to the
+    // local share of all elements
+    const uint64_t local_size = data.size();
+    uint64_t total_size = 0;
+    boost::mpi::all_reduce(comm, local_size, total_size, std::plus<uint64_t>());
+    if (total_size == 0) return;
+    size_t num_samples = static_cast<size_t>(
+        (local_size * sort_oversampling * comm_size + total_size - 1) / total_size);
+    num_samples = std::min(num_samples, data.size());
+    std::vector<sort_sample<T>> samples(num_samples), all_samples;
+    for (size_t i = 0; i < num_samples; ++i) {
+        const size_t index = (2 * i + 1) * data.size() / (2 * num_samples);
+        samples[i] = sort_sample<T>{data[index], rank, index};
+    }
+
+    // Step 3: gather all samples and pick the splitters
+    allgatherv_unsafe(comm, samples, all_samples, ws);
+    const detail::sample_less<T, Compare> less{comp};
+    std::sort(all_samples.begin(), all_samples.end(), less);
+
+    // Step 4: find the bucket boundaries. Elements equal to a splitter go to
+    // the left if they come before it in (PE, position) order.
+    std::vector<int> counts(comm_size);
+    size_t prev = 0;
+    for (size_t i = 1; i <= comm_size; ++i) {
+        size_t bound = data.size();
+        if (i < comm_size) {
+            const sort_sample<T> &splitter = all_samples[i * all_samples.size() / comm_size];
+            const auto range = std::equal_range(data.begin(), data.end(), splitter.value, comp);
+            const size_t lo = static_cast<size_t>(range.first - data.begin()),
+                hi = static_cast<size_t>(range.second - data.begin());
+            if (rank < splitter.rank) {
+                bound = hi;
+            } else if (rank > splitter.rank) {
+                bound = lo;
+            } else {
+                bound = std::min(std::max(static_cast<size_t>(splitter.index), lo), hi);
+            }
+            bound = std::max(bound, prev);
+        }
+        counts[i-1] = static_cast<int>(bound - prev);
+        prev = bound;
+    }
+
+    // Step 5: exchange the buckets, sending from the sorted data in place.
+    // The run received from PE i lies between bounds[i] and bounds[i+1].
+    std::vector<T> received;
+    std::vector<size_t> bounds;
+    alltoallv_unsafe(comm, data.data(), counts, received, bounds, ws);
+
+    // Step 6: merge the sorted runs from all PEs
+    data.resize(received.size());
+    detail::multiway_merge(received.data(), bounds, data.data(), comp);
+}
+
+template <typename T, typename Compare = std::less<T>>
+void sort(const boost::mpi::communicator &comm, std::vector<T> &data,
+          Compare comp = Compare(), size_t threads = 1) {
+    workspace ws;
+    sort(comm, data, comp, ws, threads);
+}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+/*
+ * sparse_exchange.h  -- Sparse dynamic data exchange with the NBX algorithm
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <errno.h>
+#include <mpi.h>
+
+#include <map>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+
+#include "archive.h"
+#include "common.h"
+#include "instrumentation.h"
+#include "point-to-point.h"
+#include "workspace.h"
+
+namespace unsafe_mpi {
+
+// Tag used by sparse_exchange unless told otherwise
+static const int sparse_exchange_tag = 27182;
+
+/*
+ * Send `out[i]` to PE i for every key i of `out`, and return the vectors
+ * received from other PEs, keyed by source. PEs don't need to know who sends
+ * them data, and no sizes are exchanged globally: the cost depends on the
+ * number of neighbors, not on the size of the communicator.
+ *
+ * This is the NBX algorithm by Hoefler et al.: every message is sent with
+ * MPI_Issend, which completes only once the receiver has matched it. When
+ * all of its messages have been matched, a PE enters a nonblocking barrier,
+ * and keeps receiving until the barrier completes. By then, all messages of
+ * all PEs have been received. Messages use the probe protocol of send() and
+ * recv(), i.e., one message per neighbor.
+ *
+ * A PE may still be receiving when others have already returned, so that
+ * messages of the next exchange on the same communicator could end up in
+ * this one. Use different tags for consecutive exchanges, e.g. alternate
+ * between two. The tag must not be used by other messages in the meantime.
+ */
+template <typename T, typename transmit_type = default_transmit_type<T>>
+std::map<int, std::vector<T>> sparse_exchange(const boost::mpi::communicator &comm,
+                                              const std::map<int, std::vector<T>> &out,
+                                              workspace &ws, int tag = sparse_exchange_tag) {
+    const bool trivial = is_trivial_enough<T>::value;
+    std::map<int, std::vector<T>> result;
+
+    // Step 1: start synchronous sends to all neighbors
+    std::vector<MPI_Request> requests(out.size(), MPI_REQUEST_NULL);
+    std::vector<archive_buffer> buffers(trivial ? 0 : out.size());
+    size_t i = 0;
+    for (const auto &dest : out) {
+        archive_buffer &buf = trivial ? ws.send_buffer : buffers[i];
+        int status = issend_probe<T, transmit_type>(comm, dest.first, tag, dest.second.data(),
+                                                    dest.second.size(), buf, &requests[i]);
+        if (status != 0) {
+            ERR << "MPI_Issend returned " << status << ", errno " << errno << std::endl;
+            return result;
+        }
+        ++i;
+    }
+
+    // Step 2: receive whatever arrives until everybody's sends have completed
+    MPI_Request barrier = MPI_REQUEST_NULL;
+    bool in_barrier = false;
+    while (true) {
+        int flag, status;
+        MPI_Message msg;
+        MPI_Status probe_status;
+        status = MPI_Improbe(MPI_ANY_SOURCE, tag, comm, &flag, &msg, &probe_status);
+        if (status != 0) {
+            ERR << "MPI_Improbe returned " << status << ", errno " << errno << std::endl;
+            return result;
+        }
+        if (flag) {
+            instrument::recorder rec(comm, instrument::operation::recv);
+            rec.taken(trivial ? instrument::path::trivial : instrument::path::serialized);
+            rec.enter(instrument::phase::transfer);
+            std::vector<T> &data = result[probe_status.MPI_SOURCE];
+            status = recv_matched<T, transmit_type>(comm, msg, probe_status, data, ws, rec);
+            if (status != 0) {
+                ERR << "MPI_Mrecv returned " << status << ", errno " << errno << std::endl;
+                return result;
+            }
+        }
+
+        if (in_barrier) {
+            status = MPI_Test(&barrier, &flag, MPI_STATUS_IGNORE);
+            if (status != 0) {
+                ERR << "MPI_Test returned " << status << ", errno " << errno << std::endl;
+                return result;
+            }
+            if (flag) break;
+        } else {
+            status = MPI_Testall(static_cast<int>(requests.size()), requests.data(),
+                                 &flag, MPI_STATUSES_IGNORE);
+            if (status != 0) {
+                ERR << "MPI_Testall returned " << status << ", errno " << errno << std::endl;
+                return result;
+            }
+            if (flag) {
+                // All our messages have been received, tell the others
+                status = MPI_Ibarrier(comm, &barrier);
+                if (status != 0) {
+                    ERR << "MPI_Ibarrier returned " << status << ", errno " << errno << std::endl;
+                    return result;
+                }
+                in_barrier = true;
+            }
+        }
+    }
+    return result;
+}
+
+template <typename T, typename transmit_type = default_transmit_type<T>>
+std::map<int, std::vector<T>> sparse_exchange(const boost::mpi::communicator &comm,
+                                              const std::map<int, std::vector<T>> &out,
+                                              int tag = sparse_exchange_tag) {
+    workspace ws;
+    return sparse_exchange<T, transmit_type>(comm, out, ws, tag);
+}
+
+}
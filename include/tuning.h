@@ -0,0 +1,250 @@
+#pragma once
+
+/*
+ * tuning.h  -- Choose between algorithms for trivial allgatherv and gatherv
+ *
+ * MPI_Allgatherv and MPI_Gatherv are tuned for balanced inputs. When one PE
+ * contributes most of the data, or when messages are tiny and there are many
+ * PEs, other algorithms can be much faster. The trivial allgatherv and gatherv
+ * paths pick one based on the communicator size, the total number of bytes
+ * and the imbalance, i.e. the largest contribution relative to the average.
+ *
+ * The choice comes from a tuning table measured by the unsafe_mpi_autotune
+ * tool, which is loaded from the file named by the UNSAFE_MPI_TUNING
+ * environment variable on first use. All PEs must load the same table.
+ * Without a table, a few conservative built-in rules apply.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace unsafe_mpi {
+
+enum class allgatherv_algorithm {
+    // from the tuning table or the built-in rules
+    automatic,
+    // MPI_Allgatherv
+    native,
+    // p-1 steps, each PE passes one block to its right neighbor per step
+    ring,
+    // ceil(log2 p) steps, each PE sends everything it has to the PE at
+    // distance 2^k in step k (Bruck et al.)
+    bruck,
+    // gatherv to the PE with the largest contribution, which broadcasts
+    // the result. Only its small share of the data moves twice.
+    gather_broadcast
+};
+
+enum class gatherv_algorithm {
+    // from the tuning table or the built-in rules
+    automatic,
+    // MPI_Gatherv
+    native,
+    // binomial tree, ceil(log2 p) steps, for small messages
+    tree
+};
+
+inline const char* name(allgatherv_algorithm algorithm) {
+    static const char* names[] = { "automatic", "native", "ring", "bruck", "gather_broadcast" };
+    return names[static_cast<size_t>(algorithm)];
+}
+
+inline const char* name(gatherv_algorithm algorithm) {
+    static const char* names[] = { "automatic", "native", "tree" };
+    return names[static_cast<size_t>(algorithm)];
+}
+
+// Parse the name of an algorithm, returns false if there is none by that name
+inline bool parse(const std::string &str, allgatherv_algorithm &algorithm) {
+    for (int i = 0; i <= static_cast<int>(allgatherv_algorithm::gather_broadcast); ++i) {
+        if (str == name(static_cast<allgatherv_algorithm>(i))) {
+            algorithm = static_cast<allgatherv_algorithm>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool parse(const std::string &str, gatherv_algorithm &algorithm) {
+    for (int i = 0; i <= static_cast<int>(gatherv_algorithm::tree); ++i) {
+        if (str == name(static_cast<gatherv_algorithm>(i))) {
+            algorithm = static_cast<gatherv_algorithm>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Built-in rules: gather_broadcast for allgatherv if a single PE contributes
+// at least half of this many bytes or more
+static const uint64_t gather_broadcast_bytes = uint64_t(1) << 16;
+
+
+/*
+ * The best algorithm measured for a number of PEs, total bytes and
+ * imbalance. A table is a list of such measurements. The file format is one
+ * entry per line,
+ *
+ *     allgatherv <ranks> <bytes> <imbalance> <algorithm>
+ *     gatherv <ranks> <bytes> <imbalance> <algorithm>
+ *
+ * and lines starting with # are ignored.
+ */
+struct tuning_entry {
+    size_t ranks;
+    uint64_t bytes;
+    double imbalance;
+    int algorithm;
+};
+
+class tuning_table {
+public:
+    std::vector<tuning_entry> allgatherv, gatherv;
+
+    bool empty() const {
+        return allgatherv.empty() && gatherv.empty();
+    }
+
+    // Replace the table with the one in the file at `path`. Returns false if
+    // it can't be read.
+    bool load(const std::string &path) {
+        std::ifstream in(path);
+        if (!in) return false;
+        allgatherv.clear();
+        gatherv.clear();
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string op, algo;
+            tuning_entry entry;
+            if (!(fields >> op) || op[0] == '#') continue;
+            if (!(fields >> entry.ranks >> entry.bytes >> entry.imbalance >> algo)) continue;
+            allgatherv_algorithm a;
+            gatherv_algorithm g;
+            if (op == "allgatherv" && parse(algo, a)) {
+                entry.algorithm = static_cast<int>(a);
+                allgatherv.push_back(entry);
+            } else if (op == "gatherv" && parse(algo, g)) {
+                entry.algorithm = static_cast<int>(g);
+                gatherv.push_back(entry);
+            }
+        }
+        return true;
+    }
+
+    bool save(const std::string &path) const {
+        std::ofstream out(path);
+        out << "# operation ranks bytes imbalance algorithm" << std::endl;
+        for (const auto &e : allgatherv) {
+            out << "allgatherv " << e.ranks << ' ' << e.bytes << ' ' << e.imbalance << ' '
+                << name(static_cast<allgatherv_algorithm>(e.algorithm)) << std::endl;
+        }
+        for (const auto &e : gatherv) {
+            out << "gatherv " << e.ranks << ' ' << e.bytes << ' ' << e.imbalance << ' '
+                << name(static_cast<gatherv_algorithm>(e.algorithm)) << std::endl;
+        }
+        return static_cast<bool>(out);
+    }
+
+    /*
+     * The algorithm of the entry closest below the given point, or -1 if
+     * there are no entries. Looks for the largest number of ranks, then
+     * bytes, then imbalance that doesn't exceed the arguments, or the
+     * smallest if all do.
+     */
+    static int lookup(const std::vector<tuning_entry> &entries, size_t ranks, uint64_t bytes,
+                      double imbalance) {
+        if (entries.empty()) return -1;
+        const size_t r = floor_of(entries, ranks, [](const tuning_entry &e) { return e.ranks; },
+                                  [](const tuning_entry &) { return true; });
+        const uint64_t b = floor_of(entries, bytes, [](const tuning_entry &e) { return e.bytes; },
+                                    [r](const tuning_entry &e) { return e.ranks == r; });
+        const double i = floor_of(entries, imbalance, [](const tuning_entry &e) { return e.imbalance; },
+                                  [r, b](const tuning_entry &e) { return e.ranks == r && e.bytes == b; });
+        for (const auto &e : entries) {
+            if (e.ranks == r && e.bytes == b && e.imbalance == i) return e.algorithm;
+        }
+        return -1;
+    }
+
+private:
+    // Largest key(e) <= value among the entries for which filter(e) holds,
+    // or the smallest one if there is none
+    template <typename V, typename Key, typename Filter>
+    static V floor_of(const std::vector<tuning_entry> &entries, V value, Key key, Filter filter) {
+        bool below = false, any = false;
+        V best = V();
+        for (const auto &e : entries) {
+            if (!filter(e)) continue;
+            const V k = key(e);
+            if (k <= value) {
+                if (!below || k > best) best = k;
+                below = true;
+            } else if (!below && (!any || k < best)) {
+                best = k;
+            }
+            any = true;
+        }
+        return best;
+    }
+};
+
+// The tuning table, loaded from $UNSAFE_MPI_TUNING on first use. Not
+// thread-safe; change it only while no collectives are running.
+inline tuning_table& tuning() {
+    static tuning_table table = [] {
+        tuning_table t;
+        const char *path = std::getenv("UNSAFE_MPI_TUNING");
+        if (path != nullptr && *path != '\0') t.load(path);
+        return t;
+    }();
+    return table;
+}
+
+
+// Algorithm for an allgatherv in which PE i contributes sizes[i] elements of
+// `extent` bytes each. Every PE knows all sizes, so all of them get the same.
+inline allgatherv_algorithm select_allgatherv(const std::vector<uint64_t> &sizes, size_t extent) {
+    const size_t p = sizes.size();
+    uint64_t total = 0, largest = 0;
+    for (uint64_t size : sizes) {
+        total += size;
+        largest = std::max(largest, size);
+    }
+    if (p <= 2 || total == 0) return allgatherv_algorithm::native;
+    const uint64_t bytes = total * extent;
+    const double imbalance = static_cast<double>(largest) * p / total;
+
+    const int algorithm = tuning_table::lookup(tuning().allgatherv, p, bytes, imbalance);
+    if (algorithm > 0) return static_cast<allgatherv_algorithm>(algorithm);
+    if (largest * extent >= gather_broadcast_bytes / 2 && 2 * largest >= total) {
+        return allgatherv_algorithm::gather_broadcast;
+    }
+    return allgatherv_algorithm::native;
+}
+
+// Algorithm for a gatherv, as decided by the root, which knows all sizes
+inline gatherv_algorithm select_gatherv(const std::vector<uint64_t> &sizes, size_t extent) {
+    const size_t p = sizes.size();
+    uint64_t total = 0, largest = 0;
+    for (uint64_t size : sizes) {
+        total += size;
+        largest = std::max(largest, size);
+    }
+    if (p <= 2 || total == 0) return gatherv_algorithm::native;
+    const double imbalance = static_cast<double>(largest) * p / total;
+    const int algorithm = tuning_table::lookup(tuning().gatherv, p, total * extent, imbalance);
+    if (algorithm > 0) return static_cast<gatherv_algorithm>(algorithm);
+    return gatherv_algorithm::native;
+}
+
+}
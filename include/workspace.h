@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+ * workspace.h  -- Reusable scratch buffers for repeated calls
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "archive.h"
+#include "output.h"
+
+namespace unsafe_mpi {
+
+/*
+ * Scratch space for the size arrays and archives of allgatherv, gatherv,
+ * alltoallv, broadcast and the probe protocol of send/recv. Pass the same
+ * workspace to repeated calls: its buffers only ever grow, so that calls
+ * with similar sizes stop allocating after the first one.
+ *
+ * A workspace may be used with any communicator, but only by one call at a
+ * time. The overloads without a workspace use a temporary one.
+ */
+struct workspace {
+    workspace() = default;
+    workspace(const workspace&) = delete;
+    workspace& operator=(const workspace&) = delete;
+
+    // Arrays with one entry per PE (or two, or one more for displacements)
+    std::vector<int> sizes, displacements, rest_sizes, rest_displacements, meta, recv_meta;
+    std::vector<uint64_t> sizes64;
+    std::vector<size_t> displacements64, offsets;
+    std::vector<eager_block> blocks;
+
+    // Outgoing and incoming archives
+    archive_buffer send_buffer, recv_buffer;
+    // One destination's archive before it is appended to send_buffer
+    archive_buffer segment_buffer;
+    // Blocks of the outgoing archive while they are packed in parallel
+    std::vector<archive_buffer> block_buffers;
+
+    // Outgoing and incoming data of types sent without padding
+    std::vector<uint8_t> packed;
+    uninitialized_vector<uint8_t> packed_recv;
+};
+
+}
@@ -0,0 +1,145 @@
+/*
+ * algorithms_test.cpp  -- Every allgatherv and gatherv algorithm
+ *
+ * Ring, Bruck, gather-broadcast and the binomial tree must deliver the same
+ * concatenation as MPI, for imbalanced sizes and empty contributions, in
+ * place or not, for every root. They are run both directly and as chosen
+ * through the tuning table.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+using unsafe_mpi::allgatherv_algorithm;
+using unsafe_mpi::gatherv_algorithm;
+
+// PE 1 contributes nothing, PE 0 most of the data, the others a little
+size_t count(int rank, int round) {
+    if (rank == 1) return 0;
+    if (rank == 0) return static_cast<size_t>(500 + 300 * round);
+    return static_cast<size_t>(rank * (round + 1) + 2);
+}
+
+std::vector<uint64_t> local(int rank, int round) {
+    std::vector<uint64_t> result(count(rank, round));
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = (static_cast<uint64_t>(rank) << 32) | i;
+    }
+    return result;
+}
+
+std::vector<uint64_t> all(int p, int round) {
+    std::vector<uint64_t> result;
+    for (int src = 0; src < p; ++src) {
+        const std::vector<uint64_t> part = local(src, round);
+        result.insert(result.end(), part.begin(), part.end());
+    }
+    return result;
+}
+
+bool check_sized(const boost::mpi::communicator &comm, int round) {
+    const int p = comm.size(), rank = comm.rank();
+    const MPI_Datatype datatype = unsafe_mpi::transmit_datatype<uint64_t>();
+    const std::vector<uint64_t> in = local(rank, round), expected = all(p, round);
+    unsafe_mpi::workspace ws;
+    unsafe_mpi::exchange_sizes(comm, in.size(), ws);
+    bool ok = true;
+
+    for (auto algorithm : { allgatherv_algorithm::native, allgatherv_algorithm::ring,
+                            allgatherv_algorithm::bruck, allgatherv_algorithm::gather_broadcast }) {
+        std::vector<uint64_t> out(expected.size());
+        int status = unsafe_mpi::allgatherv_sized(comm, in.data(), in.size(), out.data(),
+                                                  datatype, ws, algorithm);
+        bool good = (status == 0 && out == expected);
+
+        // In place: the local block is already where it belongs
+        out.assign(expected.size(), 0);
+        std::copy(in.begin(), in.end(), out.begin() + ws.displacements64[rank]);
+        status = unsafe_mpi::allgatherv_sized(comm, MPI_IN_PLACE, 0, out.data(),
+                                              datatype, ws, algorithm);
+        good &= (status == 0 && out == expected);
+        if (!good) {
+            std::cerr << "allgatherv " << unsafe_mpi::name(algorithm)
+                      << " failed on PE " << rank << std::endl;
+        }
+        ok &= good;
+    }
+
+    for (auto algorithm : { gatherv_algorithm::native, gatherv_algorithm::tree }) {
+        bool good = true;
+        for (int root = 0; root < p; ++root) {
+            std::vector<uint64_t> out(rank == root ? expected.size() : 0);
+            const int status = unsafe_mpi::gatherv_sized(comm, in.data(), in.size(), out.data(),
+                                                         datatype, root, ws, algorithm);
+            good &= (status == 0 && (rank != root || out == expected));
+        }
+        if (!good) {
+            std::cerr << "gatherv " << unsafe_mpi::name(algorithm)
+                      << " failed on PE " << rank << std::endl;
+        }
+        ok &= good;
+    }
+    return ok;
+}
+
+// A table with a single entry picks its algorithm for every input on more
+// than two PEs
+bool check_tuned(const boost::mpi::communicator &comm, int round,
+                 allgatherv_algorithm allgatherv, gatherv_algorithm gatherv) {
+    const int p = comm.size(), rank = comm.rank();
+    unsafe_mpi::tuning_table &table = unsafe_mpi::tuning();
+    table.allgatherv = { { 1, 0, 0.0, static_cast<int>(allgatherv) } };
+    table.gatherv = { { 1, 0, 0.0, static_cast<int>(gatherv) } };
+
+    const std::vector<uint64_t> in = local(rank, round), expected = all(p, round);
+    unsafe_mpi::workspace ws;
+    std::vector<uint64_t> out;
+    unsafe_mpi::allgatherv(comm, in, out, ws);
+    bool ok = (out == expected);
+
+    out = in;
+    unsafe_mpi::allgatherv_in_place(comm, out, ws);
+    ok &= (out == expected);
+
+    const int root = (round + 2) % p;
+    out.clear();
+    unsafe_mpi::gatherv(comm, in, out, root, ws);
+    if (rank == root) ok &= (out == expected);
+
+    table = unsafe_mpi::tuning_table();
+    if (!ok) {
+        std::cerr << "tuned allgatherv " << unsafe_mpi::name(allgatherv) << " and gatherv "
+                  << unsafe_mpi::name(gatherv) << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+
+    bool ok = true;
+    for (int round = 0; round < 3; ++round) {
+        ok &= check_sized(world, round);
+        ok &= check_tuned(world, round, allgatherv_algorithm::ring, gatherv_algorithm::tree);
+        ok &= check_tuned(world, round, allgatherv_algorithm::bruck, gatherv_algorithm::native);
+        ok &= check_tuned(world, round, allgatherv_algorithm::gather_broadcast,
+                          gatherv_algorithm::tree);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+/*
+ * alltoallv_test.cpp  -- Serialized alltoallv of class types on several PEs
+ *
+ * Every destination's archive must carry Boost's class information of its
+ * own, otherwise all PEs but the first receive garbage.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+struct item {
+    int id;
+    std::string name;
+
+    bool operator==(const item &other) const {
+        return id == other.id && name == other.name;
+    }
+
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int) {
+        ar & id & name;
+    }
+};
+
+typedef std::vector<std::pair<int, std::string>> pairs;
+
+// Number of elements PE `src` sends to PE `dest`
+int count(int src, int dest) {
+    return (src + dest) % 3 + (dest == 1 ? 5000 : 0);
+}
+
+item make(int src, int dest, int i, item*) {
+    return item{ src * 1000 + dest, std::to_string(i) };
+}
+
+pairs make(int src, int dest, int i, pairs*) {
+    return pairs(static_cast<size_t>(i % 3), std::make_pair(src * 1000 + dest, std::string(i % 5, 'a')));
+}
+
+template <typename T>
+bool check(const boost::mpi::communicator &comm, const char *name) {
+    const int p = comm.size(), rank = comm.rank();
+    std::vector<std::vector<T>> per_dest(static_cast<size_t>(p));
+    std::vector<T> flat, expected;
+    std::vector<int> counts(static_cast<size_t>(p));
+    for (int dest = 0; dest < p; ++dest) {
+        for (int i = 0; i < count(rank, dest); ++i) {
+            per_dest[dest].push_back(make(rank, dest, i, static_cast<T*>(nullptr)));
+        }
+        counts[dest] = count(rank, dest);
+        flat.insert(flat.end(), per_dest[dest].begin(), per_dest[dest].end());
+    }
+    for (int src = 0; src < p; ++src) {
+        for (int i = 0; i < count(src, rank); ++i) {
+            expected.push_back(make(src, rank, i, static_cast<T*>(nullptr)));
+        }
+    }
+
+    std::vector<T> out;
+    bool ok = true;
+    unsafe_mpi::alltoallv(comm, per_dest, out);
+    ok &= (out == expected);
+    unsafe_mpi::alltoallv(comm, flat, counts, out);
+    ok &= (out == expected);
+    if (!ok) {
+        std::cerr << "alltoallv of " << name << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+
+    bool ok = check<item>(world, "item");
+    ok &= check<pairs>(world, "vector<pair<int,string>>");
+    return ok ? 0 : 1;
+}
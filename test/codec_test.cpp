@@ -0,0 +1,94 @@
+/*
+ * codec_test.cpp  -- Compressed allgatherv, gatherv, broadcast and send/recv
+ *
+ * Every operation must deliver the same data with a codec as without one,
+ * for inputs that compress well, ones that don't, and ones below the
+ * codec's threshold, which are sent raw.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+// Input of PE `rank` for data set `kind`: sorted keys with small gaps,
+// unsorted values with negative differences, a repetitive pattern, or a
+// handful of elements
+std::vector<int64_t> make(int rank, int kind) {
+    std::vector<int64_t> result;
+    const int n = (kind == 3) ? 5 : 3000 + 37 * rank;
+    for (int i = 0; i < n; ++i) {
+        switch (kind) {
+        case 0: result.push_back(rank * 100000 + 3 * i); break;
+        case 1: result.push_back((i * 7919) % 1000 - 500); break;
+        case 2: result.push_back(i % 16); break;
+        default: result.push_back(rank - i); break;
+        }
+    }
+    return result;
+}
+
+template <typename Codec>
+bool check(const boost::mpi::communicator &comm, const Codec &codec, const char *name) {
+    const int p = comm.size(), rank = comm.rank(), root = p / 2;
+    bool ok = true;
+    for (int kind = 0; kind < 4; ++kind) {
+        const std::vector<int64_t> in = make(rank, kind);
+        std::vector<int64_t> expected, out;
+        for (int src = 0; src < p; ++src) {
+            const std::vector<int64_t> part = make(src, kind);
+            expected.insert(expected.end(), part.begin(), part.end());
+        }
+
+        unsafe_mpi::allgatherv(comm, in, out, codec);
+        ok &= (out == expected);
+
+        out.clear();
+        unsafe_mpi::gatherv(comm, in, out, root, codec);
+        if (rank == root) ok &= (out == expected);
+
+        std::vector<int64_t> data;
+        if (rank == root) data = make(root, kind);
+        unsafe_mpi::broadcast(comm, data, root, codec);
+        ok &= (data == make(root, kind));
+
+        if (p > 1) {
+            const int right = (rank + 1) % p, left = (rank + p - 1) % p;
+            if (rank % 2 == 0) {
+                unsafe_mpi::send(comm, right, 3, in, codec);
+                unsafe_mpi::recv(comm, left, 3, out, codec);
+            } else {
+                unsafe_mpi::recv(comm, left, 3, out, codec);
+                unsafe_mpi::send(comm, right, 3, in, codec);
+            }
+            ok &= (out == make(left, kind));
+        }
+    }
+    if (!ok) {
+        std::cerr << "codec " << name << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+
+    bool ok = check(world, unsafe_mpi::codec::delta_varint(), "delta_varint");
+    ok &= check(world, unsafe_mpi::codec::delta_varint(0), "delta_varint without threshold");
+    ok &= check(world, unsafe_mpi::codec::lz(), "lz");
+    ok &= check(world, unsafe_mpi::codec::lz(0), "lz without threshold");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+/*
+ * in_place_test.cpp  -- In-place allgatherv and gatherv
+ *
+ * The local elements have to end up at their place among the others', also
+ * when some PEs contribute nothing, for plain and uninitialized vectors, and
+ * when reusing a workspace.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <tuple>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+// Twelve bytes, so it is sent as opaque blocks of its size
+typedef std::tuple<int32_t, int32_t, int32_t> triple;
+
+// PE 1 contributes nothing, the others a rank-dependent number of elements
+size_t count(int rank, int round) {
+    return rank == 1 ? 0 : static_cast<size_t>(2 * rank + round + 3);
+}
+
+triple make(int rank, size_t i) {
+    return triple(rank, static_cast<int32_t>(i), rank * 1000 + static_cast<int32_t>(i));
+}
+
+template <typename Vector>
+Vector local(int rank, int round) {
+    Vector result(count(rank, round));
+    for (size_t i = 0; i < result.size(); ++i) result[i] = make(rank, i);
+    return result;
+}
+
+std::vector<triple> all(int p, int round) {
+    std::vector<triple> result;
+    for (int src = 0; src < p; ++src) {
+        for (size_t i = 0; i < count(src, round); ++i) result.push_back(make(src, i));
+    }
+    return result;
+}
+
+template <typename Vector>
+bool same(const Vector &a, const std::vector<triple> &b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+template <typename Vector>
+bool check(const boost::mpi::communicator &comm, const char *name) {
+    const int p = comm.size(), rank = comm.rank();
+    unsafe_mpi::workspace ws;
+    bool ok = true;
+    for (int round = 0; round < 3; ++round) {
+        const std::vector<triple> expected = all(p, round);
+
+        Vector data = local<Vector>(rank, round);
+        unsafe_mpi::allgatherv_in_place(comm, data, ws);
+        ok &= same(data, expected);
+
+        // Every PE already knows all counts and has its elements in place
+        std::vector<size_t> counts;
+        size_t offset = 0;
+        for (int src = 0; src < p; ++src) {
+            counts.push_back(count(src, round));
+            if (src < rank) offset += counts.back();
+        }
+        data.assign(expected.size(), triple());
+        for (size_t i = 0; i < count(rank, round); ++i) data[offset + i] = make(rank, i);
+        unsafe_mpi::allgatherv_in_place(comm, data, counts, ws);
+        ok &= same(data, expected);
+
+        const int root = (p - 1 + round) % p;
+        data = local<Vector>(rank, round);
+        unsafe_mpi::gatherv_in_place(comm, data, root, ws);
+        if (rank == root) {
+            ok &= same(data, expected);
+        } else {
+            ok &= same(data, local<std::vector<triple>>(rank, round));
+        }
+    }
+    if (!ok) {
+        std::cerr << "in-place gather into " << name << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+
+    bool ok = check<std::vector<triple>>(world, "vector");
+    ok &= check<unsafe_mpi::uninitialized_vector<triple>>(world, "uninitialized_vector");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+/*
+ * nonblocking_test.cpp  -- Nonblocking operations completed out of order
+ *
+ * Requests are only advanced when they are tested or waited on, so waiting
+ * for them in a different order than they were started must not pair up the
+ * wrong messages, and different PEs waiting in different orders must not mix
+ * up collectives.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+// Message `which` of PE `src`, long enough to be split into chunks if the
+// tests are built with a small UNSAFE_MPI_MAX_COUNT
+std::vector<int> make(int src, int which, int*) {
+    std::vector<int> result(static_cast<size_t>(which == 0 ? 3 : 20 + src));
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = src * 1000 + which * 100 + static_cast<int>(i);
+    }
+    return result;
+}
+
+std::vector<std::string> make(int src, int which, std::string*) {
+    std::vector<std::string> result(static_cast<size_t>(which == 0 ? 2 : 10 + src));
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = std::to_string(src) + std::string(i, 'a' + which);
+    }
+    return result;
+}
+
+// Every PE sends two messages to PE 0, which receives them with two irecvs
+// per source that are waited on in reverse order, then once more with
+// MPI_ANY_SOURCE and test()
+template <typename T>
+bool check_irecv(const boost::mpi::communicator &comm, const char *name) {
+    const int p = comm.size(), rank = comm.rank(), tag = 7;
+    T *type = nullptr;
+    bool ok = true;
+
+    if (rank != 0) {
+        std::vector<T> first = make(rank, 0, type), second = make(rank, 1, type);
+        unsafe_mpi::request a = unsafe_mpi::isend(comm, 0, tag, first);
+        unsafe_mpi::request b = unsafe_mpi::isend(comm, 0, tag, second);
+        b.wait();
+        a.wait();
+    } else {
+        for (int src = 1; src < p; ++src) {
+            std::vector<T> first, second;
+            unsafe_mpi::request a = unsafe_mpi::irecv(comm, src, tag, first);
+            unsafe_mpi::request b = unsafe_mpi::irecv(comm, src, tag, second);
+            // Messages are matched in the order the irecvs were started
+            b.wait();
+            a.wait();
+            ok &= (first == make(src, 0, type) && second == make(src, 1, type));
+        }
+    }
+
+    if (rank != 0) {
+        std::vector<T> first = make(rank, 0, type), second = make(rank, 1, type);
+        unsafe_mpi::send(comm, 0, tag, first);
+        unsafe_mpi::send(comm, 0, tag, second);
+    } else {
+        std::vector<std::vector<T>> out(2 * static_cast<size_t>(p - 1));
+        std::vector<unsafe_mpi::request> reqs;
+        for (auto &o : out) {
+            reqs.push_back(unsafe_mpi::irecv(comm, MPI_ANY_SOURCE, tag, o));
+        }
+        // Poll the requests in reverse order, then finish them
+        size_t completed = 0;
+        while (completed < reqs.size()) {
+            completed = 0;
+            for (auto it = reqs.rbegin(); it != reqs.rend(); ++it) {
+                completed += it->test();
+            }
+        }
+        for (auto &r : reqs) r.wait();
+        std::multiset<std::vector<T>> expected, received(out.begin(), out.end());
+        for (int src = 1; src < p; ++src) {
+            expected.insert(make(src, 0, type));
+            expected.insert(make(src, 1, type));
+        }
+        ok &= (received == expected);
+    }
+
+    if (!ok) {
+        std::cerr << "irecv of " << name << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+
+// Element `i` of collective `which` contributed by PE `src`
+int element(int src, int which, size_t i, int*) {
+    return src * 1000 + which * 100 + static_cast<int>(i);
+}
+
+std::string element(int src, int which, size_t i, std::string*) {
+    return std::to_string(src) + std::string(i % 7, 'a' + which);
+}
+
+// Contribution of PE `src` to collective `which`, whose sizes differ so that
+// mixing up the two collectives garbles the results
+template <typename T>
+std::vector<T> contribution(int src, int which) {
+    std::vector<T> result(static_cast<size_t>(which == 0 ? src + 1 : 2 * src + 20));
+    for (size_t i = 0; i < result.size(); ++i) {
+        result[i] = element(src, which, i, static_cast<T*>(nullptr));
+    }
+    return result;
+}
+
+template <typename T>
+std::vector<T> concatenation(int p, int which) {
+    std::vector<T> result;
+    for (int src = 0; src < p; ++src) {
+        auto c = contribution<T>(src, which);
+        result.insert(result.end(), c.begin(), c.end());
+    }
+    return result;
+}
+
+// Start two of each nonblocking collective in the same order on all PEs, but
+// wait for them in an order that depends on the rank, so that the PEs start
+// their second phases in different orders
+template <typename T>
+bool check_collectives(const boost::mpi::communicator &comm, const char *name) {
+    const int p = comm.size(), rank = comm.rank(), root = p - 1;
+    const bool reverse = (rank % 2 == 1);
+    auto wait_both = [reverse](unsafe_mpi::request &a, unsafe_mpi::request &b) {
+        if (reverse) {
+            b.wait();
+            a.wait();
+        } else {
+            while (!a.test()) {}
+            a.wait();
+            b.wait();
+        }
+    };
+    bool ok = true;
+
+    {
+        std::vector<T> in0 = contribution<T>(rank, 0), in1 = contribution<T>(rank, 1), out0, out1;
+        unsafe_mpi::request a = unsafe_mpi::iallgatherv(comm, in0, out0);
+        unsafe_mpi::request b = unsafe_mpi::iallgatherv(comm, in1, out1);
+        wait_both(a, b);
+        ok &= (out0 == concatenation<T>(p, 0) && out1 == concatenation<T>(p, 1));
+    }
+    {
+        std::vector<T> in0 = contribution<T>(rank, 0), in1 = contribution<T>(rank, 1), out0, out1;
+        unsafe_mpi::request a = unsafe_mpi::igatherv(comm, in0, out0, root);
+        unsafe_mpi::request b = unsafe_mpi::igatherv(comm, in1, out1, root);
+        wait_both(a, b);
+        if (rank == root) {
+            ok &= (out0 == concatenation<T>(p, 0) && out1 == concatenation<T>(p, 1));
+        }
+    }
+    {
+        std::vector<T> data0, data1;
+        if (rank == root) {
+            data0 = contribution<T>(root, 0);
+            data1 = contribution<T>(root, 1);
+        }
+        unsafe_mpi::request a = unsafe_mpi::ibroadcast(comm, data0, root);
+        unsafe_mpi::request b = unsafe_mpi::ibroadcast(comm, data1, root);
+        wait_both(a, b);
+        ok &= (data0 == contribution<T>(root, 0) && data1 == contribution<T>(root, 1));
+    }
+
+    if (!ok) {
+        std::cerr << "nonblocking collectives of " << name << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+
+    bool ok = check_irecv<int>(world, "int");
+    ok &= check_irecv<std::string>(world, "string");
+    ok &= check_collectives<int>(world, "int");
+    ok &= check_collectives<std::string>(world, "string");
+    return ok ? 0 : 1;
+}
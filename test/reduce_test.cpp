@@ -0,0 +1,142 @@
+/*
+ * reduce_test.cpp  -- allreduce and reduce_scatter with native and ring
+ *                     algorithms
+ *
+ * Results are compared with a sequential reduction in rank order, for
+ * built-in, element-wise and user-defined operations, commutative or not,
+ * and for block sizes that don't divide evenly.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+#include <boost/mpi/operations.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+// Commutative, but not built into MPI, so large vectors take the ring
+struct xor_op {
+    uint32_t operator()(uint32_t a, uint32_t b) const { return a ^ b; }
+};
+
+// Composition of affine maps x -> a*x + b modulo a prime: associative, but
+// not commutative, so it must be applied in rank order
+typedef std::pair<int64_t, int64_t> affine;
+static const int64_t prime = 1000003;
+
+struct compose {
+    affine operator()(const affine &f, const affine &g) const {
+        return affine((f.first * g.first) % prime, (f.first * g.second + f.second) % prime);
+    }
+};
+
+int64_t scalar(int rank, size_t i) {
+    return static_cast<int64_t>((i * 7 + static_cast<size_t>(rank) * 13) % 101) - 50;
+}
+
+uint32_t bits(int rank, size_t i) {
+    return static_cast<uint32_t>(i * 2654435761u) ^ (static_cast<uint32_t>(rank) << 20);
+}
+
+std::pair<int, double> pair(int rank, size_t i) {
+    return std::make_pair(static_cast<int>((i + static_cast<size_t>(rank)) % 17),
+                          static_cast<double>(rank) - static_cast<double>(i % 5));
+}
+
+affine map(int rank, size_t i) {
+    return affine(static_cast<int64_t>(rank + 2), static_cast<int64_t>(i % 11 + 1));
+}
+
+// Input of PE `rank` and its reduction over PEs 0, ..., p-1 in rank order
+template <typename T, typename F, typename Op>
+void make(int p, int rank, size_t n, F f, const Op &op, std::vector<T> &in, std::vector<T> &total) {
+    in.resize(n);
+    total.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        in[i] = f(rank, i);
+        total[i] = f(0, i);
+        for (int src = 1; src < p; ++src) {
+            total[i] = op(total[i], f(src, i));
+        }
+    }
+}
+
+template <typename T, typename F, typename Op>
+bool check(const boost::mpi::communicator &comm, size_t n, F f, const Op &op,
+           unsafe_mpi::reduce_algorithm algorithm, const char *name) {
+    const int p = comm.size(), rank = comm.rank();
+    std::vector<T> in, total, out;
+    make(p, rank, n, f, op, in, total);
+    bool ok = true;
+
+    unsafe_mpi::allreduce(comm, in, out, op, algorithm);
+    ok &= (out == total);
+
+    // Even blocks
+    unsafe_mpi::reduce_scatter(comm, in, out, op, algorithm);
+    const size_t block = n / static_cast<size_t>(p), rest = n % static_cast<size_t>(p);
+    const size_t r = static_cast<size_t>(rank);
+    const size_t begin = r * block + std::min(r, rest), end = begin + block + (r < rest ? 1 : 0);
+    ok &= (out == std::vector<T>(total.begin() + begin, total.begin() + end));
+
+    // Uneven blocks: PE 0 gets nothing, the last PE the remainder
+    std::vector<size_t> counts(static_cast<size_t>(p));
+    size_t assigned = 0;
+    for (size_t i = 1; i < counts.size(); ++i) {
+        counts[i] = std::min(n - assigned, 2 * i + 1);
+        assigned += counts[i];
+    }
+    counts.back() += n - assigned;
+    if (p == 1) counts[0] = n;
+    size_t offset = 0;
+    for (size_t i = 0; i < r; ++i) offset += counts[i];
+    unsafe_mpi::reduce_scatter(comm, in, counts, out, op, algorithm);
+    ok &= (out == std::vector<T>(total.begin() + offset, total.begin() + offset + counts[r]));
+
+    if (!ok) {
+        std::cerr << "reduction " << name << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+namespace boost {
+namespace mpi {
+
+template <>
+struct is_commutative<xor_op, uint32_t> : public mpl::true_ {};
+
+}
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+    using unsafe_mpi::reduce_algorithm;
+    namespace ops = unsafe_mpi::ops;
+
+    bool ok = true;
+    for (auto algorithm : { reduce_algorithm::native, reduce_algorithm::ring }) {
+        ok &= check<int64_t>(world, 1003, scalar, ops::plus(), algorithm, "plus");
+        ok &= check<int64_t>(world, 1003, scalar, ops::max(), algorithm, "max");
+        ok &= check<std::pair<int, double>>(world, 517, pair, ops::min(), algorithm, "min of pairs");
+        ok &= check<uint32_t>(world, 777, bits, xor_op(), algorithm, "xor");
+    }
+    // The ring needs a commutative operation, so this one always runs natively
+    ok &= check<affine>(world, 333, map, compose(), reduce_algorithm::ring, "compose");
+    // Large enough for automatic to pick the ring
+    ok &= check<uint32_t>(world, (size_t(1) << 20) / sizeof(uint32_t) + 5, bits, xor_op(),
+                          reduce_algorithm::automatic, "xor, automatic");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * sort_test.cpp  -- Distributed sort with many equal keys
+ *
+ * The output must be sorted within and across PEs and contain exactly the
+ * input elements, for few distinct keys, all-equal keys, PEs without input,
+ * a custom comparator and a multithreaded local sort. With all keys equal,
+ * no PE may end up with much more than its share.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+// A key and the element's origin, which the comparators ignore, so that we
+// can tell whether equal keys arrive with their own payload
+typedef std::pair<uint32_t, uint32_t> element;
+
+struct key_less {
+    bool operator()(const element &a, const element &b) const { return a.first < b.first; }
+};
+
+struct key_greater {
+    bool operator()(const element &a, const element &b) const { return a.first > b.first; }
+};
+
+// Input of PE `rank` for data set `kind`: three distinct keys, all keys
+// equal, nothing on PE 1 and few keys elsewhere, or enough elements for the
+// local sort to use several threads
+std::vector<element> make(int rank, int kind) {
+    const uint32_t r = static_cast<uint32_t>(rank);
+    size_t n = 1000 + 77 * r;
+    if (kind == 2 && rank == 1) n = 0;
+    if (kind == 3) n = (size_t(1) << 17) + r;
+    std::vector<element> result(n);
+    for (size_t i = 0; i < n; ++i) {
+        const uint32_t index = static_cast<uint32_t>(i);
+        uint32_t key;
+        switch (kind) {
+        case 0: key = (index * 7 + r) % 3; break;
+        case 1: key = 42; break;
+        case 2: key = (index * 2654435761u) % 10; break;
+        default: key = (index * 2654435761u + r) % 1000; break;
+        }
+        result[i] = element(key, (r << 20) | index);
+    }
+    return result;
+}
+
+template <typename Compare>
+bool check(const boost::mpi::communicator &comm, int kind, Compare comp, size_t threads,
+           unsafe_mpi::workspace &ws) {
+    const int p = comm.size(), rank = comm.rank();
+    std::vector<element> data = make(rank, kind);
+    unsafe_mpi::sort(comm, data, comp, ws, threads);
+    bool ok = std::is_sorted(data.begin(), data.end(), comp);
+
+    // Globally sorted: no element on a later PE precedes one on this PE
+    std::vector<element> all, expected;
+    unsafe_mpi::allgatherv(comm, data, all);
+    ok &= std::is_sorted(all.begin(), all.end(), comp);
+
+    // Nothing lost, duplicated or separated from its payload
+    for (int src = 0; src < p; ++src) {
+        const std::vector<element> part = make(src, kind);
+        expected.insert(expected.end(), part.begin(), part.end());
+    }
+    std::sort(all.begin(), all.end());
+    std::sort(expected.begin(), expected.end());
+    ok &= (all == expected);
+
+    // Runs of equal keys are split between PEs
+    if (kind == 1) {
+        const size_t share = expected.size() / static_cast<size_t>(p);
+        ok &= (data.size() <= 2 * share);
+    }
+
+    if (!ok) {
+        std::cerr << "sort of data set " << kind << " with " << threads
+                  << " threads failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+    unsafe_mpi::workspace ws;
+
+    bool ok = true;
+    for (int kind = 0; kind < 3; ++kind) {
+        ok &= check(world, kind, key_less(), 1, ws);
+        ok &= check(world, kind, key_greater(), 1, ws);
+    }
+    ok &= check(world, 3, key_less(), 2, ws);
+
+    // The overload without a workspace and with the default comparator
+    std::vector<int> data(500, world.rank() % 2), all;
+    unsafe_mpi::sort(world, data);
+    unsafe_mpi::allgatherv(world, data, all);
+    if (!std::is_sorted(all.begin(), all.end()) || all.size() != 500 * size_t(world.size()) ||
+        std::count(all.begin(), all.end(), 1) != 500 * (world.size() / 2)) {
+        std::cerr << "sort with the default comparator failed on PE " << world.rank() << std::endl;
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+/*
+ * sparse_exchange_test.cpp  -- NBX exchanges with irregular neighborhoods
+ *
+ * Every PE sends to a few PEs that depend on the round, possibly itself and
+ * possibly an empty vector, and must receive exactly what the others sent
+ * it. Consecutive rounds alternate between two tags.
+ *
+ * Copyright (C) 2015 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ * Published under the Boost Software License, Version 1.0
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/environment.hpp>
+
+#define ERR std::cerr
+#include "unsafe_mpi.h"
+
+namespace {
+
+int value(int src, int dest, int round, size_t i, int*) {
+    return (src * 100 + dest) * 100 + round + static_cast<int>(i);
+}
+
+std::string value(int src, int dest, int round, size_t i, std::string*) {
+    return std::to_string(src) + ":" + std::to_string(dest) + std::string(i % 5, 'a' + round);
+}
+
+// What PE `src` sends in `round`: the destinations depend on the round, and
+// the message to the last one is empty in odd rounds
+template <typename T>
+std::map<int, std::vector<T>> outgoing(int src, int p, int round) {
+    std::map<int, std::vector<T>> result;
+    const int dests[3] = { (src + 1) % p, (src * src + round) % p, (src + 2 * round) % p };
+    for (int dest : dests) {
+        const size_t n = (round % 2 == 1 && dest == dests[2]) ? 0 : static_cast<size_t>(3 + src + dest);
+        std::vector<T> &msg = result[dest];
+        msg.clear();
+        for (size_t i = 0; i < n; ++i) {
+            msg.push_back(value(src, dest, round, i, static_cast<T*>(nullptr)));
+        }
+    }
+    return result;
+}
+
+template <typename T>
+bool check(const boost::mpi::communicator &comm, const char *name) {
+    const int p = comm.size(), rank = comm.rank();
+    unsafe_mpi::workspace ws;
+    bool ok = true;
+    for (int round = 0; round < 6; ++round) {
+        const int tag = unsafe_mpi::sparse_exchange_tag + round % 2;
+        auto in = unsafe_mpi::sparse_exchange(comm, outgoing<T>(rank, p, round), ws, tag);
+
+        std::map<int, std::vector<T>> expected;
+        for (int src = 0; src < p; ++src) {
+            auto out = outgoing<T>(src, p, round);
+            auto it = out.find(rank);
+            if (it != out.end()) expected[src] = it->second;
+        }
+        ok &= (in == expected);
+    }
+    if (!ok) {
+        std::cerr << "sparse_exchange of " << name << " failed on PE " << rank << std::endl;
+    }
+    return ok;
+}
+
+}
+
+int main(int argc, char **argv) {
+    boost::mpi::environment env(argc, argv);
+    boost::mpi::communicator world;
+
+    bool ok = check<int>(world, "int");
+    ok &= check<std::string>(world, "string");
+    return ok ? 0 : 1;
+}
@@ -10,7 +10,39 @@
 // Point-to-Point communication
 #include "include/point-to-point.h"
 
+// Handles for nonblocking operations
+#include "include/request.h"
+
+// Reusable scratch buffers for repeated calls
+#include "include/workspace.h"
+
+// Receive targets that are not zero-filled before receiving
+#include "include/output.h"
+
+// Opt-in wire format without padding for trivial types
+#include "include/packed.h"
+
+// Optional compression of trivial data
+#include "include/codec.h"
+
 // Collective communication
 #include "include/broadcast.h"
 #include "include/allgatherv.h"
+#include "include/alltoallv.h"
 #include "include/gatherv.h"
+#include "include/reduce.h"
+
+// Distributed sorting of trivial types
+#include "include/sort.h"
+
+// Sparse data exchange with neighbors that are only known at runtime
+#include "include/sparse_exchange.h"
+
+// Node-aware collectives with results in shared memory
+#include "include/hierarchical.h"
+
+// Persistent collectives for repeated calls with the same sizes
+#include "include/plan.h"
+
+// Optional instrumentation, enable with -DUNSAFE_MPI_INSTRUMENT
+#include "include/instrumentation.h"